@@ -0,0 +1,211 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+// Speed and accuracy of the Wiener shrinkage (see WienerFunc in SIMD.h) for each instruction set level and wiener_mode,
+// over the groups of the block sizes and group sizes of the profiles.
+// The relative error of the coefficients and of the returned sum is measured against double precision,
+// and checked against the bound documented for the mode. Returns 1 when any bound is exceeded.
+
+
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "SIMD.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+static const char *const LevelNames[] = { "C", "SSE2", "AVX2", "AVX-512" };
+static const char *const ModeNames[] = { "0 fast", "1 refined", "2 exact" };
+
+
+// Bound of the relative error of the coefficients: the approximate reciprocal of SSE2 and AVX2 is within 1.5 * 2^-12,
+// the one of AVX-512 within 2^-14, a Newton-Raphson step squares it, and the rest is float rounding
+static double ErrorBound(SIMDLevel level, WienerMode mode)
+{
+    if (level != SIMDLevel::None && mode == WienerMode::Fast)
+    {
+        return level == SIMDLevel::AVX512 ? 6.2e-5 : 3.7e-4;
+    }
+
+    if (level != SIMDLevel::None && mode == WienerMode::Refined)
+    {
+        return 3e-7;
+    }
+
+    return 2e-7;
+}
+
+
+// Coefficients of a transformed group: most of them around the noise level, a few of them much larger
+static void Generate(FLType *src, FLType *ref, PCType size, std::mt19937 &rng)
+{
+    std::normal_distribution<FLType> noise(0, 1);
+    std::exponential_distribution<FLType> signal(0.05f);
+    std::bernoulli_distribution large(0.1);
+
+    for (PCType k = 0; k < size; ++k)
+    {
+        ref[k] = noise(rng) + (large(rng) ? signal(rng) : 0);
+        src[k] = ref[k] + noise(rng);
+    }
+}
+
+
+// Nanoseconds per call of func, the fastest of several runs
+template < typename _Fn >
+static double Measure(int iterations, _Fn &&func)
+{
+    double best = 0;
+
+    for (int run = 0; run < 5; ++run)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        for (int n = 0; n < iterations; ++n)
+        {
+            func(n);
+        }
+
+        const double time = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / iterations;
+
+        if (run == 0 || time < best)
+        {
+            best = time;
+        }
+    }
+
+    return best;
+}
+
+
+int main()
+{
+    // block_size, group_size of the profiles
+    const PCType groups[][2] = { { 8, 8 }, { 8, 16 }, { 8, 32 }, { 11, 32 } };
+    const FLType sigma_sqr = 1;
+    const SIMDLevel cpu = SIMDLevel_CPU();
+    int failed = 0;
+
+    std::mt19937 rng(1);
+    volatile FLType sink = 0;
+
+    printf("%-8s %-8s %-10s %12s %12s %12s %12s\n", "group", "level", "mode", "ns/call", "coef error", "sum error", "bound");
+
+    for (const auto &g : groups)
+    {
+        const PCType size = g[0] * g[0] * g[1];
+        FLType *src = nullptr, *ref = nullptr, *dst = nullptr, *exact = nullptr;
+
+        AlignedMalloc(src, size);
+        AlignedMalloc(ref, size);
+        AlignedMalloc(dst, size);
+        AlignedMalloc(exact, size);
+        Generate(src, ref, size, rng);
+
+        // Reference coefficients and sum in double precision
+        std::vector<double> coef(size);
+        double sum = 0;
+
+        for (PCType k = 0; k < size; ++k)
+        {
+            const double r2 = static_cast<double>(ref[k]) * ref[k];
+            coef[k] = r2 / (r2 + sigma_sqr);
+            sum += coef[k] * coef[k];
+        }
+
+        // The group is copied back before every call, thus the time of a copy alone is subtracted
+        const int iterations = Max(1000, 20000000 / size);
+
+        const double copy = Measure(iterations, [&](int n)
+        {
+            memcpy(dst, src, sizeof(FLType) * size);
+            sink = sink + dst[n % size];
+        });
+
+        for (int l = 0; l <= static_cast<int>(cpu); ++l)
+        {
+            const SIMDLevel level = static_cast<SIMDLevel>(l);
+
+            for (int m = 0; m < 3; ++m)
+            {
+                const WienerMode mode = static_cast<WienerMode>(m);
+                const WienerFunc func = Wiener_Func(level, mode);
+
+                const double time = Measure(iterations, [&](int)
+                {
+                    memcpy(dst, src, sizeof(FLType) * size);
+                    sink = sink + func(dst, ref, size, sigma_sqr);
+                });
+
+                // The filtered coefficients divided by the source ones give back the Wiener coefficients
+                memcpy(dst, src, sizeof(FLType) * size);
+                const double result = func(dst, ref, size, sigma_sqr);
+                double error = 0;
+
+                for (PCType k = 0; k < size; ++k)
+                {
+                    if (src[k] != 0 && coef[k] > 0)
+                    {
+                        error = Max(error, std::abs(dst[k] / static_cast<double>(src[k]) - coef[k]) / coef[k]);
+                    }
+                }
+
+                const double sum_error = std::abs(result - sum) / sum;
+                const double bound = ErrorBound(level, mode);
+                bool ok = error <= bound;
+
+                // The exact mode gives the same results at every level
+                if (mode == WienerMode::Exact)
+                {
+                    if (level == SIMDLevel::None)
+                    {
+                        memcpy(exact, dst, sizeof(FLType) * size);
+                    }
+                    else if (memcmp(exact, dst, sizeof(FLType) * size))
+                    {
+                        printf("%dx%dx%d %s: the exact mode differs from C\n", g[0], g[0], g[1], LevelNames[l]);
+                        ok = false;
+                    }
+                }
+
+                failed += !ok;
+
+                printf("%2dx%-2dx%-2d %-8s %-10s %12.1f %12.2e %12.2e %12.2e%s\n", g[0], g[0], g[1], LevelNames[l], ModeNames[m],
+                    time - copy, error, sum_error, bound, ok ? "" : "  FAILED");
+            }
+        }
+
+        AlignedFree(src);
+        AlignedFree(ref);
+        AlignedFree(dst);
+        AlignedFree(exact);
+    }
+
+    return failed > 0 ? 1 : 0;
+}
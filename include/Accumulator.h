@@ -0,0 +1,160 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef ACCUMULATOR_H_
+#define ACCUMULATOR_H_
+
+
+#include <limits>
+#include <vector>
+#include "Helper.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Rows of reference blocks of a plane split into chunks for the threads of a frame, see Accumulator::Chunks
+struct ChunkLayout
+{
+    std::vector<PCType> rows;
+
+    // Index of the first row of each chunk followed by rows.size()
+    std::vector<size_t> chunks;
+
+    // Rows of pixels only reached by each chunk
+    std::vector<PCType> top;
+    std::vector<PCType> bottom;
+
+    // Most rows of blocks each chunk may defer
+    std::vector<size_t> deferred;
+
+    size_t count() const { return chunks.size() - 1; }
+};
+
+
+// Numerator and denominator of the estimate of one plane, to which a chunk of rows of reference blocks adds its filtered blocks.
+// The rows in [top, bottom) are only reached by the blocks of this chunk and are added to directly.
+// The other rows are also reached by the neighbouring chunks, so their values are deferred and added by Merge
+// in the order of the chunks, which keeps each sum in the same order as the serial scan.
+// The planes of several frames may share an accumulator, each frame frame_step values after the previous one.
+// The storage of the deferred rows is kept for the following frames, so that a frame in steady state doesn't allocate.
+class Accumulator
+{
+public:
+    typedef Accumulator _Myt;
+    typedef Pos PosType;
+
+    // Chunks of rows handed out to each thread of a frame, more than one so that the threads can balance the work
+    static const size_t ChunksPerThread = 4;
+
+private:
+    FLType *num_ = nullptr;
+    FLType *den_ = nullptr;
+    PCType stride_ = 0;
+    size_t frame_step_ = 0;
+    PCType top_ = 0;
+    PCType bottom_ = std::numeric_limits<PCType>::max();
+
+    // Offset of each deferred row, and its values followed by the numerator weight and the denominator weight
+    std::vector<size_t> offset_;
+    std::vector<FLType> data_;
+
+public:
+    Accumulator() {}
+
+    // Add to the planes num and den of the first frame, the deferred rows left by a failed frame are dropped
+    void Reset(FLType *num, FLType *den, PCType stride, size_t frame_step = 0)
+    {
+        num_ = num;
+        den_ = den;
+        stride_ = stride;
+        frame_step_ = frame_step;
+        offset_.clear();
+        data_.clear();
+    }
+
+    // Only the rows of pixels in [top, bottom) are added to directly, the storage is kept for deferred rows of blocks
+    void Bound(PCType top, PCType bottom, size_t deferred, PCType BlockSize)
+    {
+        top_ = top;
+        bottom_ = bottom;
+        Reserve(offset_, deferred);
+        Reserve(data_, deferred * (BlockSize + 2));
+    }
+
+    // Add the block of BlockSize x BlockSize values at pos of the frame, weighted by numWeight, and denWeight to the denominator
+    void Add(const PosType &pos, const FLType *block, PCType BlockSize, FLType numWeight, FLType denWeight, int frame = 0)
+    {
+        const size_t offset = frame * frame_step_ + static_cast<size_t>(pos.y) * stride_ + pos.x;
+
+        for (PCType y = 0; y < BlockSize; ++y, block += BlockSize)
+        {
+            const PCType row = pos.y + y;
+
+            if (row >= top_ && row < bottom_)
+            {
+                AddRow(offset + static_cast<size_t>(y) * stride_, block, BlockSize, numWeight, denWeight);
+            }
+            else
+            {
+                offset_.push_back(offset + static_cast<size_t>(y) * stride_);
+                data_.insert(data_.end(), block, block + BlockSize);
+                data_.push_back(numWeight);
+                data_.push_back(denWeight);
+            }
+        }
+    }
+
+    // Add the deferred rows, their storage is kept
+    void Merge(PCType BlockSize);
+
+    // The accumulators of the plane of the calling thread, grown to at least count
+    static std::vector<_Myt> &Local(int plane, size_t count);
+
+    // Split layout.rows, the rows of reference blocks of a plane, into chunks for the threads.
+    // reach is the largest vertical distance between a reference block and its matched blocks,
+    // and each reference block is filtered in a group of at most GroupSize blocks.
+    // The chunks are kept high enough for most of their pixels to be added to directly.
+    static void Chunks(ChunkLayout &layout, size_t threads, PCType reach,
+        PCType height, PCType width, PCType BlockSize, PCType BlockStep, PCType GroupSize);
+
+private:
+    void AddRow(size_t offset, const FLType *srcp, PCType BlockSize, FLType numWeight, FLType denWeight)
+    {
+        FLType *nump = num_ + offset;
+        FLType *denp = den_ + offset;
+
+        for (PCType x = 0; x < BlockSize; ++x)
+        {
+            nump[x] += srcp[x] * numWeight;
+            denp[x] += denWeight;
+        }
+    }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
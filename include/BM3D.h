@@ -27,9 +27,11 @@
 
 
 #include <memory>
-#include "fftw3_helper.hpp"
+#include <mutex>
+#include "PlanCache.h"
 #include "Conversion.hpp"
 #include "Block.h"
+#include "DCT.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -62,38 +64,122 @@ struct BM3D_FilterData
 {
     typedef BM3D_FilterData _Myt;
 
-    typedef fftwh<FLType> fftw;
+    typedef PlanCache::fftw fftw;
+    typedef PlanCache::plan_ptr plan_ptr;
 
-    std::vector<fftw::plan> fp;
-    std::vector<fftw::plan> bp;
-    std::vector<double> finalAMP;
-    std::vector<std::shared_ptr<const FLType>> thrTable;
-    std::vector<FLType> wienerSigmaSqr;
+    // Transform along the group axis: 0 - DCT, 1 - Haar, 2 - Walsh-Hadamard
+    // The latter two only take groups of power-of-2 sizes, and the 2D transforms of the blocks are planned instead of the 3D ones
+    int group_transform = 0;
+    PCType block_size = 0;
 
-    BM3D_FilterData() {}
+private:
+    // The state depending on the group size, built on the first request for the size (see Size), since a frame only
+    // produces a handful of group sizes
+    struct SizeData
+    {
+        std::once_flag once;
 
-    BM3D_FilterData(bool wiener, double sigma, PCType GroupSize, PCType BlockSize, double lambda);
+        // The plans are shared with the other planes and filter instances through PlanCache
+        plan_ptr fp;
+        plan_ptr bp;
 
-    BM3D_FilterData(const _Myt &right) = delete;
+        // With the transform cache, the forward 3D transform is split into the 2D transform of each block (see TransformCache)
+        // and the 1D transforms along the group axis
+        plan_ptr fp1d;
+
+        double finalAMP = 0;
+        std::shared_ptr<const FLType> thrTable;
+        FLType wienerSigmaSqr = 0;
+
+        // Backward transform of each coefficient along the group axis, the row z is the one of the coefficient z,
+        // only for hard-thresholding
+        std::vector<FLType> groupBasis;
+    };
+
+    bool wiener = false;
+    double sigma = 0;
+    double lambda = 0;
+    unsigned plan_flags = 0;
+
+    // Whether the 3D transforms and the 1D transforms are planned by FFTW
+    bool plan3d = false;
+    bool plan1d = false;
+
+    std::unique_ptr<SizeData[]> sizes;
+
+    plan_ptr fp2d;
+    plan_ptr bp2d;
+
+    // Replaces all the plans for the block sizes it's specialized for, null otherwise
+    std::shared_ptr<const BlockDCT> dct;
+
+    // Backward DCT of each coefficient along a block axis, the row u is the one of the coefficient u, only for hard-thresholding
+    std::vector<FLType> blockBasis;
+
+public:
+    BM3D_FilterData() {}
 
-    BM3D_FilterData(_Myt &&right)
-        : fp(std::move(right.fp)), bp(std::move(right.bp)),
-        finalAMP(std::move(right.finalAMP)), thrTable(std::move(right.thrTable)),
-        wienerSigmaSqr(std::move(right.wienerSigmaSqr))
-    {}
+    // PlanFlags is one of the planner flags of FFTW, FFTW_ESTIMATE, FFTW_MEASURE, FFTW_PATIENT, etc.
+    BM3D_FilterData(bool wiener, double sigma, PCType GroupSize, PCType BlockSize, double lambda,
+        int GroupTransform, SIMDLevel simd, bool cache, unsigned PlanFlags);
 
+    BM3D_FilterData(const _Myt &right) = delete;
+    BM3D_FilterData(_Myt &&right) = default;
     _Myt &operator=(const _Myt &right) = delete;
+    _Myt &operator=(_Myt &&right) = default;
 
-    _Myt &operator=(_Myt &&right)
+    // Number of blocks filtered from a group of GroupSize matched blocks, rounded down to a power of 2 for Haar and Walsh-Hadamard
+    PCType FitGroupSize(PCType GroupSize) const
     {
-        fp = std::move(right.fp);
-        bp = std::move(right.bp);
-        finalAMP = std::move(right.finalAMP);
-        thrTable = std::move(right.thrTable);
-        wienerSigmaSqr = std::move(right.wienerSigmaSqr);
+        if (group_transform == 0)
+        {
+            return GroupSize;
+        }
+
+        PCType size = 1;
+        while (size * 2 <= GroupSize) size *= 2;
+        return size;
+    }
+
+    // Amplification of the unnormalized 3D transform round trip
+    double FinalAMP(PCType GroupSize) const { return Size(GroupSize).finalAMP; }
 
-        return *this;
+    // Hard threshold of each coefficient of the 3D transform, only for the basic estimate
+    const FLType *ThrTable(PCType GroupSize) const { return Size(GroupSize).thrTable.get(); }
+
+    // Noise power in the 3D transform domain, only for the final estimate
+    FLType WienerSigmaSqr(PCType GroupSize) const { return Size(GroupSize).wienerSigmaSqr; }
+
+    // Groups laid out one after another are padded to keep the alignment of the first one
+    size_t GroupStride(PCType GroupSize) const
+    {
+        return (static_cast<size_t>(GroupSize) * block_size * block_size + 15) / 16 * 16;
     }
+
+    // Groups with at most SparseLimit non-zero coefficients left by hard-thresholding are transformed backward
+    // by the sum of the basis functions of those coefficients, which costs less than the whole backward transform
+    static const PCType SparseLimit = 3;
+
+    // In-place transforms of a group of GroupSize blocks, and of a single block for the 2D transform
+    void Forward(FLType *data, PCType GroupSize) const;
+    void Backward(FLType *data, PCType GroupSize) const;
+    void Forward2D(FLType *block) const;
+    void Backward2D(FLType *block) const;
+    void Forward1D(FLType *data, PCType GroupSize) const;
+
+    // Backward transform of a group with the given number of non-zero coefficients, same as Backward,
+    // return false without touching the group if it isn't sparse enough
+    bool BackwardSparse(FLType *data, PCType GroupSize, PCType nonzero) const;
+
+private:
+    // Thread-safe, the state of each size is built once
+    const SizeData &Size(PCType GroupSize) const;
+
+    void BuildSize(SizeData &size, PCType GroupSize) const;
+
+    // Butterflies along the group axis, each one transforms the pair of blocks (i, i + s) of the given pixels,
+    // which defaults to block_size * block_size
+    void GroupButterflies(FLType *data, PCType GroupSize, bool forward, PCType pixels = 0) const;
 };
 
 
@@ -26,10 +26,18 @@
 #define BM3D_BASE_H_
 
 
-#include <shared_mutex>
-#include <thread>
-#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include "Accumulator.h"
 #include "BM3D.h"
+#include "BufferPool.h"
+#include "FullSearch.h"
+#include "HierarchicalSearch.h"
+#include "PlaneArena.h"
+#include "PredictiveSearch.h"
+#include "ThreadPool.h"
+#include "TransformCache.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -50,13 +58,27 @@ public:
 
     bool wiener;
     ColorMatrix matrix;
+    SIMDLevel simd = SIMDLevel::None;
+    int bm_mode = 0;
+    int dct_cache = 0;
+    int group_transform = 0;
+    std::string wisdom;
+    int plan_flags = 2;
+    int threads = 1;
+
+    // Workers filtering the chunks of a frame along with the calling thread, null when threads is 1
+    std::shared_ptr<ThreadPool> pool;
 
     _Mypara para_default;
     _Mypara para;
     std::vector<BM3D_FilterData> f;
 
-    std::shared_mutex mutex0, mutex1, mutex2;
-    std::unordered_map<std::thread::id, FLType *> buffer0, buffer1, buffer2;
+    // Denominators of the estimate of each plane, reused by the frames filtered concurrently
+    BufferPool buffer[VSMaxPlaneCount];
+
+    // Chunks of the rows of reference blocks, the same for every frame, built by the first one
+    std::once_flag layout_once;
+    ChunkLayout layout;
 
 public:
     explicit BM3D_Data_Base(bool _wiener,
@@ -74,18 +96,7 @@ public:
     {
         if (rdef && rnode) vsapi->freeNode(rnode);
 
-        for (auto &e : buffer0)
-        {
-            AlignedFree(e.second);
-        }
-        for (auto &e : buffer1)
-        {
-            AlignedFree(e.second);
-        }
-        for (auto &e : buffer2)
-        {
-            AlignedFree(e.second);
-        }
+        if (!wisdom.empty()) PlanCache::ExportWisdom(wisdom);
     }
 
     virtual int arguments_process(const VSMap *in, VSMap *out) override;
@@ -118,9 +129,19 @@ public:
     typedef block_type::KeyCode KeyCode;
     typedef block_type::PosCode PosCode;
     typedef block_type::PosPairCode PosPairCode;
+    typedef block_type::PosPairTopK PosPairTopK;
 
     typedef BlockGroup<FLType, FLType> block_group;
 
+    // Search engines and matched code of a worker thread, kept for its following frames
+    struct Workspace
+    {
+        FullSearch fs;
+        HierarchicalSearch hs;
+        PredictiveSearch ps;
+        PosPairTopK matchCode;
+    };
+
 private:
     _Mydata &d;
 
@@ -135,10 +156,18 @@ protected:
 
     bool full = true;
 
+    // Reference Y plane of integer input used directly by block matching, null when it runs on the floating point plane
+    const uint8_t *ref_int8 = nullptr;
+    const uint16_t *ref_int16 = nullptr;
+    PCType ref_int_range = 0;
+
 private:
     template < typename _Ty >
     void process_core();
 
+    template < typename _Ty >
+    bool IntegerMatching(const _Ty *refY);
+
     template < typename _Ty >
     void process_core_gray();
 
@@ -222,18 +251,80 @@ protected:
         _NewFrame(width, height, dfi == fi);
     }
 
+    // The workspace of the calling thread
+    static Workspace &Local();
+
     void Kernel(FLType *dst, const FLType *src, const FLType *ref) const;
 
     void Kernel(FLType *dstY, FLType *dstU, FLType *dstV,
         const FLType *srcY, const FLType *srcU, const FLType *srcV,
         const FLType *refY, const FLType *refU, const FLType *refV) const;
 
-    PosPairCode BlockMatching(const FLType *ref, PCType j, PCType i) const;
+    // Vertical positions of the rows of reference blocks in scan order
+    std::vector<PCType> ReferenceRows() const;
+
+    // The rows of reference blocks split into chunks for the threads, see Accumulator::Chunks
+    const ChunkLayout &Layout() const;
+
+    // Largest vertical distance between a reference block and its matched blocks
+    PCType MatchReach() const;
+
+    // Whether block matching runs on the incremental full-search engine, which doesn't need the block moments
+    bool FullSearchApplicable() const;
+
+    // The engines and the caches take their buffers from the scratch of the worker,
+    // the engines are kept in the workspace of its thread
+
+    // Incremental full-search engine for the reference plane, null when block matching is skipped or it doesn't pay off
+    FullSearch *FullSearchEngine(Workspace &ws, const FLType *ref, PlaneArena::Frame &scratch) const;
+
+    // Coarse-to-fine engine for the reference plane, null unless bm_mode is 1
+    HierarchicalSearch *HierarchicalEngine(Workspace &ws, const FLType *ref, PlaneArena::Frame &scratch) const;
+
+    // Predictive engine for the reference plane, null unless bm_mode is 2
+    PredictiveSearch *PredictiveEngine(Workspace &ws, const FLType *ref, PlaneArena::Frame &scratch) const;
+
+    // Block moments of the reference plane for pruning the window search, null when block matching is skipped
+    const BlockMoments *BlockMomentsMap(std::optional<BlockMoments> &moments, const FLType *ref, PlaneArena::Frame &scratch) const;
+
+    // 2D-transform cache of a source or reference plane for collaborative filtering, null unless dct_cache is 1
+    TransformCache *TransformCacheMap(std::optional<TransformCache> &cache, const FLType *src,
+        PCType height, PCType width, PCType stride, int plane, PlaneArena::Frame &scratch) const;
+
+    // The matched code is collected in place, match_code is reused for every reference block in a thread
+    void BlockMatching(PosPairTopK &match_code, const FLType *ref, PCType j, PCType i,
+        FullSearch *fs = nullptr, HierarchicalSearch *hs = nullptr, PredictiveSearch *ps = nullptr,
+        const BlockMoments *moments = nullptr) const;
+
+    template < typename _St1 >
+    void WindowMatching(PosPairTopK &match_code, const _St1 *ref, _St1 ref_range, PCType j, PCType i,
+        const BlockMoments *moments) const;
+
+    // Construct the group guided by matched pos code and apply forward 3D transform to it,
+    // the group is a view over buffer of GroupStride(para.GroupSize) values
+    block_group ForwardGroup(int plane, FLType *buffer, const FLType *src, PCType stride, TransformCache *cache,
+        const PosPairCode &code, PCType GroupSize) const;
+
+    // Number of the matched blocks taken into the group
+    PCType FilterGroupSize(int plane, const PosPairCode &code) const;
 
-    virtual void CollaborativeFilter(int plane,
-        FLType *ResNum, FLType *ResDen,
+    // buffer holds the group (2 with the reference group) each of GroupStride(para.GroupSize) values
+    void CollaborativeFilter(int plane, Accumulator &acc,
         const FLType *src, const FLType *ref,
-        const PosPairCode &code) const = 0;
+        TransformCache *srcCache, TransformCache *refCache,
+        FLType *buffer, const PosPairCode &code) const;
+
+    // Same as CollaborativeFilter for the 3 planes at once, the groups of the planes are gathered in one pass over the matched blocks
+    // and aggregated in another, buffer holds the 3 groups (6 with the reference groups) each of GroupStride(para.GroupSize) values
+    void CollaborativeFilter3(Accumulator *const *acc,
+        const FLType *const *src, const FLType *const *ref,
+        TransformCache *const *srcCache, TransformCache *const *refCache,
+        FLType *buffer, const PosPairCode &code) const;
+
+    // Filter the transformed source group in place, guided by the transformed reference group for the final estimate,
+    // and return the weight of the filtered group
+    // inverted is set when the filter has also applied the backward 3D transform, which is left to the caller otherwise
+    virtual FLType FilterGroup(int plane, FLType *srcData, const FLType *refData, PCType GroupSize, bool &inverted) const = 0;
 };
 
 
@@ -77,10 +77,7 @@ public:
     virtual ~BM3D_Basic_Process() override {}
 
 protected:
-    virtual void CollaborativeFilter(int plane,
-        FLType *ResNum, FLType *ResDen,
-        const FLType *src, const FLType *ref,
-        const PosPairCode &code) const override;
+    virtual FLType FilterGroup(int plane, FLType *srcData, const FLType *refData, PCType GroupSize, bool &inverted) const override;
 };
 
 
@@ -39,6 +39,10 @@ public:
     typedef BM3D_Final_Data _Myt;
     typedef BM3D_Data_Base _Mybase;
 
+public:
+    // Empirical Wiener shrinkage selected by the instruction set and wiener_mode
+    WienerFunc wiener_filter = nullptr;
+
 public:
     BM3D_Final_Data(const VSAPI *_vsapi = nullptr, std::string _FunctionName = "Final", std::string _NameSpace = "bm3d")
         : _Mybase(true, _vsapi, _FunctionName, _NameSpace)
@@ -77,10 +81,7 @@ public:
     virtual ~BM3D_Final_Process() override {}
 
 protected:
-    virtual void CollaborativeFilter(int plane,
-        FLType *ResNum, FLType *ResDen,
-        const FLType *src, const FLType *ref,
-        const PosPairCode &code) const override;
+    virtual FLType FilterGroup(int plane, FLType *srcData, const FLType *refData, PCType GroupSize, bool &inverted) const override;
 };
 
 
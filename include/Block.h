@@ -29,6 +29,228 @@
 #include <vector>
 #include <algorithm>
 #include "Helper.h"
+#include "SIMD.h"
+#include "BlockMoments.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Fixed-capacity container of the smallest elements pushed into it, used to collect matched blocks in place.
+// The first "fixed" elements are always kept at the front and count towards the capacity.
+// The others are kept in the order of insertion until the capacity is exceeded,
+// from then on they form a max-heap, so that each push costs O(log(capacity)) at most.
+template < typename _Ty,
+    typename _Compare = KeyPairLess >
+class TopK
+{
+public:
+    typedef TopK<_Ty, _Compare> _Myt;
+    typedef _Ty value_type;
+    typedef std::vector<value_type> container_type;
+
+private:
+    container_type data_;
+    size_t capacity_ = 0;
+    size_t fixed_ = 0;
+    bool heap_ = false;
+    bool truncated_ = false;
+    _Compare comp_;
+
+public:
+    // Remove all the elements, capacity 0 means no limit.
+    // The storage is kept, thus a container reused for each reference block doesn't allocate in the hot path.
+    void reset(size_t capacity)
+    {
+        data_.clear();
+        Reserve(data_, capacity);
+        capacity_ = capacity;
+        fixed_ = 0;
+        heap_ = false;
+        truncated_ = false;
+    }
+
+    // Only valid before any element is pushed by push()
+    void push_fixed(const value_type &value)
+    {
+        data_.push_back(value);
+        ++fixed_;
+    }
+
+    // Returns whether the element is kept
+    bool push(const value_type &value)
+    {
+        if (capacity_ == 0 || data_.size() < capacity_)
+        {
+            data_.push_back(value);
+            return true;
+        }
+
+        truncated_ = true;
+
+        if (closed() || !comp_(value, top()))
+        {
+            return false;
+        }
+
+        std::pop_heap(data_.begin() + fixed_, data_.end(), comp_);
+        data_.back() = value;
+        std::push_heap(data_.begin() + fixed_, data_.end(), comp_);
+
+        return true;
+    }
+
+    bool full() const
+    {
+        return capacity_ > 0 && data_.size() >= capacity_;
+    }
+
+    // No element can be kept any more, since the capacity is taken by the fixed elements
+    bool closed() const
+    {
+        return full() && data_.size() == fixed_;
+    }
+
+    // Whether any element has been dropped
+    bool truncated() const
+    {
+        return truncated_;
+    }
+
+    // The largest element that is not fixed, only valid when full and not closed
+    const value_type &top()
+    {
+        if (!heap_)
+        {
+            std::make_heap(data_.begin() + fixed_, data_.end(), comp_);
+            heap_ = true;
+        }
+
+        return data_[fixed_];
+    }
+
+    // Sort the elements that are not fixed in ascending order
+    void sort()
+    {
+        if (heap_)
+        {
+            std::sort_heap(data_.begin() + fixed_, data_.end(), comp_);
+        }
+        else
+        {
+            std::sort(data_.begin() + fixed_, data_.end(), comp_);
+        }
+
+        heap_ = false;
+    }
+
+    size_t size() const
+    {
+        return data_.size();
+    }
+
+    size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    const container_type &get() const
+    {
+        return data_;
+    }
+
+    container_type &get()
+    {
+        return data_;
+    }
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Set of block positions in a plane, used to merge overlapping search windows without duplicates.
+// Each position has a stamp, and it's in the set if the stamp equals the current generation,
+// thus the set is cleared by starting a new generation, and a grid reused for each reference block doesn't allocate in the hot path.
+// The stamps are allocated by the grid, unless it's bound to the storage of the caller.
+class SearchPosGrid
+{
+public:
+    typedef SearchPosGrid _Myt;
+    typedef std::vector<Pos> container_type;
+
+private:
+    std::vector<uint32_t> own_;
+    uint32_t *stamp_ = nullptr;
+    PCType height_ = 0;
+    PCType width_ = 0;
+    uint32_t generation_ = 0;
+    container_type pos_;
+
+public:
+    SearchPosGrid() {}
+
+    SearchPosGrid(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    // Take the stamps of a plane of height x width block positions from stamp, which must outlive the grid
+    void bind(uint32_t *stamp, PCType height, PCType width)
+    {
+        own_.clear();
+        own_.shrink_to_fit();
+        stamp_ = stamp;
+        height_ = height;
+        width_ = width;
+        std::fill_n(stamp_, static_cast<size_t>(height_) * width_, 0);
+        generation_ = 0;
+    }
+
+    // Remove all the positions, the plane has height x width block positions
+    void reset(PCType height, PCType width)
+    {
+        if (height != height_ || width != width_)
+        {
+            const RetainedAllocations retained;
+            height_ = height;
+            width_ = width;
+            own_.assign(static_cast<size_t>(height_) * width_, 0);
+            stamp_ = own_.data();
+            generation_ = 0;
+        }
+
+        // All the stamps are cleared once the generation wraps around
+        if (++generation_ == 0)
+        {
+            std::fill_n(stamp_, static_cast<size_t>(height_) * width_, 0);
+            generation_ = 1;
+        }
+
+        pos_.clear();
+    }
+
+    // Keep the storage for count positions, so that the insertions don't allocate
+    void reserve(size_t count)
+    {
+        Reserve(pos_, Min(count, static_cast<size_t>(height_) * width_));
+    }
+
+    // Positions are kept in the order of insertion
+    void insert(const Pos &pos)
+    {
+        uint32_t &stamp = stamp_[static_cast<size_t>(pos.y) * width_ + pos.x];
+
+        if (stamp != generation_)
+        {
+            stamp = generation_;
+            pos_.push_back(pos);
+        }
+    }
+
+    const container_type &get() const
+    {
+        return pos_;
+    }
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -59,6 +281,7 @@ public:
     typedef std::vector<KeyType> KeyCode;
     typedef std::vector<PosType> PosCode;
     typedef std::vector<PosPair> PosPairCode;
+    typedef TopK<PosPair> PosPairTopK;
 
 private:
     PCType Height_ = 0;
@@ -66,6 +289,12 @@ private:
     PCType PixelCount_ = 0;
     PosType pos_;
     pointer Data_ = nullptr;
+    bool view_ = false;
+
+    void Allocate()
+    {
+        AlignedMalloc(Data_, size());
+    }
 
 public:
     template < typename _Fn1 >
@@ -111,7 +340,7 @@ public:
     Block(PCType _Height, PCType _Width, const PosType &pos, bool Init = true, value_type Value = 0)
         : Height_(_Height), Width_(_Width), PixelCount_(Height_ * Width_), pos_(pos)
     {
-        AlignedMalloc(Data_, size());
+        Allocate();
 
         InitValue(Init, Value);
     }
@@ -124,6 +353,19 @@ public:
         From(src, src_stride);
     }
 
+    // View over Height * Width values of the caller, which must outlive the block, the data is left uninitialized
+    Block(pointer data, PCType _Height, PCType _Width, const PosType &pos)
+        : Height_(_Height), Width_(_Width), PixelCount_(Height_ * Width_), pos_(pos), Data_(data), view_(true)
+    {}
+
+    // View constructor from plane pointer and PosType
+    template < typename _St1 >
+    Block(pointer data, const _St1 *src, PCType src_stride, PCType _Height, PCType _Width, const PosType &pos)
+        : Block(data, _Height, _Width, pos)
+    {
+        From(src, src_stride);
+    }
+
     // Constructor from src Block
     Block(const _Myt &src, bool Init, value_type Value = 0)
         : Block(src.Height_, src.Width_, src.pos_, Init, Value)
@@ -141,17 +383,19 @@ public:
         : Height_(src.Height_), Width_(src.Width_), PixelCount_(src.PixelCount_), pos_(src.pos_)
     {
         Data_ = src.Data_;
+        view_ = src.view_;
 
         src.Height_ = 0;
         src.Width_ = 0;
         src.PixelCount_ = 0;
         src.Data_ = nullptr;
+        src.view_ = false;
     }
 
     // Destructor
     ~Block()
     {
-        AlignedFree(Data_);
+        if (!view_) AlignedFree(Data_);
     }
 
     // Copy assignment operator
@@ -185,13 +429,15 @@ public:
         PixelCount_ = src.PixelCount_;
         pos_ = src.pos_;
 
-        AlignedFree(Data_);
+        if (!view_) AlignedFree(Data_);
         Data_ = src.Data_;
+        view_ = src.view_;
 
         src.Height_ = 0;
         src.Width_ = 0;
         src.PixelCount_ = 0;
         src.Data_ = nullptr;
+        src.view_ = false;
 
         return *this;
     }
@@ -218,6 +464,7 @@ public:
     PosType GetPos() const { return pos_; }
     PCType PosY() const { return pos_.y; }
     PCType PosX() const { return pos_.x; }
+    bool IsView() const { return view_; }
 
     void SetPos(PosType _pos) { pos_ = _pos; }
 
@@ -551,138 +798,192 @@ public:
     ////////////////////////////////////////////////////////////////
     // Multiple block-matching functions
 
-    template < typename _St1 >
-    void BlockMatchingMulti(PosPairCode &match_code, const _St1 *src, PCType src_stride, _St1 src_range,
-        const PosCode &search_pos, double thMSE) const
+    // Measure the candidates given by search_pos(visit, visit_row), which calls visit(pos) for each search position,
+    // or visit_row(j, l, r, skip) for the positions (j, i) with i in [l, r] except skip, and collect the similar ones into match_code.
+    // Float rows are measured several adjacent positions at once by the batch kernel, which gives the same distances.
+    // Once match_code is full, the measurement of a candidate stops as soon as it can't be kept any more.
+    // If moments of the blocks in src are given, candidates whose lower bound exceeds the current bound are not measured at all.
+    template < typename _St1, typename _Fn1 >
+    void BlockMatchingScan(PosPairTopK &match_code, const _St1 *src, PCType src_stride, _St1 src_range,
+        double thMSE, SIMDLevel simd, const BlockMoments *moments, _Fn1 &&search_pos) const
     {
+        if (match_code.closed())
+        {
+            return;
+        }
+
         double MSE2SSE = static_cast<double>(PixelCount()) * src_range * src_range / double(255 * 255);
         double distMul = double(1) / MSE2SSE;
         dist_type thSSE = static_cast<dist_type>(thMSE * MSE2SSE);
 
-        size_t index = match_code.size();
-        match_code.resize(index + search_pos.size());
+        // The bound is slightly above the distance of the largest kept key,
+        // so that the key of a dropped candidate can't even tie with it
+        dist_type bound = thSSE;
 
-#if defined(__SSE2__)
-        static const ptrdiff_t simd_step = 8;
-        const ptrdiff_t simd_residue = Width() % simd_step;
-        const ptrdiff_t simd_width = Width() - simd_residue;
-        const ptrdiff_t src_stride1 = src_stride - simd_width;
-        const ptrdiff_t src_stride2 = src_stride - simd_residue;
-#else
+        // Float blocks and 8/16-bit integer blocks are measured by the runtime-dispatched kernels, any other type by the generic loop
+        const SSDFunc ssd = SSD_Func(simd);
+        const SSDBatchFunc ssd_batch = SSDBatch_Func(simd);
+        const PCType batch_size = ssd_batch ? SSDBatch_Size(simd) : 0;
+        const SSD8Func ssd8 = SSD8_Func(simd);
+        const SSD16Func ssd16 = SSD16_Func(simd);
         const ptrdiff_t src_stride0 = src_stride - Width();
-#endif
 
-        for (const auto &pos : search_pos)
+        BlockMoments::Moments refMoments = {};
+
+        if constexpr (std::is_same<_Ty, FLType>::value && std::is_same<_St1, FLType>::value)
+        {
+            if (moments && moments->BlockSize() == Height() && moments->BlockSize() == Width())
+            {
+                refMoments = moments->Measure(data(), Width());
+            }
+            else
+            {
+                moments = nullptr;
+            }
+        }
+        else
+        {
+            moments = nullptr;
+        }
+
+        // Only match similar blocks but not identical blocks
+        const auto collect = [&](dist_type dist, const PosType &pos)
+        {
+            if (dist <= bound && dist != 0
+                && match_code.push(PosPair(static_cast<KeyType>(dist * distMul), pos)) && match_code.full())
+            {
+                bound = Min(thSSE, static_cast<dist_type>(match_code.top().first * MSE2SSE * (1 + std::ldexp(1.0, -19))));
+            }
+        };
+
+        const auto visit = [&](const PosType &pos)
         {
+            if (moments && moments->LowerBound(refMoments, pos.y, pos.x) > bound)
+            {
+                return;
+            }
+
             dist_type dist = 0;
 
             auto refp0 = data();
             auto srcp0 = src + pos.y * src_stride + pos.x;
 
-#if defined(__SSE2__)
-            if(simd_width > 0)
+            if constexpr (std::is_same<_Ty, FLType>::value && std::is_same<_St1, FLType>::value)
             {
-                auto refp = refp0;
-                auto srcp = srcp0;
-
-                __m128 ssum = _mm_setzero_ps();
+                dist = ssd(refp0, srcp0, src_stride, Height(), Width(), bound);
+            }
+            else if constexpr (std::is_same<_Ty, _St1>::value
+                && (std::is_same<_St1, uint8_t>::value || std::is_same<_St1, uint16_t>::value))
+            {
+                double dist_int;
 
-                for (PCType y = 0; y < Height(); ++y)
+                if constexpr (std::is_same<_St1, uint8_t>::value)
                 {
-                    for (const auto upper = refp + simd_width; refp < upper; refp += simd_step, srcp += simd_step)
-                    {
-                        const __m128 r1 = _mm_loadu_ps(refp);
-                        const __m128 r2 = _mm_loadu_ps(refp + 4);
-                        const __m128 s1 = _mm_loadu_ps(srcp);
-                        const __m128 s2 = _mm_loadu_ps(srcp + 4);
-                        const __m128 d1 = _mm_sub_ps(r1, s1);
-                        const __m128 d2 = _mm_sub_ps(r2, s2);
-                        const __m128 d1sqr = _mm_mul_ps(d1, d1);
-                        const __m128 d2sqr = _mm_mul_ps(d2, d2);
-                        ssum = _mm_add_ps(ssum, d1sqr);
-                        ssum = _mm_add_ps(ssum, d2sqr);
-                    }
+                    dist_int = ssd8(refp0, srcp0, src_stride, Height(), Width(), bound);
+                }
+                else
+                {
+                    dist_int = ssd16(refp0, srcp0, src_stride, Height(), Width(), bound);
+                }
 
-                    refp += simd_residue;
-                    srcp += src_stride1;
+                // The exact distance is compared before rounding to dist_type
+                if (dist_int > bound)
+                {
+                    return;
                 }
 
-                alignas(16) FLType ssum_f32[4];
-                _mm_store_ps(ssum_f32, ssum);
-                dist += ssum_f32[0] + ssum_f32[1] + ssum_f32[2] + ssum_f32[3];
+                dist = static_cast<dist_type>(dist_int);
             }
-
-            if (simd_residue > 0)
+            else
             {
-                auto refp = refp0 + simd_width;
-                auto srcp = srcp0 + simd_width;
-
                 for (PCType y = 0; y < Height(); ++y)
                 {
-                    for (const auto upper = refp + simd_residue; refp < upper; ++refp, ++srcp)
+                    for (const auto upper = refp0 + Width(); refp0 < upper; ++refp0, ++srcp0)
                     {
-                        dist_type temp = static_cast<dist_type>(*refp) - static_cast<dist_type>(*srcp);
+                        dist_type temp = static_cast<dist_type>(*refp0) - static_cast<dist_type>(*srcp0);
                         dist += temp * temp;
                     }
 
-                    refp += simd_width;
-                    srcp += src_stride2;
+                    if (dist > bound)
+                    {
+                        break;
+                    }
+
+                    srcp0 += src_stride0;
                 }
             }
-#else
-            for (PCType y = 0; y < Height(); ++y)
+
+            collect(dist, pos);
+        };
+
+        const auto visit_row = [&](PCType j, PCType l, PCType r, PCType skip)
+        {
+            PCType i = l;
+
+            if constexpr (std::is_same<_Ty, FLType>::value && std::is_same<_St1, FLType>::value)
             {
-                for (const auto upper = refp0 + Width(); refp0 < upper; ++refp0, ++srcp0)
+                alignas(64) FLType dist[16];
+
+                for (; batch_size > 0 && i + batch_size <= r + 1; i += batch_size)
                 {
-                    dist_type temp = static_cast<dist_type>(*refp0) - static_cast<dist_type>(*srcp0);
-                    dist += temp * temp;
-                }
+                    // The batch is skipped only when none of its positions could be kept
+                    if (moments)
+                    {
+                        PCType k = 0;
 
-                srcp0 += src_stride0;
+                        while (k < batch_size && moments->LowerBound(refMoments, j, i + k) > bound)
+                        {
+                            ++k;
+                        }
+
+                        if (k == batch_size)
+                        {
+                            continue;
+                        }
+                    }
+
+                    ssd_batch(dist, data(), src + j * src_stride + i, src_stride, Height(), Width(), bound);
+
+                    for (PCType k = 0; k < batch_size; ++k)
+                    {
+                        if (i + k != skip)
+                        {
+                            collect(dist[k], PosType(j, i + k));
+                        }
+                    }
+                }
             }
-#endif
 
-            // Only match similar blocks but not identical blocks
-            if (dist <= thSSE && dist != 0)
+            for (; i <= r; ++i)
             {
-                match_code[index++] = PosPair(static_cast<KeyType>(dist * distMul), pos);
+                if (i != skip)
+                {
+                    visit(PosType(j, i));
+                }
             }
-        }
+        };
 
-        match_code.resize(index);
+        search_pos(visit, visit_row);
     }
 
     template < typename _St1 >
-    PosPairCode BlockMatchingMulti(const _St1 *src, PCType src_stride, _St1 src_range,
-        const PosCode &search_pos, double thMSE, size_t match_size = 0, bool sorted = true) const
+    void BlockMatchingMulti(PosPairTopK &match_code, const _St1 *src, PCType src_stride, _St1 src_range,
+        const PosCode &search_pos, double thMSE, SIMDLevel simd = SIMDLevel_CPU(), const BlockMoments *moments = nullptr) const
     {
-        PosPairCode match_code;
-
-        BlockMatchingMulti(match_code, src, src_stride, src_range, search_pos, thMSE);
-
-        // When match_size > 0, it's the upper limit of the number of matched blocks
-        if (match_size > 0 && match_code.size() > match_size)
+        BlockMatchingScan(match_code, src, src_stride, src_range, thMSE, simd, moments, [&](auto &&visit, auto &&)
         {
-            // Always sorted when size of match code is larger than match_size,
-            // since std::partial_sort is faster than std::nth_element
-            std::partial_sort(match_code.begin(), match_code.begin() + match_size, match_code.end());
-            match_code.resize(match_size);
-        }
-        else if (sorted)
-        {
-            std::stable_sort(match_code.begin(), match_code.end());
-        }
-
-        return match_code;
+            for (const auto &pos : search_pos)
+            {
+                visit(pos);
+            }
+        });
     }
 
-    // excludeCurPos:
-    //     0 - include current position in search positions
-    //     1 - exclude current position in search positions but take it as the first element in matched code
-    //     2 - exclude current position in search positions
+    // Search the window around the current position, which is excluded from the search positions if excludeCurPos is true
     template < typename _St1 >
-    PosPairCode BlockMatchingMulti(const _St1 *src, PCType src_height, PCType src_width, PCType src_stride, _St1 src_range,
-        PCType range, PCType step, double thMSE, int excludeCurPos = 1, size_t match_size = 0, bool sorted = true) const
+    void BlockMatchingMulti(PosPairTopK &match_code, const _St1 *src, PCType src_height, PCType src_width, PCType src_stride,
+        _St1 src_range, PCType range, PCType step, double thMSE, bool excludeCurPos, SIMDLevel simd = SIMDLevel_CPU(),
+        const BlockMoments *moments = nullptr) const
     {
         range = range / step * step;
         const PCType l = SearchBoundary(PCType(0), range, step, false);
@@ -690,42 +991,66 @@ public:
         const PCType t = SearchBoundary(PCType(0), range, step, true);
         const PCType b = SearchBoundary(src_height - Height(), range, step, true);
 
-        PosCode search_pos(((r - l) / step + 1) * ((b - t) / step + 1));
-        size_t index = 0;
-
-        for (PCType j = t; j <= b; j += step)
+        BlockMatchingScan(match_code, src, src_stride, src_range, thMSE, simd, moments, [&](auto &&visit, auto &&visit_row)
         {
-            for (PCType i = l; i <= r; i += step)
+            for (PCType j = t; j <= b; j += step)
             {
-                if (excludeCurPos > 0 && j == PosY() && i == PosX())
+                // Adjacent positions are measured together
+                if (step == 1)
                 {
+                    visit_row(j, l, r, excludeCurPos && j == PosY() ? PosX() : PCType(-1));
                     continue;
                 }
 
-                search_pos[index++] = PosType(j, i);
+                for (PCType i = l; i <= r; i += step)
+                {
+                    if (excludeCurPos && j == PosY() && i == PosX())
+                    {
+                        continue;
+                    }
+
+                    visit(PosType(j, i));
+                }
             }
-        }
+        });
+    }
 
-        PosPairCode match_code;
-        if (excludeCurPos == 1) match_code.push_back(PosPair(static_cast<KeyType>(0), PosType(PosY(), PosX())));
+    template < typename _St1 >
+    PosPairCode BlockMatchingMulti(const _St1 *src, PCType src_stride, _St1 src_range,
+        const PosCode &search_pos, double thMSE, size_t match_size = 0, bool sorted = true,
+        SIMDLevel simd = SIMDLevel_CPU()) const
+    {
+        PosPairTopK match_code;
+        match_code.reset(match_size);
 
-        BlockMatchingMulti(match_code, src, src_stride, src_range, search_pos, thMSE);
+        BlockMatchingMulti(match_code, src, src_stride, src_range, search_pos, thMSE, simd);
 
-        // When match_size > 0, it's the upper limit of the number of matched blocks
-        if (match_size > 0 && match_code.size() > match_size)
-        {
-            // Always sorted when size of match code is larger than match_size,
-            // since std::partial_sort is faster than std::nth_element
-            std::partial_sort(excludeCurPos == 1 ? match_code.begin() + 1 : match_code.begin(),
-                match_code.begin() + match_size, match_code.end());
-            match_code.resize(match_size);
-        }
-        else if (sorted)
-        {
-            std::stable_sort(match_code.begin(), match_code.end());
-        }
+        // Always sorted when the number of matched blocks is limited by match_size
+        if (sorted || match_code.full()) match_code.sort();
 
-        return match_code;
+        return std::move(match_code.get());
+    }
+
+    // excludeCurPos:
+    //     0 - include current position in search positions
+    //     1 - exclude current position in search positions but take it as the first element in matched code
+    //     2 - exclude current position in search positions
+    template < typename _St1 >
+    PosPairCode BlockMatchingMulti(const _St1 *src, PCType src_height, PCType src_width, PCType src_stride, _St1 src_range,
+        PCType range, PCType step, double thMSE, int excludeCurPos = 1, size_t match_size = 0, bool sorted = true,
+        SIMDLevel simd = SIMDLevel_CPU()) const
+    {
+        PosPairTopK match_code;
+        match_code.reset(match_size);
+        if (excludeCurPos == 1) match_code.push_fixed(PosPair(static_cast<KeyType>(0), PosType(PosY(), PosX())));
+
+        BlockMatchingMulti(match_code, src, src_height, src_width, src_stride, src_range,
+            range, step, thMSE, excludeCurPos > 0, simd);
+
+        // Always sorted when the number of matched blocks is limited by match_size
+        if (sorted || match_code.full()) match_code.sort();
+
+        return std::move(match_code.get());
     }
 
     ////////////////////////////////////////////////////////////////
@@ -810,6 +1135,34 @@ public:
         }
     }
 
+    // Same positions as the other overload, merged in O(positions) into grid, but not sorted.
+    // The matched code doesn't depend on the order of the search positions.
+    void GenSearchPos(SearchPosGrid &grid, const PosCode &ref_pos_code, PCType src_height, PCType src_width,
+        PCType range, PCType step = 1) const
+    {
+        range = range / step * step;
+        grid.reset(src_height - Height() + 1, src_width - Width() + 1);
+
+        const size_t side = range / step * 2 + 1;
+        grid.reserve(ref_pos_code.size() * side * side);
+
+        for (auto ref_pos : ref_pos_code)
+        {
+            const PCType l = _SearchBoundary(ref_pos.x, PCType(0), range, step);
+            const PCType r = _SearchBoundary(ref_pos.x, src_width - Width(), range, step);
+            const PCType t = _SearchBoundary(ref_pos.y, PCType(0), range, step);
+            const PCType b = _SearchBoundary(ref_pos.y, src_height - Height(), range, step);
+
+            for (PCType j = t; j <= b; j += step)
+            {
+                for (PCType i = l; i <= r; i += step)
+                {
+                    grid.insert(PosType(j, i));
+                }
+            }
+        }
+    }
+
     PosCode GenSearchPos(const PosCode &ref_pos_code, PCType src_height, PCType src_width,
         PCType range, PCType step = 1) const
     {
@@ -862,6 +1215,7 @@ public:
     typedef KeyPair<KeyType, Pos3Type> Pos3Pair;
     typedef std::vector<Pos3Type> Pos3Code;
     typedef std::vector<Pos3Pair> Pos3PairCode;
+    typedef TopK<Pos3Pair> Pos3PairTopK;
 
 private:
     PCType GroupSize_ = 0;
@@ -872,6 +1226,39 @@ private:
     PosCode posCode_;
     Pos3Code pos3Code_;
     pointer Data_ = nullptr;
+    bool view_ = false;
+
+    // The positions of a view are read from the code it's constructed from
+    const PosPair *posPairs_ = nullptr;
+    const Pos3Pair *pos3Pairs_ = nullptr;
+
+    void Allocate()
+    {
+        AlignedMalloc(Data_, size());
+    }
+
+    static PCType FitSize(size_type CodeSize, PCType _GroupSize)
+    {
+        return _GroupSize < 0 ? static_cast<PCType>(CodeSize)
+            : static_cast<PCType>(Min(CodeSize, static_cast<size_type>(_GroupSize)));
+    }
+
+    void CopyPos(const _Myt &src)
+    {
+        if (IsPos3())
+        {
+            pos3Code_.resize(GroupSize());
+            for (PCType i = 0; i < GroupSize(); ++i) pos3Code_[i] = src.GetPos3(i);
+        }
+        else
+        {
+            posCode_.resize(GroupSize());
+            for (PCType i = 0; i < GroupSize(); ++i) posCode_[i] = src.GetPos(i);
+        }
+
+        posPairs_ = nullptr;
+        pos3Pairs_ = nullptr;
+    }
 
 public:
     template < typename _Fn1 >
@@ -920,11 +1307,25 @@ public:
         PixelCount_(GroupSize_ * Height_ * Width_),
         isPos3_(_isPos3)
     {
-        AlignedMalloc(Data_, size());
+        Allocate();
 
         InitValue(Init, Value);
     }
 
+    // Constructor from PosPairCode, the data is left uninitialized
+    BlockGroup(const PosPairCode &code, PCType _GroupSize, PCType _Height, PCType _Width)
+        : Height_(_Height), Width_(_Width)
+    {
+        FromCode(code, _GroupSize);
+    }
+
+    // Constructor from Pos3PairCode, the data is left uninitialized
+    BlockGroup(const Pos3PairCode &code, PCType _GroupSize, PCType _Height, PCType _Width)
+        : Height_(_Height), Width_(_Width), isPos3_(true)
+    {
+        FromCode(code, _GroupSize);
+    }
+
     // Constructor from plane pointer and PosPairCode
     template < typename _St1 >
     BlockGroup(const _St1 *src, PCType src_stride, const PosPairCode &code,
@@ -947,12 +1348,45 @@ public:
         From(src, src_stride);
     }
 
-    // Copy constructor
+    // View over GroupSize * Height * Width values of the caller, with the positions read from the PosPairCode.
+    // Both must outlive the group, the data is left uninitialized.
+    BlockGroup(pointer data, const PosPairCode &code, PCType _GroupSize, PCType _Height, PCType _Width)
+        : GroupSize_(FitSize(code.size(), _GroupSize)), Height_(_Height), Width_(_Width),
+        PixelCount_(GroupSize_ * Height_ * Width_), Data_(data), view_(true), posPairs_(code.data())
+    {}
+
+    // View over GroupSize * Height * Width values of the caller, with the positions read from the Pos3PairCode.
+    // Both must outlive the group, the data is left uninitialized.
+    BlockGroup(pointer data, const Pos3PairCode &code, PCType _GroupSize, PCType _Height, PCType _Width)
+        : GroupSize_(FitSize(code.size(), _GroupSize)), Height_(_Height), Width_(_Width),
+        PixelCount_(GroupSize_ * Height_ * Width_), isPos3_(true), Data_(data), view_(true), pos3Pairs_(code.data())
+    {}
+
+    // View constructor from plane pointer and PosPairCode
+    template < typename _St1 >
+    BlockGroup(pointer data, const _St1 *src, PCType src_stride, const PosPairCode &code,
+        PCType _GroupSize, PCType _Height, PCType _Width)
+        : BlockGroup(data, code, _GroupSize, _Height, _Width)
+    {
+        From(src, src_stride);
+    }
+
+    // View constructor from plane pointer and Pos3PairCode
+    template < typename _St1 >
+    BlockGroup(pointer data, const std::vector<const _St1 *> &src, PCType src_stride, const Pos3PairCode &code,
+        PCType _GroupSize, PCType _Height, PCType _Width)
+        : BlockGroup(data, code, _GroupSize, _Height, _Width)
+    {
+        From(src, src_stride);
+    }
+
+    // Copy constructor, which always allocates its own data and positions
     BlockGroup(const _Myt &src)
         : GroupSize_(src.GroupSize_), Height_(src.Height_), Width_(src.Width_), PixelCount_(src.PixelCount_),
-        isPos3_(src.isPos3_), posCode_(src.posCode_), pos3Code_(src.pos3Code_)
+        isPos3_(src.isPos3_)
     {
-        AlignedMalloc(Data_, size());
+        Allocate();
+        CopyPos(src);
 
         memcpy(Data_, src.Data_, sizeof(value_type) * size());
     }
@@ -963,18 +1397,24 @@ public:
         isPos3_(src.isPos3_), posCode_(std::move(src.posCode_)), pos3Code_(std::move(src.pos3Code_))
     {
         Data_ = src.Data_;
+        view_ = src.view_;
+        posPairs_ = src.posPairs_;
+        pos3Pairs_ = src.pos3Pairs_;
 
         src.GroupSize_ = 0;
         src.Height_ = 0;
         src.Width_ = 0;
         src.PixelCount_ = 0;
         src.Data_ = nullptr;
+        src.view_ = false;
+        src.posPairs_ = nullptr;
+        src.pos3Pairs_ = nullptr;
     }
 
     // Destructor
     ~BlockGroup()
     {
-        AlignedFree(Data_);
+        if (!view_) AlignedFree(Data_);
     }
 
     // Copy assignment operator
@@ -990,8 +1430,7 @@ public:
         Width_ = src.Width_;
         PixelCount_ = src.PixelCount_;
         isPos3_ = src.isPos3_;
-        posCode_ = src.posCode_;
-        pos3Code_ = src.pos3Code_;
+        CopyPos(src);
 
         memcpy(Data_, src.Data_, sizeof(value_type) * size());
 
@@ -1013,15 +1452,21 @@ public:
         isPos3_ = src.isPos3_;
         posCode_ = std::move(src.posCode_);
         pos3Code_ = std::move(src.pos3Code_);
+        posPairs_ = src.posPairs_;
+        pos3Pairs_ = src.pos3Pairs_;
 
-        AlignedFree(Data_);
+        if (!view_) AlignedFree(Data_);
         Data_ = src.Data_;
+        view_ = src.view_;
 
         src.GroupSize_ = 0;
         src.Height_ = 0;
         src.Width_ = 0;
         src.PixelCount_ = 0;
         src.Data_ = nullptr;
+        src.view_ = false;
+        src.posPairs_ = nullptr;
+        src.pos3Pairs_ = nullptr;
 
         return *this;
     }
@@ -1047,10 +1492,12 @@ public:
     PCType Stride() const { return Width_; }
     PCType PixelCount() const { return PixelCount_; }
     bool IsPos3() const { return isPos3_; }
+    bool IsView() const { return view_; }
+    // Only filled for the groups owning their positions, a view reads them from its code
     const PosCode &GetPosCode() const { return posCode_; }
     const Pos3Code &GetPos3Code() const { return pos3Code_; }
-    PosType GetPos(PCType i) const { return posCode_[i]; }
-    Pos3Type GetPos3(PCType i) const { return pos3Code_[i]; }
+    PosType GetPos(PCType i) const { return posPairs_ ? posPairs_[i].second : posCode_[i]; }
+    Pos3Type GetPos3(PCType i) const { return pos3Pairs_ ? pos3Pairs_[i].second : pos3Code_[i]; }
 
     ////////////////////////////////////////////////////////////////
     // Initialization functions
@@ -1076,18 +1523,10 @@ public:
 
     void FromCode(const PosPairCode &code, PCType _GroupSize = -1)
     {
-        if (_GroupSize < 0)
-        {
-            GroupSize_ = static_cast<PCType>(code.size());
-        }
-        else
-        {
-            GroupSize_ = static_cast<PCType>(Min(code.size(), static_cast<size_type>(_GroupSize)));
-        }
-
+        GroupSize_ = FitSize(code.size(), _GroupSize);
         PixelCount_ = GroupSize_ * Height_ * Width_;
 
-        AlignedMalloc(Data_, size());
+        Allocate();
 
         posCode_.resize(GroupSize());
 
@@ -1099,18 +1538,10 @@ public:
 
     void FromCode(const Pos3PairCode &code, PCType _GroupSize = -1)
     {
-        if (_GroupSize < 0)
-        {
-            GroupSize_ = static_cast<PCType>(code.size());
-        }
-        else
-        {
-            GroupSize_ = static_cast<PCType>(Min(code.size(), static_cast<size_type>(_GroupSize)));
-        }
-
+        GroupSize_ = FitSize(code.size(), _GroupSize);
         PixelCount_ = GroupSize_ * Height_ * Width_;
 
-        AlignedMalloc(Data_, size());
+        Allocate();
 
         pos3Code_.resize(GroupSize());
 
@@ -0,0 +1,117 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef BLOCKMOMENTS_H_
+#define BLOCKMOMENTS_H_
+
+
+#include "Helper.h"
+#include "PlaneArena.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Sum and centered norm of every square block of a plane, built from direct box sums over columns and then rows.
+// For blocks a and b of n pixels, with means m and centered norms v,
+//     SSD(a, b) >= n * (m_a - m_b)^2 + (v_a - v_b)^2,
+// which rejects most far-off candidates of block matching without measuring them.
+// The bound accounts for the rounding errors of the maps and of the SSD kernel,
+// thus a rejected candidate would never have been matched.
+class BlockMoments
+{
+public:
+    typedef BlockMoments _Myt;
+
+    // Sum and centered norm of a block, with the absolute error bounds of both
+    struct Moments
+    {
+        double sum;
+        double norm;
+        double sum_error;
+        double norm_error;
+    };
+
+private:
+    PCType height_;
+    PCType width_;
+    PCType block_size_;
+    PCType map_width_;
+    double pixel_count_;
+    double inv_pixel_count_;
+
+    // Subtracted from every pixel, which doesn't change the distances but reduces the rounding errors
+    double offset_ = 0;
+
+    FLType *sum_ = nullptr;
+    FLType *norm_ = nullptr;
+
+    // Absolute error bounds of the stored sums and norms, relative error bound of the SSD kernel (also covering this bound),
+    // and absolute error bound of the SSD kernel when the squares underflow
+    double sum_error_;
+    double norm_error_;
+    double rel_;
+    double underflow_;
+
+public:
+    // The maps are taken from scratch, which must outlive them
+    BlockMoments(const FLType *src, PCType height, PCType width, PCType stride, PCType block_size,
+        PlaneArena::Frame &scratch);
+
+    // The bound is not usable when the plane contains non-finite values
+    bool Valid() const { return std::isfinite(sum_error_) && std::isfinite(norm_error_); }
+
+    PCType BlockSize() const { return block_size_; }
+
+    // Moments of a block of block_size x block_size pixels, not necessarily from the same plane
+    Moments Measure(const FLType *src, PCType stride) const;
+
+    Moments Get(PCType y, PCType x) const
+    {
+        const size_t index = static_cast<size_t>(y) * map_width_ + x;
+        return { sum_[index], norm_[index], sum_error_, norm_error_ };
+    }
+
+    // Lower bound of the SSD between a block with moments "ref" and the block at (y, x),
+    // as measured by the SSD kernel (see SIMD.h)
+    double LowerBound(const Moments &ref, PCType y, PCType x) const
+    {
+        const size_t index = static_cast<size_t>(y) * map_width_ + x;
+
+        const double sum_diff = Max(Abs(ref.sum - sum_[index]) - (ref.sum_error + sum_error_), 0.0);
+        const double norm_diff = Max(Abs(ref.norm - norm_[index]) - (ref.norm_error + norm_error_), 0.0);
+
+        return (sum_diff * sum_diff * inv_pixel_count_ + norm_diff * norm_diff) * (1 - rel_) - underflow_;
+    }
+
+private:
+    // Error bounds of the moments summed in double from values of magnitude at most M
+    void Errors(double M, double &sum_error, double &norm_error) const;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
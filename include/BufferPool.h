@@ -0,0 +1,128 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+
+#ifndef BUFFERPOOL_H_
+#define BUFFERPOOL_H_
+
+
+#include <atomic>
+#include <memory>
+#include "Helper.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Scratch buffers of the same size reused by the frames filtered concurrently, without any lock.
+// Each slot holds at most one idle buffer. It is taken by an atomic exchange with null, and filled by a compare-exchange
+// from null, so that a buffer released concurrently into the same slot is never overwritten.
+// Every thread starts its scan at its own slot, so a thread usually gets back the buffer it released last.
+// At most capacity idle buffers are kept, a buffer released when all the slots are filled is freed.
+class BufferPool
+{
+public:
+    typedef BufferPool _Myt;
+
+    // A buffer taken from the pool, which is returned to it on destruction
+    class Buffer
+    {
+    private:
+        _Myt *pool_ = nullptr;
+        FLType *data_ = nullptr;
+
+    public:
+        Buffer() {}
+
+        Buffer(_Myt *pool, FLType *data)
+            : pool_(pool), data_(data)
+        {}
+
+        Buffer(const Buffer &right) = delete;
+        Buffer &operator=(const Buffer &right) = delete;
+
+        Buffer(Buffer &&right)
+            : pool_(right.pool_), data_(right.data_)
+        {
+            right.pool_ = nullptr;
+            right.data_ = nullptr;
+        }
+
+        Buffer &operator=(Buffer &&right)
+        {
+            if (this != &right)
+            {
+                if (pool_) pool_->Release(data_);
+                pool_ = right.pool_;
+                data_ = right.data_;
+                right.pool_ = nullptr;
+                right.data_ = nullptr;
+            }
+
+            return *this;
+        }
+
+        ~Buffer()
+        {
+            if (pool_) pool_->Release(data_);
+        }
+
+        FLType *get() const { return data_; }
+    };
+
+private:
+    // Each slot in its own cache line, so that the threads scanning their own slots don't share one
+    struct alignas(64) Slot
+    {
+        std::atomic<FLType *> data{ nullptr };
+    };
+
+    size_t capacity_;
+    std::unique_ptr<Slot[]> slots_;
+
+public:
+    // The capacity defaults to the logical processors, the most frames being filtered at once
+    explicit BufferPool(size_t capacity = 0);
+
+    BufferPool(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    ~BufferPool();
+
+    // Take an idle buffer, or allocate a new one of count elements when there's none.
+    // All the buffers of a pool must have the same count.
+    Buffer Acquire(size_t count);
+
+private:
+    void Release(FLType *data);
+
+    size_t Start() const;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
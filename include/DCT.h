@@ -0,0 +1,111 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef DCT_H_
+#define DCT_H_
+
+
+#include <vector>
+#include "SIMD.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// 3D DCT of the groups by products of precomputed matrices, specialized for the common block sizes.
+// The forward and backward transforms follow the FFTW kinds REDFT10 and REDFT01 along every axis (unnormalized),
+// thus they replace the FFTW plans with results differing only by rounding.
+// The 2D transform of each block takes two products with the block size as the row length,
+// then every row of the blocks is transformed along the group axis with the matrix of the group size.
+class BlockDCT
+{
+public:
+    typedef BlockDCT _Myt;
+
+    // The matrices along the group axis take O(GroupSize^3) memory, larger groups are left to FFTW
+    static const PCType MaxGroupSize = 64;
+
+private:
+    PCType block_size_;
+    MulRowsFunc mul_rows_;
+
+    // Matrices of the 2D transform and their transposes
+    std::vector<FLType> forward_;
+    std::vector<FLType> forward_t_;
+    std::vector<FLType> backward_;
+    std::vector<FLType> backward_t_;
+
+    // Matrices along the group axis, indexed by group size - 1
+    std::vector<std::vector<FLType>> group_forward_;
+    std::vector<std::vector<FLType>> group_backward_;
+
+public:
+    // With group_size 0, only the 2D transforms are available
+    BlockDCT(PCType block_size, PCType group_size, SIMDLevel level);
+
+    BlockDCT(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    static bool Supported(PCType block_size, PCType group_size);
+
+    // In-place 3D transforms of a group of group_size blocks
+    void Forward(FLType *data, PCType group_size) const
+    {
+        Transform2D(data, group_size, forward_, forward_t_);
+        TransformGroup(data, group_size, group_forward_[group_size - 1]);
+    }
+
+    void Backward(FLType *data, PCType group_size) const
+    {
+        Transform2D(data, group_size, backward_, backward_t_);
+        TransformGroup(data, group_size, group_backward_[group_size - 1]);
+    }
+
+    // The forward transform split into the 2D transform of a block and the 1D transform along the group axis
+    void Forward2D(FLType *block) const
+    {
+        Transform2D(block, 1, forward_, forward_t_);
+    }
+
+    void Backward2D(FLType *block) const
+    {
+        Transform2D(block, 1, backward_, backward_t_);
+    }
+
+    void Forward1D(FLType *data, PCType group_size) const
+    {
+        TransformGroup(data, group_size, group_forward_[group_size - 1]);
+    }
+
+private:
+    void Transform2D(FLType *data, PCType group_size, const std::vector<FLType> &matrix, const std::vector<FLType> &matrix_t) const;
+
+    void TransformGroup(FLType *data, PCType group_size, const std::vector<FLType> &matrix) const;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
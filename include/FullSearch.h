@@ -0,0 +1,128 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef FULLSEARCH_H_
+#define FULLSEARCH_H_
+
+
+#include "Block.h"
+#include "PlaneArena.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Full-search block matching of every reference block in a plane, scanned row by row.
+// For each displacement, the squared differences are summed by column with running sums sliding down the rows,
+// and the SSD of each reference block is taken from the prefix sums of these column sums,
+// so the cost per candidate depends on block_step rather than on block_size.
+// The running sums are only an estimate with a known error bound: the candidates which may still be selected
+// are measured again by the same SSD kernel as Block::BlockMatchingMulti, thus the match codes are identical.
+class FullSearch
+{
+public:
+    typedef FullSearch _Myt;
+
+    typedef Block<FLType, FLType> block_type;
+    typedef block_type::KeyType KeyType;
+    typedef block_type::PosType PosType;
+    typedef block_type::PosPair PosPair;
+    typedef block_type::PosPairCode PosPairCode;
+    typedef block_type::PosPairTopK PosPairTopK;
+
+private:
+    const FLType *ref_ = nullptr;
+    PCType height_;
+    PCType width_;
+    PCType stride_;
+    PCType block_size_;
+    PCType block_step_;
+    PCType step_;
+    PCType radius_;
+    PCType diameter_;
+    double thMSE_;
+    SSDFunc ssd_;
+    SSDSlideFunc slide_;
+
+    // Absolute error bound of the running sums, and relative error bound of the measured and stored distances
+    double error_;
+    double rel_;
+
+    // Horizontal positions of the reference blocks
+    std::vector<PCType> cols_;
+
+    // Column sums of each displacement, and the row of reference blocks they are summed for
+    double *colsum_ = nullptr;
+    std::vector<PCType> colsum_row_;
+    std::vector<double> prefix_;
+
+    // Estimated distances of each reference block in the current row to each displacement
+    FLType *dist_ = nullptr;
+    PCType row_ = -1;
+
+    // Estimates surely within the threshold, filtered by the bound of the last reference block
+    std::vector<FLType> upper_;
+    FLType hint_ = std::numeric_limits<FLType>::infinity();
+
+    // Storage of the reference block, which is a view over it
+    FLType *block_ = nullptr;
+
+public:
+    // The engine is kept by a worker thread, and bound by Reset to the plane of each frame
+    FullSearch() {}
+
+    FullSearch(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    // Bind the engine to the plane ref, the column sums, the distances and the block are taken from scratch,
+    // which must outlive its use. The other storage is kept from the previous frames.
+    void Reset(const FLType *ref, PCType height, PCType width, PCType stride,
+        PCType block_size, PCType block_step, PCType range, PCType step, double thMSE, SIMDLevel simd,
+        PlaneArena::Frame &scratch);
+
+    // Whether the engine is cheaper than matching each reference block separately
+    static bool Worthwhile(PCType width, PCType block_size, PCType block_step, PCType range, PCType step);
+
+    // The estimate is not usable when the plane contains non-finite values
+    bool Valid() const { return std::isfinite(error_); }
+
+    // Same as Block::BlockMatchingMulti with the window search, match_code should be reset to the group size
+    // with only the reference block pushed as a fixed element, and reference blocks should be requested in scan order
+    void Match(PosPairTopK &match_code, PCType j, PCType i);
+
+private:
+    void Row(PCType j);
+
+    void Accumulate(double *colsum, PCType y0, PCType y1, PCType dy, PCType dx) const;
+
+    void Slide(double *colsum, PCType y0, PCType y1, PCType dy, PCType dx) const;
+
+    double Margin(double dist) const;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
@@ -138,10 +138,82 @@ inline __m128 _mm_abs_ps(const __m128 &x)
 const size_t MEMORY_ALIGNMENT = 64;
 
 
+#ifndef NDEBUG
+// Heap allocations made by the current thread, counted by AlignedMalloc and by the operator new of Allocations.cpp.
+// The retained ones grow the storage kept across frames (arenas, pools, per-thread workspaces),
+// so a steady-state frame leaves the transient count unchanged.
+struct AllocationCount
+{
+    size_t total = 0;
+    size_t retained = 0;
+    int depth = 0;
+
+    size_t Transient() const { return total - retained; }
+};
+
+
+inline AllocationCount &Allocations()
+{
+    thread_local AllocationCount count;
+    return count;
+}
+#endif
+
+
+// Marks the allocations made during its lifetime as retained storage, only counted in debug builds
+class RetainedAllocations
+{
+#ifndef NDEBUG
+private:
+    size_t total_;
+
+public:
+    RetainedAllocations()
+        : total_(Allocations().total)
+    {
+        ++Allocations().depth;
+    }
+
+    ~RetainedAllocations()
+    {
+        AllocationCount &count = Allocations();
+
+        if (--count.depth == 0)
+        {
+            count.retained += count.total - total_;
+        }
+    }
+#else
+public:
+    RetainedAllocations() {}
+    ~RetainedAllocations() {}
+#endif
+
+    RetainedAllocations(const RetainedAllocations &right) = delete;
+    RetainedAllocations &operator=(const RetainedAllocations &right) = delete;
+};
+
+
+// Grow the capacity of a container kept across frames to at least count elements
+template < typename _Cont >
+void Reserve(_Cont &container, size_t count)
+{
+    if (container.capacity() < count)
+    {
+        const RetainedAllocations retained;
+        container.reserve(count);
+    }
+}
+
+
 template < typename _Ty >
 void AlignedMalloc(_Ty *&Memory, size_t Count, size_t Alignment = MEMORY_ALIGNMENT)
 {
     Memory = vsh::vsh_aligned_malloc<_Ty>(sizeof(_Ty) * Count, Alignment);
+
+#ifndef NDEBUG
+    ++Allocations().total;
+#endif
 }
 
 
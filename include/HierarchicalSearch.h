@@ -0,0 +1,103 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef HIERARCHICALSEARCH_H_
+#define HIERARCHICALSEARCH_H_
+
+
+#include "Block.h"
+#include "PlaneArena.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Coarse-to-fine block matching of reference blocks in a plane.
+// The window is first searched on the plane downsampled by 2 with blocks of half the size,
+// then only the neighbourhoods of the best coarse matches are searched at full resolution.
+// Unlike FullSearch, the match codes may differ from those of the window search.
+class HierarchicalSearch
+{
+public:
+    typedef HierarchicalSearch _Myt;
+
+    typedef Block<FLType, FLType> block_type;
+    typedef block_type::KeyType KeyType;
+    typedef block_type::PosType PosType;
+    typedef block_type::PosPair PosPair;
+    typedef block_type::PosCode PosCode;
+    typedef block_type::PosPairTopK PosPairTopK;
+
+private:
+    const FLType *ref_ = nullptr;
+    PCType height_;
+    PCType width_;
+    PCType stride_;
+    PCType block_size_;
+    PCType range_;
+    PCType step_;
+    double thMSE_;
+    SIMDLevel simd_;
+
+    // Reference plane downsampled by 2, with stride equal to width
+    FLType *coarse_ = nullptr;
+    PCType coarse_height_;
+    PCType coarse_width_;
+    PCType coarse_block_size_;
+
+    // Coarse matches and the positions derived from them, reused for every reference block
+    PosPairTopK coarse_match_;
+    PosCode seeds_;
+    SearchPosGrid search_pos_;
+
+    // Storage of the reference block followed by its coarse block, which are views over it
+    FLType *block_ = nullptr;
+
+public:
+    // The engine is kept by a worker thread, and bound by Reset to the plane of each frame
+    HierarchicalSearch() {}
+
+    HierarchicalSearch(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    // Bind the engine to the plane ref, the coarse plane, the block and the stamps of the search positions
+    // are taken from scratch, which must outlive its use
+    void Reset(const FLType *ref, PCType height, PCType width, PCType stride,
+        PCType block_size, PCType range, PCType step, double thMSE, SIMDLevel simd,
+        PlaneArena::Frame &scratch);
+
+    // The coarse blocks need at least 2x2 pixels
+    static bool Applicable(PCType height, PCType width, PCType block_size);
+
+    // Same as Block::BlockMatchingMulti with the window search, match_code should be reset to the group size
+    // with only the reference block pushed as a fixed element.
+    // The best match_code.capacity() coarse matches and the reference block itself are refined within +-step.
+    void Match(PosPairTopK &match_code, PCType j, PCType i, const BlockMoments *moments = nullptr);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
@@ -0,0 +1,89 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef PLANCACHE_H_
+#define PLANCACHE_H_
+
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "fftw3_helper.hpp"
+#include "Helper.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Process-wide registry of the in-place r2r plans of FFTW, keyed by the shape, kinds and flags of the transform.
+// All the planes and filter instances with the same transform share one plan, planned only by the first of them.
+// The registry only holds weak references, a plan is destroyed along with the last filter referencing it.
+// FFTW's planner isn't thread-safe, so planning and destruction are serialized by the registry.
+class PlanCache
+{
+public:
+    typedef PlanCache _Myt;
+
+    typedef fftwh<FLType> fftw;
+    typedef std::shared_ptr<const fftw::plan> plan_ptr;
+
+private:
+    typedef std::vector<int> KeyType;
+
+    static std::mutex mutex_;
+    static std::map<KeyType, std::weak_ptr<const fftw::plan>> plans_;
+
+    // Number of the plans not found in the wisdom, and its value when the wisdom file was last imported or exported
+    static size_t learned_;
+    static std::map<std::string, size_t> synced_;
+
+public:
+    PlanCache() = delete;
+
+    // Same arguments as fftw_plan_many_r2r without the embeds, transforming in place
+    // The plan is planned on a buffer allocated by AlignedMalloc, thus it should be executed on aligned data
+    static plan_ptr Plan(int rank, const int *n, int howmany, int stride, int dist,
+        const fftw::r2r_kind *kind, unsigned flags);
+
+    static plan_ptr Plan2D(int n0, int n1, fftw::r2r_kind kind, unsigned flags);
+    static plan_ptr Plan3D(int n0, int n1, int n2, fftw::r2r_kind kind, unsigned flags);
+
+    // Merge the wisdom file into the wisdom of FFTW, only done once per file in a process, a missing file is ignored
+    static void ImportWisdom(const std::string &filename);
+
+    // Write the wisdom back to the file if plans were learned since it was imported or exported,
+    // through a temporary file so that concurrent processes never read a partially written file
+    static void ExportWisdom(const std::string &filename);
+
+private:
+    static void Release(const KeyType &key, fftw::plan *plan);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
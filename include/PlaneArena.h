@@ -0,0 +1,131 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+
+#ifndef PLANEARENA_H_
+#define PLANEARENA_H_
+
+
+#include <atomic>
+#include <vector>
+#include "Helper.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Floating point planes converted from and to the frames, reused by the following frames of the same thread.
+// The plane-sized scratch of the workers (transform rings, search buffers) is taken from it as well.
+// Each thread has its own arena, whose idle buffers are kept by size class, so a thread in steady state takes
+// all its planes from the arena without calling the system allocator. The buffers are freed when the thread exits.
+class PlaneArena
+{
+public:
+    typedef PlaneArena _Myt;
+
+    // Bytes of the planes of all the threads
+    struct Usage
+    {
+        size_t in_use = 0;
+        size_t peak = 0;
+        size_t reserved = 0;
+        size_t peak_reserved = 0;
+    };
+
+    // The planes taken through a frame are returned to the arena of the thread when the frame is destroyed.
+    // A frame must be destroyed by the thread which created it, in the reverse order of creation.
+    class Frame
+    {
+    private:
+        _Myt &arena_;
+        size_t mark_;
+
+    public:
+        Frame();
+
+        Frame(const Frame &right) = delete;
+        Frame &operator=(const Frame &right) = delete;
+
+        ~Frame();
+
+        // Uninitialized buffer of count values, aligned to MEMORY_ALIGNMENT
+        template < typename _Ty = FLType >
+        _Ty *Get(size_t count)
+        {
+            return reinterpret_cast<_Ty *>(arena_.Take(sizeof(_Ty) * count));
+        }
+    };
+
+private:
+    // Idle buffers of the same rounded size
+    struct Class
+    {
+        size_t bytes;
+        std::vector<FLType *> idle;
+    };
+
+    struct Taken
+    {
+        FLType *data;
+        size_t bytes;
+    };
+
+    std::vector<Class> classes_;
+    std::vector<Taken> taken_;
+
+    static std::atomic<size_t> in_use_;
+    static std::atomic<size_t> peak_;
+    static std::atomic<size_t> reserved_;
+    static std::atomic<size_t> peak_reserved_;
+
+public:
+    PlaneArena() {}
+
+    PlaneArena(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    ~PlaneArena();
+
+    static Usage Stats();
+
+private:
+    static _Myt &Local();
+
+    // Round up to 8 classes per power of 2 from 4 KiB, which wastes at most 1/8 of a buffer
+    static size_t RoundUp(size_t bytes);
+
+    static void Raise(std::atomic<size_t> &peak, size_t value);
+
+    void *Take(size_t bytes);
+
+    // Return the planes taken since the mark
+    void Release(size_t mark);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
@@ -0,0 +1,111 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+#ifndef PREDICTIVESEARCH_H_
+#define PREDICTIVESEARCH_H_
+
+
+#include "Block.h"
+#include "PlaneArena.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Predictive block matching of reference blocks scanned in rows.
+// Neighbouring reference blocks mostly match at the same offsets, thus the matches of the previous reference block
+// in the row, shifted by the block step, seed a narrow search around them instead of searching the whole window.
+// The window search is still done at the start of each row, every refresh_interval reference blocks,
+// and whenever the predicted group is smaller than the one of the last window search.
+// Unlike FullSearch, the match codes may differ from those of the window search.
+class PredictiveSearch
+{
+public:
+    typedef PredictiveSearch _Myt;
+
+    typedef Block<FLType, FLType> block_type;
+    typedef block_type::KeyType KeyType;
+    typedef block_type::PosType PosType;
+    typedef block_type::PosPair PosPair;
+    typedef block_type::PosCode PosCode;
+    typedef block_type::PosPairTopK PosPairTopK;
+
+    // Maximum number of predicted searches between two window searches
+    static const PCType refresh_interval = 8;
+
+    // Radius of the narrow search around each predicted position
+    static const PCType predict_range = 2;
+
+private:
+    const FLType *ref_ = nullptr;
+    PCType height_;
+    PCType width_;
+    PCType stride_;
+    PCType block_size_;
+    PCType range_;
+    PCType step_;
+    double thMSE_;
+    SIMDLevel simd_;
+
+    // Matches of the previous reference block, and the state of the last window search
+    PosType prev_pos_;
+    PosCode prev_match_;
+    PCType predicted_ = 0;
+    size_t window_size_ = 0;
+
+    // Positions predicted for the current reference block, reused for every reference block
+    PosCode seeds_;
+    SearchPosGrid search_pos_;
+
+    // Storage of the reference block, which is a view over it
+    FLType *block_ = nullptr;
+
+public:
+    // The engine is kept by a worker thread, and bound by Reset to the plane of each frame
+    PredictiveSearch() {}
+
+    PredictiveSearch(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    // Bind the engine to the plane ref, the block and the stamps of the search positions are taken from scratch,
+    // which must outlive its use
+    void Reset(const FLType *ref, PCType height, PCType width, PCType stride,
+        PCType block_size, PCType range, PCType step, double thMSE, SIMDLevel simd,
+        PlaneArena::Frame &scratch);
+
+    // Same as Block::BlockMatchingMulti with the window search, match_code should be reset to the group size
+    // with only the reference block pushed as a fixed element.
+    // The reference blocks are expected in the scan order of the kernel, the prediction only follows a row.
+    void Match(PosPairTopK &match_code, PCType j, PCType i, const BlockMoments *moments = nullptr);
+
+private:
+    void WindowMatch(PosPairTopK &match_code, const block_type &refBlock, const BlockMoments *moments);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
@@ -0,0 +1,153 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef SIMD_H_
+#define SIMD_H_
+
+
+#include "Helper.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Instruction set levels of the runtime-dispatched kernels
+
+
+enum class SIMDLevel
+{
+    None = 0,
+    SSE2 = 1,
+    AVX2 = 2, // with FMA
+    AVX512 = 3
+};
+
+
+// Highest level supported by both the build and the running CPU, detected once by CPUID
+SIMDLevel SIMDLevel_CPU();
+
+// Level selected by the "opt" argument: 0 - auto detect, 1 - SSE2, 2 - AVX2, 3 - AVX-512
+// A forced level is capped at what the running CPU supports
+SIMDLevel SIMDLevel_Select(int opt);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sum of squared differences between a contiguous reference block and a block of the source plane
+
+
+// All the levels accumulate in the same order, thus the distances (and the matched codes) are bit-identical:
+//     the columns [0, width - width % 8) of each row are split into chunks of 8 pixels, and the chunks are numbered in scan order,
+//     chunk c is accumulated into lanes [8 * (c % 2), 8 * (c % 2) + 8) of 16 partial sums,
+//     the partial sums are reduced as s8[k] = p[k] + p[k + 8], s4[k] = s8[k] + s8[k + 4], ((s4[0] + s4[1]) + s4[2]) + s4[3],
+//     then the residual columns are added sequentially in scan order.
+// The sum stops early once a partial sum (checked every other row) exceeds bound, and that partial sum is returned.
+// Since all the terms are non-negative, it never exceeds the full sum.
+typedef FLType (*SSDFunc)(const FLType *refp, const FLType *srcp, PCType src_stride, PCType height, PCType width, FLType bound);
+
+SSDFunc SSD_Func(SIMDLevel level);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sum of squared differences at horizontally adjacent positions of the source plane
+
+
+// Measures the positions srcp + k for k in [0, SSDBatch_Size(level)) at once, one vector lane each,
+// so that every pixel of the reference block is loaded once for all of them.
+// The lanes accumulate in the same order as SSDFunc, thus dist[k] is bit-identical to the distance of position srcp + k,
+// except that the sum only stops early once the partial sums of all the positions exceed bound.
+// The rows of the last position must lie within the plane.
+typedef void (*SSDBatchFunc)(FLType *dist, const FLType *refp, const FLType *srcp, PCType src_stride,
+    PCType height, PCType width, FLType bound);
+
+// Null with size 0 when the level has no vector lanes
+SSDBatchFunc SSDBatch_Func(SIMDLevel level);
+PCType SSDBatch_Size(SIMDLevel level);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sum of squared differences between blocks of integer samples
+
+
+// Accumulated in integers, thus exact at every level, and returned as double (exact up to 2^53).
+// The sum stops early once a partial sum (checked every other row) exceeds bound, and that partial sum is returned.
+typedef double (*SSD8Func)(const uint8_t *refp, const uint8_t *srcp, PCType src_stride, PCType height, PCType width, double bound);
+typedef double (*SSD16Func)(const uint16_t *refp, const uint16_t *srcp, PCType src_stride, PCType height, PCType width, double bound);
+
+SSD8Func SSD8_Func(SIMDLevel level);
+SSD16Func SSD16_Func(SIMDLevel level);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Running column sums of squared differences, in double precision
+
+
+// Slides the column sums down by one row, the row (ref0, src0) leaves and the row (ref1, src1) enters:
+//     colsum[x] += (ref1[x] - src1[x])^2 - (ref0[x] - src0[x])^2, for x in [0, width)
+// The results of different levels may differ by rounding, only the error bound is the same
+typedef void (*SSDSlideFunc)(double *colsum, const FLType *ref0, const FLType *src0,
+    const FLType *ref1, const FLType *src1, PCType width);
+
+SSDSlideFunc SSDSlide_Func(SIMDLevel level);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Products of small matrices whose rows hold block_size values
+
+
+// dst[r * dst_stride + x] = sum of coef[r * count + m] * src[m * block_size + x] over m in [0, count), for r in [0, rows)
+// The sum is accumulated in the order of m at every level, thus the results are bit-identical.
+// dst must not overlap coef or src.
+typedef void (*MulRowsFunc)(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src, PCType rows);
+
+// Null when the kernel is not specialized for block_size, which are 4, 8, 11 and 16
+MulRowsFunc MulRows_Func(SIMDLevel level, PCType block_size);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Empirical Wiener shrinkage of the 3D transform coefficients
+
+
+// How the Wiener coefficient is computed
+enum class WienerMode
+{
+    // Approximate reciprocal of the SIMD instruction set, about 12 bits (14 bits with AVX-512)
+    Fast = 0,
+    // Approximate reciprocal refined by a Newton-Raphson step, about 22 bits
+    Refined = 1,
+    // IEEE division, without FMA, thus the results are bit-identical at every level
+    Exact = 2
+};
+
+// src[k] *= w[k] with the Wiener coefficient w[k] = ref[k]^2 / (ref[k]^2 + sigma_sqr), for k in [0, size),
+// returns the sum of w[k]^2
+// The elements [0, size - size % 16) are split into chunks of 16, element k of a chunk is accumulated into the partial sum k,
+// the partial sums are reduced in the same order as SSDFunc, then the residual elements are added sequentially by division.
+// Without SIMD, the coefficients are always computed by division.
+typedef FLType (*WienerFunc)(FLType *src, const FLType *ref, PCType size, FLType sigma_sqr);
+
+WienerFunc Wiener_Func(SIMDLevel level, WienerMode mode);
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
@@ -0,0 +1,153 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "PlaneArena.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Worker threads filtering the chunks of frames in parallel, shared by all the filters in a process.
+// Frames requested by several threads of VapourSynth share the workers, the tasks of all of them are queued together.
+// The calling thread runs its own queued tasks as well, so a frame still progresses when all the workers are busy.
+// It never takes the tasks of other frames, which would hold its own frame back until they are done.
+class ThreadPool
+{
+public:
+    typedef ThreadPool _Myt;
+
+private:
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::condition_variable done_;
+
+    // The tasks queued by one call of Run, on the stack of the call which outlives them
+    struct Batch
+    {
+        const std::function<void(size_t)> *func;
+        size_t pending;
+        std::exception_ptr error;
+    };
+
+    // Each task calls the function of its batch for one index
+    struct Task
+    {
+        Batch *batch;
+        size_t index;
+    };
+
+    // The queue only grows, thus it stops allocating once it has held the tasks of the frames filtered concurrently
+    std::vector<Task> tasks_;
+    std::vector<std::thread> workers_;
+    bool stop_ = false;
+
+    static std::mutex shared_mutex_;
+    static std::weak_ptr<ThreadPool> shared_;
+
+public:
+    ThreadPool() {}
+
+    ThreadPool(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    ~ThreadPool();
+
+    // The pool of the process, grown to at least threads - 1 workers as the calling thread also works.
+    // The threads are capped by the logical processors, which VapourSynth already keeps busy with its own frame threads,
+    // thus more threads would only compete with them. Return the number of threads a frame may use.
+    static std::shared_ptr<ThreadPool> Shared(int &threads);
+
+    // Call func(k) for each k in [0, count) and return when all the calls are done,
+    // the first exception thrown by any of them is rethrown.
+    // A lambda is passed by std::cref, so that std::function doesn't copy its captures to the heap.
+    void Run(size_t count, const std::function<void(size_t)> &func);
+
+private:
+    void Work();
+
+    // Run the task with the lock released, the lock is held on entry and on return
+    void Execute(const Task &task, std::unique_lock<std::mutex> &lock);
+};
+
+
+// Work-stealing distribution of the chunks [0, count) of a frame among its threads.
+// Each thread owns a range of neighbouring chunks and takes them from the front, so that its search engines and caches
+// keep working on neighbouring rows. A thread running out of chunks steals the last chunk of the largest remaining range,
+// so the threads stay busy however the cost of block matching varies across the frame.
+// Finish runs the merge of the chunks in order, each once all the previous chunks are finished.
+class WorkStealing
+{
+public:
+    typedef WorkStealing _Myt;
+
+private:
+    // Only changed under the lock, but read without it to choose the victim
+    struct Range
+    {
+        std::mutex mutex;
+        std::atomic<size_t> begin{ 0 };
+        std::atomic<size_t> end{ 0 };
+    };
+
+    Range *ranges_;
+    size_t threads_;
+
+    std::mutex merge_mutex_;
+    bool *finished_;
+    size_t count_;
+    size_t merged_ = 0;
+
+public:
+    // The ranges and the states of the chunks are taken from scratch, which must outlive the scheduler
+    WorkStealing(size_t count, size_t threads, PlaneArena::Frame &scratch);
+
+    WorkStealing(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    ~WorkStealing();
+
+    // Take a chunk for the thread, return false when all the chunks are taken
+    bool Next(size_t thread, size_t &chunk);
+
+    // merge is passed by std::cref as well
+    void Finish(size_t chunk, const std::function<void(size_t)> &merge);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
@@ -0,0 +1,103 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+#ifndef TRANSFORMCACHE_H_
+#define TRANSFORMCACHE_H_
+
+
+#include "BM3D.h"
+#include "PlaneArena.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// 2D transforms of the blocks of one or more planes, each computed once and shared by all the groups containing the block.
+// The 3D transform of a group is then completed by the 1D transform along the group axis.
+// For a single plane, the transforms are kept in a ring of rows of block positions, the row y in the slot row y % rows.
+// The groups of neighbouring reference blocks mostly come from the same rows within the block-matching range,
+// thus the rows are recycled as the reference blocks move down.
+// For the planes of several frames, only the matched blocks are kept, each hashed to one slot of a fixed number of them,
+// thus the memory follows the blocks the reference blocks may match rather than the rows of every frame.
+// A block evicted from the cache is simply transformed again.
+class TransformCache
+{
+public:
+    typedef TransformCache _Myt;
+    typedef Pos PosType;
+
+private:
+    // The single plane of the ring points src_ to plane_
+    const FLType *plane_ = nullptr;
+    const FLType *const *src_ = nullptr;
+    PCType stride_;
+    PCType block_size_;
+    PCType pos_height_;
+    PCType pos_width_;
+
+    // Rows of the ring, 0 when the blocks are hashed into 2^(64 - shift_) slots
+    PCType rows_ = 0;
+    int shift_ = 0;
+
+    // Every slot is padded to a multiple of 16 values, so that all the slots keep the alignment of the planned buffer
+    size_t slot_size_;
+
+    // Transforms of the plane, whose 2D transform is applied in place to one slot
+    const BM3D_FilterData &filter_;
+
+    // Slots of the cache and the key of the block held by each of them, its position index over the frames, or Empty
+    FLType *data_ = nullptr;
+    size_t *tag_ = nullptr;
+
+    static const size_t Empty = static_cast<size_t>(-1);
+
+public:
+    // Ring of rows of the plane src, taken from scratch which must outlive the cache
+    TransformCache(const FLType *src, PCType height, PCType width, PCType stride,
+        PCType block_size, PCType rows, const BM3D_FilterData &filter, PlaneArena::Frame &scratch);
+
+    // At least slots hashed slots for the planes src[0, frames), capped at the blocks of all the planes,
+    // src must outlive the cache as well
+    TransformCache(const FLType *const *src, int frames, PCType height, PCType width, PCType stride,
+        PCType block_size, size_t slots, const BM3D_FilterData &filter, PlaneArena::Frame &scratch);
+
+    TransformCache(const _Myt &right) = delete;
+    _Myt &operator=(const _Myt &right) = delete;
+
+    // Slot size of the 2D transform, whose FFTW plan should be planned in place on a buffer allocated by AlignedMalloc
+    static size_t SlotSize(PCType block_size);
+
+    // Copy the 2D transform of the block at pos in the plane of the frame to dst, computing it first if it's not cached
+    void CopyTo(FLType *dst, const PosType &pos, int frame = 0);
+
+private:
+    void Allocate(size_t slots, PlaneArena::Frame &scratch);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
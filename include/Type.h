@@ -473,6 +473,18 @@ struct KeyPair
 };
 
 
+// Strict weak ordering of key pairs by key, then by value,
+// so that selecting the smallest elements doesn't depend on the order of the input
+struct KeyPairLess
+{
+    template < typename _Ty >
+    bool operator()(const _Ty &left, const _Ty &right) const
+    {
+        return left.first < right.first || (left.first == right.first && left.second < right.second);
+    }
+};
+
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
@@ -27,6 +27,7 @@
 
 
 #include "BM3D.h"
+#include "PlaneArena.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -26,7 +26,14 @@
 #define VBM3D_BASE_H_
 
 
+#include <mutex>
+#include <optional>
+#include "Accumulator.h"
 #include "BM3D.h"
+#include "HierarchicalSearch.h"
+#include "PlaneArena.h"
+#include "ThreadPool.h"
+#include "TransformCache.h"
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -65,11 +72,25 @@ public:
 
     bool wiener;
     ColorMatrix matrix;
+    SIMDLevel simd = SIMDLevel::None;
+    int bm_mode = 0;
+    int dct_cache = 0;
+    int group_transform = 0;
+    std::string wisdom;
+    int plan_flags = 2;
+    int threads = 1;
+
+    // Workers filtering the chunks of a frame along with the calling thread, null when threads is 1
+    std::shared_ptr<ThreadPool> pool;
 
     _Mypara para_default;
     _Mypara para;
     std::vector<BM3D_FilterData> f;
 
+    // Chunks of the rows of reference blocks, the same for every frame, built by the first one
+    mutable std::once_flag layout_once;
+    mutable ChunkLayout layout;
+
 public:
     explicit VBM3D_Data_Base(bool _wiener,
         const VSAPI *_vsapi = nullptr, std::string _FunctionName = "VBase", std::string _NameSpace = "bm3d")
@@ -85,6 +106,8 @@ public:
     virtual ~VBM3D_Data_Base() override
     {
         if (rdef && rnode) vsapi->freeNode(rnode);
+
+        if (!wisdom.empty()) PlanCache::ExportWisdom(wisdom);
     }
 
     virtual int arguments_process(const VSMap *in, VSMap *out) override;
@@ -117,12 +140,39 @@ public:
     typedef block_type::KeyCode KeyCode;
     typedef block_type::PosCode PosCode;
     typedef block_type::PosPairCode PosPairCode;
+    typedef block_type::PosPairTopK PosPairTopK;
 
     typedef BlockGroup<FLType, FLType> block_group;
     typedef block_group::Pos3Type Pos3Type;
     typedef block_group::Pos3Pair Pos3Pair;
     typedef block_group::Pos3Code Pos3Code;
     typedef block_group::Pos3PairCode Pos3PairCode;
+    typedef block_group::Pos3PairTopK Pos3PairTopK;
+
+    // Search engine, matched codes and search positions of a worker thread, kept for its following frames
+    struct Workspace
+    {
+        HierarchicalSearch hs;
+        Pos3PairTopK matchCode;
+        PosPairTopK frameMatch;
+        SearchPosGrid searchPos;
+        PosCode curPosCode;
+        PosCode prePosCode;
+    };
+
+    // Frame and plane pointers of a worker thread, cleared and filled again by each of its frames
+    struct FrameLists
+    {
+        std::vector<const VSFrame *> src;
+        std::vector<const VSFrame *> ref;
+        std::vector<const uint8_t *> ref_int8;
+        std::vector<const uint16_t *> ref_int16;
+        std::vector<FLType *> dst[3];
+        std::vector<const FLType *> srcf[3];
+        std::vector<const FLType *> reff[3];
+
+        static FrameLists &Local(int frames);
+    };
 
 private:
     const _Mydata &d;
@@ -133,8 +183,10 @@ protected:
     int cur;
     int frames;
 
-    std::vector<const VSFrame *> v_src;
-    std::vector<const VSFrame *> v_ref;
+    FrameLists &lists;
+
+    std::vector<const VSFrame *> &v_src;
+    std::vector<const VSFrame *> &v_ref;
 
     const VSVideoFormat *rfi = nullptr;
 
@@ -148,10 +200,19 @@ protected:
 
     bool full = true;
 
+    // Reference Y planes of integer input used directly by block matching, empty when it runs on the floating point planes
+    std::vector<const uint8_t *> &ref_int8;
+    std::vector<const uint16_t *> &ref_int16;
+    PCType ref_int_range = 0;
+
 private:
     template < typename _Ty >
     void process_core();
 
+    // Appends the reference Y plane of the next frame for block matching, false if it runs on the floating point planes
+    template < typename _Ty >
+    bool IntegerMatching(const _Ty *refY);
+
     template < typename _Ty >
     void process_core_gray();
 
@@ -168,15 +229,11 @@ protected:
 
 public:
     VBM3D_Process_Base(const _Mydata &_d, int _n, VSFrameContext *_frameCtx, VSCore *_core, const VSAPI *_vsapi)
-        : _Mybase(_d, _n, _frameCtx, _core, _vsapi), d(_d)
+        : _Mybase(_d, _n, _frameCtx, _core, _vsapi), d(_d),
+        b_offset(-Min(n - 0, d.para.radius)), f_offset(Min(d.vi->numFrames - 1 - n, d.para.radius)),
+        cur(-b_offset), frames(f_offset - b_offset + 1), lists(FrameLists::Local(frames)),
+        v_src(lists.src), v_ref(lists.ref), ref_int8(lists.ref_int8), ref_int16(lists.ref_int16)
     {
-        int total_frames = d.vi->numFrames;
-        int radius = d.para.radius;
-
-        b_offset = -Min(n - 0, radius);
-        f_offset = Min(total_frames - 1 - n, radius);
-        cur = -b_offset;
-        frames = f_offset - b_offset + 1;
 
         for (int o = b_offset; o <= f_offset; ++o)
         {
@@ -311,18 +368,65 @@ protected:
         vsapi->mapSetIntArray(dst_map, "BM3D_V_process", process, VSMaxPlaneCount);
     }
 
+    // The workspace of the calling thread
+    static Workspace &Local();
+
     void Kernel(const std::vector<FLType *> &dst, const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref) const;
 
     void Kernel(const std::vector<FLType *> &dstY, const std::vector<FLType *> &dstU, const std::vector<FLType *> &dstV,
         const std::vector<const FLType *> &srcY, const std::vector<const FLType *> &srcU, const std::vector<const FLType *> &srcV,
         const std::vector<const FLType *> &refY, const std::vector<const FLType *> &refU, const std::vector<const FLType *> &refV) const;
 
-    Pos3PairCode BlockMatching(const std::vector<const FLType *> &ref, PCType j, PCType i) const;
+    // Vertical positions of the rows of reference blocks in scan order
+    std::vector<PCType> ReferenceRows() const;
+
+    // The rows of reference blocks split into chunks for the threads, see Accumulator::Chunks
+    const ChunkLayout &Layout() const;
+
+    // Largest vertical distance between a reference block and its matched blocks in any frame
+    PCType MatchReach() const;
+
+    // The engine, the caches and the search positions take their buffers from the scratch of the worker,
+    // the engine is kept in the workspace of its thread
+
+    // Coarse-to-fine engine for the reference plane in current frame, null unless bm_mode is 1
+    HierarchicalSearch *HierarchicalEngine(Workspace &ws, const std::vector<const FLType *> &ref, PlaneArena::Frame &scratch) const;
+
+    // Block moments of the reference plane in each frame for pruning the search, taken from scratch,
+    // null for a frame when block matching is skipped
+    const BlockMoments *const *BlockMomentsMap(const std::vector<const FLType *> &ref, PlaneArena::Frame &scratch) const;
+
+    // 2D-transform cache of the source or reference planes of the frames for collaborative filtering, null unless dct_cache is 1
+    TransformCache *TransformCacheMap(std::optional<TransformCache> &cache, const std::vector<const FLType *> &src,
+        PCType height, PCType width, PCType stride, int plane, PlaneArena::Frame &scratch) const;
+
+    // Bind the grid of the search positions to the stamps of the reference plane, unless block matching is skipped
+    void SearchPosMap(SearchPosGrid &searchPos, PlaneArena::Frame &scratch) const;
+
+    // The matched code is collected in place, matchCode, frameMatch, searchPos and the predictive search positions
+    // curPosCode and prePosCode are reused for every reference block in a thread
+    void BlockMatching(Pos3PairTopK &matchCode, PosPairTopK &frameMatch, SearchPosGrid &searchPos,
+        PosCode &curPosCode, PosCode &prePosCode,
+        const std::vector<const FLType *> &ref, const BlockMoments *const *moments,
+        PCType j, PCType i, HierarchicalSearch *hs = nullptr) const;
+
+    template < typename _St1 >
+    void BlockMatchingFrames(Pos3PairTopK &matchCode, PosPairTopK &frameMatch, SearchPosGrid &searchPos,
+        PosCode &curPosCode, PosCode &prePosCode,
+        const std::vector<const _St1 *> &ref, _St1 ref_range, const BlockMoments *const *moments,
+        PCType j, PCType i, HierarchicalSearch *hs) const;
+
+    // Construct the group guided by matched pos code and apply forward 3D transform to it,
+    // the group is a view over buffer of GroupStride(para.GroupSize) values
+    block_group ForwardGroup(int plane, FLType *buffer, const std::vector<const FLType *> &src, PCType stride,
+        TransformCache *cache, const Pos3PairCode &code, PCType GroupSize) const;
 
-    virtual void CollaborativeFilter(int plane,
-        const std::vector<FLType *> &ResNum, const std::vector<FLType *> &ResDen,
+    // acc holds the planes of all the frames,
+    // buffer holds the group (2 with the reference group) each of GroupStride(para.GroupSize) values
+    virtual void CollaborativeFilter(int plane, Accumulator &acc,
         const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref,
-        const Pos3PairCode &code) const = 0;
+        TransformCache *srcCache, TransformCache *refCache,
+        FLType *buffer, const Pos3PairCode &code) const = 0;
 };
 
 
@@ -77,10 +77,10 @@ public:
     virtual ~VBM3D_Basic_Process() override {}
 
 protected:
-    virtual void CollaborativeFilter(int plane,
-        const std::vector<FLType *> &ResNum, const std::vector<FLType *> &ResDen,
+    virtual void CollaborativeFilter(int plane, Accumulator &acc,
         const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref,
-        const Pos3PairCode &code) const override;
+        TransformCache *srcCache, TransformCache *refCache,
+        FLType *buffer, const Pos3PairCode &code) const override;
 };
 
 
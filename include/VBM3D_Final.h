@@ -39,6 +39,10 @@ public:
     typedef VBM3D_Final_Data _Myt;
     typedef VBM3D_Data_Base _Mybase;
 
+public:
+    // Empirical Wiener shrinkage selected by the instruction set and wiener_mode
+    WienerFunc wiener_filter = nullptr;
+
 public:
     VBM3D_Final_Data(const VSAPI *_vsapi = nullptr, std::string _FunctionName = "VFinal", std::string _NameSpace = "bm3d")
         : _Mybase(true, _vsapi, _FunctionName, _NameSpace)
@@ -77,10 +81,10 @@ public:
     virtual ~VBM3D_Final_Process() override {}
 
 protected:
-    virtual void CollaborativeFilter(int plane,
-        const std::vector<FLType *> &ResNum, const std::vector<FLType *> &ResDen,
+    virtual void CollaborativeFilter(int plane, Accumulator &acc,
         const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref,
-        const Pos3PairCode &code) const override;
+        TransformCache *srcCache, TransformCache *refCache,
+        FLType *buffer, const Pos3PairCode &code) const override;
 };
 
 
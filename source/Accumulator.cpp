@@ -0,0 +1,134 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+
+#include "Accumulator.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class Accumulator
+
+
+void Accumulator::Merge(PCType BlockSize)
+{
+    const FLType *srcp = data_.data();
+
+    for (const auto offset : offset_)
+    {
+        AddRow(offset, srcp, BlockSize, srcp[BlockSize], srcp[BlockSize + 1]);
+        srcp += BlockSize + 2;
+    }
+
+    offset_.clear();
+    data_.clear();
+}
+
+
+std::vector<Accumulator> &Accumulator::Local(int plane, size_t count)
+{
+    thread_local std::vector<_Myt> local[3];
+    std::vector<_Myt> &acc = local[plane];
+
+    if (acc.size() < count)
+    {
+        const RetainedAllocations retained;
+        acc.resize(count);
+    }
+
+    return acc;
+}
+
+
+void Accumulator::Chunks(ChunkLayout &layout, size_t threads, PCType reach,
+    PCType height, PCType width, PCType BlockSize, PCType BlockStep, PCType GroupSize)
+{
+    const auto &rows = layout.rows;
+
+    // Each chunk spans at least twice the rows of pixels shared with a neighbouring chunk
+    const size_t shared = static_cast<size_t>((reach * 2 + BlockSize + BlockStep - 1) / BlockStep);
+    const size_t count = Max(Min(threads * ChunksPerThread, rows.size() / (shared * 2)), Min(threads, rows.size()));
+
+    if (count <= 1)
+    {
+        layout.chunks = { 0, rows.size() };
+        layout.top.assign(1, 0);
+        layout.bottom.assign(1, height);
+        layout.deferred.assign(1, 0);
+        return;
+    }
+
+    const PCType BlockPosBottom = height - BlockSize;
+
+    std::vector<size_t> &chunks = layout.chunks;
+    std::vector<PCType> upper(count), lower(count);
+
+    chunks.resize(count + 1);
+
+    for (size_t c = 0; c <= count; ++c)
+    {
+        chunks[c] = rows.size() * c / count;
+    }
+
+    // Rows of pixels reached by the matched blocks of each chunk
+    for (size_t c = 0; c < count; ++c)
+    {
+        upper[c] = Max(rows[chunks[c]] - reach, PCType(0));
+        lower[c] = Min(rows[chunks[c + 1] - 1] + reach, BlockPosBottom) + BlockSize;
+    }
+
+    layout.top.assign(count, 0);
+    layout.bottom.assign(count, height);
+
+    for (size_t c = 0; c < count; ++c)
+    {
+        if (c > 0) layout.top[c] = lower[c - 1];
+        if (c + 1 < count) layout.bottom[c] = upper[c + 1];
+    }
+
+    // Reference blocks of a row, the last one moved to the right border
+    const size_t columns = static_cast<size_t>((width - BlockSize + BlockStep * 2 - 1) / BlockStep);
+
+    // A block matched at y defers its rows outside [top, bottom), which are the most at either end of the reach
+    layout.deferred.assign(count, 0);
+
+    for (size_t c = 0; c < count; ++c)
+    {
+        const PCType top = layout.top[c];
+        const PCType bottom = layout.bottom[c];
+
+        const auto outside = [&](PCType y)
+        {
+            return BlockSize - Max(Min(y + BlockSize, bottom) - Max(y, top), PCType(0));
+        };
+
+        for (size_t r = chunks[c]; r < chunks[c + 1]; ++r)
+        {
+            const PCType j = rows[r];
+            const PCType rowsOutside = Max(outside(Max(j - reach, PCType(0))), outside(Min(j + reach, BlockPosBottom)));
+
+            layout.deferred[c] += static_cast<size_t>(rowsOutside) * columns * GroupSize;
+        }
+    }
+}
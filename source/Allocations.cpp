@@ -0,0 +1,177 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+
+
+
+// Debug replacement of the global allocation functions, counting the allocations of each thread in Allocations(),
+// so that the filters can assert that a steady-state frame allocates nothing.
+// Only the allocations made by the plugin are counted, the shared module binds its own calls to these functions.
+
+
+#ifndef NDEBUG
+
+
+#include <cstdlib>
+#include <new>
+#include "Helper.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+static void *Allocate(size_t size)
+{
+    void *memory = malloc(size > 0 ? size : 1);
+    if (!memory) throw std::bad_alloc();
+
+    ++Allocations().total;
+    return memory;
+}
+
+
+static void *Allocate(size_t size, std::align_val_t alignment)
+{
+    void *memory = vsh::vsh_aligned_malloc<void>(size > 0 ? size : 1, static_cast<size_t>(alignment));
+    if (!memory) throw std::bad_alloc();
+
+    ++Allocations().total;
+    return memory;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+void *operator new(size_t size)
+{
+    return Allocate(size);
+}
+
+void *operator new[](size_t size)
+{
+    return Allocate(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    try { return Allocate(size); }
+    catch (...) { return nullptr; }
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    try { return Allocate(size); }
+    catch (...) { return nullptr; }
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    return Allocate(size, alignment);
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return Allocate(size, alignment);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    try { return Allocate(size, alignment); }
+    catch (...) { return nullptr; }
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    try { return Allocate(size, alignment); }
+    catch (...) { return nullptr; }
+}
+
+
+void operator delete(void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, const std::nothrow_t &) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void *memory, const std::nothrow_t &) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void *memory, std::align_val_t) noexcept
+{
+    vsh::vsh_aligned_free(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t) noexcept
+{
+    vsh::vsh_aligned_free(memory);
+}
+
+void operator delete(void *memory, size_t, std::align_val_t) noexcept
+{
+    vsh::vsh_aligned_free(memory);
+}
+
+void operator delete[](void *memory, size_t, std::align_val_t) noexcept
+{
+    vsh::vsh_aligned_free(memory);
+}
+
+void operator delete(void *memory, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    vsh::vsh_aligned_free(memory);
+}
+
+void operator delete[](void *memory, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    vsh::vsh_aligned_free(memory);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+#endif
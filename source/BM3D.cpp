@@ -134,73 +134,368 @@ void BM3D_Para::thMSE_Default()
 // Functions of struct BM3D_FilterData
 
 
-BM3D_FilterData::BM3D_FilterData(bool wiener, double sigma, PCType GroupSize, PCType BlockSize, double lambda)
-    : fp(GroupSize), bp(GroupSize), finalAMP(GroupSize), thrTable(wiener ? 0 : GroupSize),
-    wienerSigmaSqr(wiener ? GroupSize : 0)
+BM3D_FilterData::BM3D_FilterData(bool wiener, double sigma, PCType GroupSize, PCType BlockSize, double lambda,
+    int GroupTransform, SIMDLevel simd, bool cache, unsigned PlanFlags)
+    : group_transform(GroupTransform), block_size(BlockSize),
+    wiener(wiener), sigma(sigma), lambda(lambda), plan_flags(PlanFlags),
+    sizes(new SizeData[GroupSize])
 {
-    const unsigned int flags = FFTW_PATIENT;
     const fftw::r2r_kind fkind = FFTW_REDFT10;
     const fftw::r2r_kind bkind = FFTW_REDFT01;
 
-    FLType *temp = nullptr;
+    // Only the 2D transforms are needed when the group axis isn't transformed by DCT
+    const bool dct3d = group_transform == 0;
+    const PCType dctGroupSize = dct3d ? GroupSize : 0;
 
-    for (PCType i = 1; i <= GroupSize; ++i)
+    // FFTW is only planned for the block sizes the specialized kernels don't handle
+    const bool plan = !BlockDCT::Supported(BlockSize, dctGroupSize);
+
+    plan3d = plan && dct3d;
+    plan1d = plan3d && cache;
+
+    if (!plan)
+    {
+        dct = std::make_shared<const BlockDCT>(BlockSize, dctGroupSize, simd);
+    }
+
+    // Backward DCT of the unit vector of each coefficient, following the definition of REDFT01
+    if (!wiener)
+    {
+        const double pi = 3.14159265358979323846;
+
+        blockBasis.resize(BlockSize * BlockSize);
+
+        for (PCType u = 0; u < BlockSize; ++u)
+        {
+            for (PCType j = 0; j < BlockSize; ++j)
+            {
+                blockBasis[u * BlockSize + j] = static_cast<FLType>(u == 0 ? 1.0
+                    : 2 * cos(pi * u * (2 * j + 1) / (2.0 * BlockSize)));
+            }
+        }
+    }
+
+    // The blocks in a group are only aligned for the block sizes of multiples of 4
+    if (plan && (cache || !dct3d))
+    {
+        const unsigned flags2d = BlockSize % 4 == 0 ? plan_flags : plan_flags | FFTW_UNALIGNED;
+
+        fp2d = PlanCache::Plan2D(BlockSize, BlockSize, fkind, flags2d);
+        if (!dct3d) bp2d = PlanCache::Plan2D(BlockSize, BlockSize, bkind, flags2d);
+    }
+}
+
+
+const BM3D_FilterData::SizeData &BM3D_FilterData::Size(PCType GroupSize) const
+{
+    SizeData &size = sizes[GroupSize - 1];
+
+    std::call_once(size.once, [&]()
+    {
+        // Kept by the filter for all the following frames
+        const RetainedAllocations retained;
+        BuildSize(size, GroupSize);
+    });
+
+    return size;
+}
+
+
+void BM3D_FilterData::BuildSize(SizeData &size, PCType GroupSize) const
+{
+    const fftw::r2r_kind fkind = FFTW_REDFT10;
+    const fftw::r2r_kind bkind = FFTW_REDFT01;
+    const PCType BlockSize = block_size;
+    const PCType i = GroupSize;
+    const bool dct3d = group_transform == 0;
+
+    if (plan3d)
+    {
+        size.fp = PlanCache::Plan3D(i, BlockSize, BlockSize, fkind, plan_flags);
+        size.bp = PlanCache::Plan3D(i, BlockSize, BlockSize, bkind, plan_flags);
+    }
+
+    // The group axis is the outermost, every coefficient of the 2D transforms is transformed along it
+    if (plan1d)
+    {
+        const int n = i;
+        const int howmany = BlockSize * BlockSize;
+        size.fp1d = PlanCache::Plan(1, &n, howmany, howmany, 1, &fkind, plan_flags);
+    }
+
+    // Both the gain and the amplification of the round trip along the group axis are 2 * i for DCT,
+    // i for the unnormalized Walsh-Hadamard transform and 1 for the orthonormal Haar transform
+    const double groupAMP = group_transform == 0 ? 2 * i : group_transform == 2 ? i : 1;
+
+    size.finalAMP = groupAMP * 2 * BlockSize * 2 * BlockSize;
+    double forwardAMP = sqrt(size.finalAMP);
+
+    if (wiener)
     {
-        AlignedMalloc(temp, i * BlockSize * BlockSize);
-        fp[i - 1].r2r_3d(i, BlockSize, BlockSize, temp, temp, fkind, fkind, fkind, flags);
-        bp[i - 1].r2r_3d(i, BlockSize, BlockSize, temp, temp, bkind, bkind, bkind, flags);
-        AlignedFree(temp);
+        // Floor at the smallest positive normal float so that refSquare + sigmaSquare
+        // can never be exactly zero in the Wiener filter (avoids 0/0 -> NaN when sigma
+        // is 0, which is reachable for RGB where the plane is always processed).
+        size.wienerSigmaSqr = Max(std::numeric_limits<FLType>::min(),
+            static_cast<FLType>(sigma * forwardAMP * sigma * forwardAMP));
+    }
+    else
+    {
+        double thrBase = sigma * lambda * forwardAMP;
+        std::vector<double> thr(4);
+        
+        thr[0] = thrBase;
+        thr[1] = thrBase * sqrt(double(2));
+        thr[2] = thrBase * double(2);
+        thr[3] = thrBase * sqrt(double(8));
+
+        FLType *thrp = nullptr;
+        AlignedMalloc(thrp, i * BlockSize * BlockSize);
+        size.thrTable.reset(thrp, [](FLType *memory)
+        {
+            AlignedFree(memory);
+        });
+
+        for (PCType z = 0; z < i; ++z)
+        {
+            for (PCType y = 0; y < BlockSize; ++y)
+            {
+                for (PCType x = 0; x < BlockSize; ++x, ++thrp)
+                {
+                    int flag = 0;
+
+                    if (x == 0)
+                    {
+                        ++flag;
+                    }
+                    if (y == 0)
+                    {
+                        ++flag;
+                    }
+                    if (z == 0 && dct3d)
+                    {
+                        ++flag;
+                    }
+
+                    *thrp = static_cast<FLType>(thr[flag]);
+                }
+            }
+        }
 
-        finalAMP[i - 1] = 2 * i * 2 * BlockSize * 2 * BlockSize;
-        double forwardAMP = sqrt(finalAMP[i - 1]);
+        // Backward transform of the unit vector of each coefficient along the group axis
+        size.groupBasis.resize(i * i);
 
-        if (wiener)
+        if (dct3d)
         {
-            // Floor at the smallest positive normal float so that refSquare + sigmaSquare
-            // can never be exactly zero in the Wiener filter (avoids 0/0 -> NaN when sigma
-            // is 0, which is reachable for RGB where the plane is always processed).
-            wienerSigmaSqr[i - 1] = Max(std::numeric_limits<FLType>::min(),
-                static_cast<FLType>(sigma * forwardAMP * sigma * forwardAMP));
+            const double pi = 3.14159265358979323846;
+
+            for (PCType z = 0; z < i; ++z)
+            {
+                for (PCType k = 0; k < i; ++k)
+                {
+                    size.groupBasis[z * i + k] = static_cast<FLType>(z == 0 ? 1.0
+                        : 2 * cos(pi * z * (2 * k + 1) / (2.0 * i)));
+                }
+            }
         }
         else
         {
-            double thrBase = sigma * lambda * forwardAMP;
-            std::vector<double> thr(4);
-            
-            thr[0] = thrBase;
-            thr[1] = thrBase * sqrt(double(2));
-            thr[2] = thrBase * double(2);
-            thr[3] = thrBase * sqrt(double(8));
-
-            FLType *thrp = nullptr;
-            AlignedMalloc(thrp, i * BlockSize * BlockSize);
-            thrTable[i - 1].reset(thrp, [](FLType *memory)
+            // The butterflies are applied to i blocks of i pixels, the pixel z of the block k starting from the unit vectors
+            std::vector<FLType> unit(i * i, 0);
+
+            for (PCType z = 0; z < i; ++z)
             {
-                AlignedFree(memory);
-            });
+                unit[z * i + z] = 1;
+            }
+
+            GroupButterflies(unit.data(), i, false, i);
 
             for (PCType z = 0; z < i; ++z)
             {
-                for (PCType y = 0; y < BlockSize; ++y)
+                for (PCType k = 0; k < i; ++k)
+                {
+                    size.groupBasis[z * i + k] = unit[k * i + z];
+                }
+            }
+        }
+    }
+}
+
+
+void BM3D_FilterData::Forward(FLType *data, PCType GroupSize) const
+{
+    if (group_transform == 0)
+    {
+        if (dct) dct->Forward(data, GroupSize);
+        else Size(GroupSize).fp->execute_r2r(data, data);
+        return;
+    }
+
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        Forward2D(data + z * block_size * block_size);
+    }
+
+    GroupButterflies(data, GroupSize, true);
+}
+
+
+void BM3D_FilterData::Backward(FLType *data, PCType GroupSize) const
+{
+    if (group_transform == 0)
+    {
+        if (dct) dct->Backward(data, GroupSize);
+        else Size(GroupSize).bp->execute_r2r(data, data);
+        return;
+    }
+
+    GroupButterflies(data, GroupSize, false);
+
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        Backward2D(data + z * block_size * block_size);
+    }
+}
+
+
+void BM3D_FilterData::Forward2D(FLType *block) const
+{
+    if (dct) dct->Forward2D(block);
+    else fp2d->execute_r2r(block, block);
+}
+
+
+void BM3D_FilterData::Backward2D(FLType *block) const
+{
+    if (dct) dct->Backward2D(block);
+    else bp2d->execute_r2r(block, block);
+}
+
+
+void BM3D_FilterData::Forward1D(FLType *data, PCType GroupSize) const
+{
+    if (group_transform != 0) GroupButterflies(data, GroupSize, true);
+    else if (dct) dct->Forward1D(data, GroupSize);
+    else Size(GroupSize).fp1d->execute_r2r(data, data);
+}
+
+
+bool BM3D_FilterData::BackwardSparse(FLType *data, PCType GroupSize, PCType nonzero) const
+{
+    if (nonzero > SparseLimit)
+    {
+        return false;
+    }
+
+    // Nothing left, the backward transform is also zero
+    if (nonzero == 0)
+    {
+        return true;
+    }
+
+    const PCType BlockSize = block_size;
+    const PCType pixels = BlockSize * BlockSize;
+    const PCType count = GroupSize * pixels;
+    const FLType *groupBasis = Size(GroupSize).groupBasis.data();
+
+    PCType index[SparseLimit];
+    FLType coef[SparseLimit];
+    PCType found = 0;
+
+    for (PCType n = 0; n < count && found < nonzero; ++n)
+    {
+        if (data[n] != 0)
+        {
+            index[found] = n;
+            coef[found++] = data[n];
+        }
+    }
+
+    // The flat groups keep only the DC coefficient, whose backward transform is a constant
+    if (found == 1 && index[0] == 0)
+    {
+        const FLType value = coef[0] * groupBasis[0];
+
+        for (PCType n = 0; n < count; ++n)
+        {
+            data[n] = value;
+        }
+
+        return true;
+    }
+
+    memset(data, 0, sizeof(FLType) * count);
+
+    for (PCType c = 0; c < found; ++c)
+    {
+        const PCType z = index[c] / pixels;
+        const PCType y = index[c] % pixels / BlockSize;
+        const PCType x = index[c] % BlockSize;
+        const FLType *bz = groupBasis + z * GroupSize;
+        const FLType *by = blockBasis.data() + y * BlockSize;
+        const FLType *bx = blockBasis.data() + x * BlockSize;
+
+        FLType *dstp = data;
+
+        for (PCType k = 0; k < GroupSize; ++k)
+        {
+            const FLType gz = coef[c] * bz[k];
+
+            for (PCType j = 0; j < BlockSize; ++j, dstp += BlockSize)
+            {
+                const FLType gy = gz * by[j];
+
+                for (PCType i = 0; i < BlockSize; ++i)
+                {
+                    dstp[i] += gy * bx[i];
+                }
+            }
+        }
+    }
+
+    return true;
+}
+
+
+void BM3D_FilterData::GroupButterflies(FLType *data, PCType GroupSize, bool forward, PCType pixels) const
+{
+    if (pixels == 0) pixels = block_size * block_size;
+
+    // The Haar butterflies are orthonormal and their own inverse, the Walsh-Hadamard ones only add and subtract
+    const bool haar = group_transform == 1;
+    const FLType scale = static_cast<FLType>(1 / sqrt(2.0));
+
+    // Haar pairs the low-pass coefficients left by the previous level, which sit at the multiples of s,
+    // coarse to fine for the inverse. The coefficients stay interleaved in place, the order doesn't matter to the filters
+    // Walsh-Hadamard pairs every block i without the bit s, and the levels commute
+    for (PCType level = 1; level < GroupSize; level *= 2)
+    {
+        const PCType s = forward || !haar ? level : GroupSize / level / 2;
+
+        for (PCType i0 = 0; i0 < GroupSize; i0 += s * 2)
+        {
+            for (PCType i = i0; i < (haar ? i0 + 1 : i0 + s); ++i)
+            {
+                FLType *p = data + i * pixels;
+                FLType *q = p + s * pixels;
+
+                if (haar)
+                {
+                    for (PCType k = 0; k < pixels; ++k)
+                    {
+                        const FLType a = p[k];
+                        const FLType b = q[k];
+                        p[k] = (a + b) * scale;
+                        q[k] = (a - b) * scale;
+                    }
+                }
+                else
                 {
-                    for (PCType x = 0; x < BlockSize; ++x, ++thrp)
+                    for (PCType k = 0; k < pixels; ++k)
                     {
-                        int flag = 0;
-
-                        if (x == 0)
-                        {
-                            ++flag;
-                        }
-                        if (y == 0)
-                        {
-                            ++flag;
-                        }
-                        if (z == 0)
-                        {
-                            ++flag;
-                        }
-
-                        *thrp = static_cast<FLType>(thr[flag]);
+                        const FLType a = p[k];
+                        const FLType b = q[k];
+                        p[k] = a + b;
+                        q[k] = a - b;
                     }
                 }
             }
@@ -22,6 +22,8 @@
 */
 
 
+#include <cstdlib>
+#include <functional>
 #include "BM3D_Base.h"
 
 
@@ -226,6 +228,99 @@ int BM3D_Data_Base::arguments_process(const VSMap *in, VSMap *out)
             throw std::string("Unsupported \"matrix\" specified");
         }
 
+        // opt - int
+        int opt = vsapi->mapGetIntSaturated(in, "opt", 0, &error);
+
+        if (error)
+        {
+            opt = 0;
+        }
+        else if (opt < 0 || opt > 3)
+        {
+            throw std::string("Invalid \"opt\" assigned, must be an integer in [0, 3]");
+        }
+
+        simd = SIMDLevel_Select(opt);
+
+        // bm_mode - int
+        bm_mode = vsapi->mapGetIntSaturated(in, "bm_mode", 0, &error);
+
+        if (error)
+        {
+            bm_mode = 0;
+        }
+        else if (bm_mode < 0 || bm_mode > 2)
+        {
+            throw std::string("Invalid \"bm_mode\" assigned, must be an integer in [0, 2]");
+        }
+
+        // group_transform - int
+        group_transform = vsapi->mapGetIntSaturated(in, "group_transform", 0, &error);
+
+        if (error)
+        {
+            group_transform = 0;
+        }
+        else if (group_transform < 0 || group_transform > 2)
+        {
+            throw std::string("Invalid \"group_transform\" assigned, must be an integer in [0, 2]");
+        }
+
+        // dct_cache - int
+        dct_cache = vsapi->mapGetIntSaturated(in, "dct_cache", 0, &error);
+
+        if (error)
+        {
+            dct_cache = 0;
+        }
+        else if (dct_cache < 0 || dct_cache > 1)
+        {
+            throw std::string("Invalid \"dct_cache\" assigned, must be an integer in [0, 1]");
+        }
+
+        // wisdom - data
+        auto wisdom_file = vsapi->mapGetData(in, "wisdom", 0, &error);
+
+        if (error)
+        {
+            const char *env = std::getenv("BM3D_WISDOM");
+            wisdom = env ? env : "";
+        }
+        else
+        {
+            wisdom = wisdom_file;
+        }
+
+        // plan_flags - int
+        plan_flags = vsapi->mapGetIntSaturated(in, "plan_flags", 0, &error);
+
+        if (error)
+        {
+            plan_flags = 2;
+        }
+        else if (plan_flags < 0 || plan_flags > 2)
+        {
+            throw std::string("Invalid \"plan_flags\" assigned, must be an integer in [0, 2]");
+        }
+
+        // threads - int
+        threads = vsapi->mapGetIntSaturated(in, "threads", 0, &error);
+
+        if (error)
+        {
+            threads = 1;
+        }
+        else if (threads < 0)
+        {
+            throw std::string("Invalid \"threads\" assigned, must be a non-negative integer");
+        }
+        else if (threads == 0)
+        {
+            threads = Max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        }
+
+        pool = ThreadPool::Shared(threads);
+
         // process
         for (int i = 0; i < VSMaxPlaneCount; i++)
         {
@@ -273,13 +368,19 @@ void BM3D_Data_Base::init_filter_data()
 
     para.thMSE *= normY;
 
+    // Plans measured by the previous processes are loaded from the wisdom file
+    if (!wisdom.empty()) PlanCache::ImportWisdom(wisdom);
+
+    const unsigned flags = plan_flags == 0 ? FFTW_ESTIMATE : plan_flags == 1 ? FFTW_MEASURE : FFTW_PATIENT;
+
     // Initialize BM3D data - FFTW plans, unnormalized transform amplification factor, hard threshold table, etc.
+    // The ones depending on the group size are only built when a group of the size is filtered
     if (process[0]) f[0] = BM3D_FilterData(wiener, para.sigma[0] / double(255) * normY,
-        para.GroupSize, para.BlockSize, para.lambda);
+        para.GroupSize, para.BlockSize, para.lambda, group_transform, simd, dct_cache != 0, flags);
     if (process[1]) f[1] = BM3D_FilterData(wiener, para.sigma[1] / double(255) * normU,
-        para.GroupSize, para.BlockSize, para.lambda);
+        para.GroupSize, para.BlockSize, para.lambda, group_transform, simd, dct_cache != 0, flags);
     if (process[2]) f[2] = BM3D_FilterData(wiener, para.sigma[2] / double(255) * normV,
-        para.GroupSize, para.BlockSize, para.lambda);
+        para.GroupSize, para.BlockSize, para.lambda, group_transform, simd, dct_cache != 0, flags);
 }
 
 
@@ -287,68 +388,117 @@ void BM3D_Data_Base::init_filter_data()
 // Functions of class BM3D_Process_Base
 
 
+BM3D_Process_Base::Workspace &BM3D_Process_Base::Local()
+{
+    thread_local Workspace ws;
+    return ws;
+}
+
+
 void BM3D_Process_Base::Kernel(FLType *dst, const FLType *src, const FLType *ref) const
 {
-    std::thread::id threadId = std::this_thread::get_id();
-    FLType *ResNum = dst, *ResDen = nullptr;
+#ifndef NDEBUG
+    const size_t kernelAllocations = Allocations().Transient();
+#endif
 
-    {
-        if (!d.buffer0.count(threadId))
-        {
-            std::unique_lock<std::shared_mutex> lock(d.mutex0);
-            AlignedMalloc(ResDen, dst_pcount[0]);
-            d.buffer0.emplace(threadId, ResDen);
-        }
-        else
-        {
-            std::shared_lock<std::shared_mutex> lock(d.mutex0);
-            ResDen = d.buffer0.at(threadId);
-        }
-    }
+    const auto buffer = d.buffer[0].Acquire(dst_pcount[0]);
+    FLType *ResNum = dst, *ResDen = buffer.get();
 
     memset(ResNum, 0, sizeof(FLType) * dst_pcount[0]);
     memset(ResDen, 0, sizeof(FLType) * dst_pcount[0]);
 
-    const PCType BlockPosBottom = height - d.para.BlockSize;
     const PCType BlockPosRight = width - d.para.BlockSize;
 
-    for (PCType j = 0;; j += d.para.BlockStep)
+    // The state shared by the workers is taken from the arena of the calling thread
+    PlaneArena::Frame shared;
+
+    const ChunkLayout &layout = Layout();
+    const size_t count = layout.count();
+    const size_t threads = Min(static_cast<size_t>(d.threads), count);
+    std::vector<Accumulator> &acc = Accumulator::Local(0, count);
+    WorkStealing scheduler(count, threads, shared);
+
+    for (size_t c = 0; c < count; ++c)
     {
-        // Handle scan of reference block - vertical
-        if (j >= BlockPosBottom + d.para.BlockStep)
-        {
-            break;
-        }
-        else if (j > BlockPosBottom)
-        {
-            j = BlockPosBottom;
-        }
+        acc[c].Reset(ResNum, ResDen, dst_stride[0]);
+    }
+
+    std::optional<BlockMoments> momentsMap;
+    const BlockMoments *moments = FullSearchApplicable() ? nullptr : BlockMomentsMap(momentsMap, ref, shared);
 
-        for (PCType i = 0;; i += d.para.BlockStep)
+    const auto merge = [&](size_t c)
+    {
+        acc[c].Merge(d.para.BlockSize);
+    };
+
+    const auto worker = [&](size_t t)
+    {
+#ifndef NDEBUG
+        const size_t allocations = Allocations().Transient();
+#endif
+
+        // The buffers of the worker are taken from the arena of its thread, and reused by its following frames
+        PlaneArena::Frame scratch;
+        Workspace &ws = Local();
+
+        FullSearch *fs = FullSearchEngine(ws, ref, scratch);
+        HierarchicalSearch *hs = HierarchicalEngine(ws, ref, scratch);
+        PredictiveSearch *ps = PredictiveEngine(ws, ref, scratch);
+        std::optional<TransformCache> srcCacheMap, refCacheMap;
+        TransformCache *srcCache = TransformCacheMap(srcCacheMap, src, src_height[0], src_width[0], src_stride[0], 0, scratch);
+        TransformCache *refCache = d.wiener ? TransformCacheMap(refCacheMap, ref, ref_height[0], ref_width[0], ref_stride[0], 0, scratch) : nullptr;
+        PosPairTopK &matchCode = ws.matchCode;
+        size_t c;
+
+        // The groups are views over the scratch, the source group followed by the reference group
+        FLType *groups = scratch.Get((d.wiener ? 2 : 1) * d.f[0].GroupStride(d.para.GroupSize));
+
+        while (scheduler.Next(t, c))
         {
-            // Handle scan of reference block - horizontal
-            if (i >= BlockPosRight + d.para.BlockStep)
-            {
-                break;
-            }
-            else if (i > BlockPosRight)
+            acc[c].Bound(layout.top[c], layout.bottom[c], layout.deferred[c], d.para.BlockSize);
+
+            for (size_t r = layout.chunks[c]; r < layout.chunks[c + 1]; ++r)
             {
-                i = BlockPosRight;
-            }
+                const PCType j = layout.rows[r];
 
-            // Form a group by block matching between reference block and its spatial neighborhood in the reference plane
-            PosPairCode matchCode = BlockMatching(ref, j, i);
+                for (PCType i = 0;; i += d.para.BlockStep)
+                {
+                    // Handle scan of reference block - horizontal
+                    if (i >= BlockPosRight + d.para.BlockStep)
+                    {
+                        break;
+                    }
+                    else if (i > BlockPosRight)
+                    {
+                        i = BlockPosRight;
+                    }
+
+                    // Form a group by block matching between reference block and its spatial neighborhood in the reference plane
+                    BlockMatching(matchCode, ref, j, i, fs, hs, ps, moments);
+
+                    // Get the filtered result through collaborative filtering and aggregation of matched blocks
+                    CollaborativeFilter(0, acc[c], src, ref, srcCache, refCache, groups, matchCode.get());
+                }
+            }
 
-            // Get the filtered result through collaborative filtering and aggregation of matched blocks
-            CollaborativeFilter(0, ResNum, ResDen, src, ref, matchCode);
+            scheduler.Finish(c, std::cref(merge));
         }
-    }
+
+        // Only the storage kept for the following frames may grow
+        assert(Allocations().Transient() == allocations);
+    };
+
+    if (threads > 1) d.pool->Run(threads, std::cref(worker));
+    else worker(0);
 
     // The filtered blocks are sumed and averaged to form the final filtered image
     LOOP_VH(dst_height[0], dst_width[0], dst_stride[0], [&](PCType i)
     {
         dst[i] = ResNum[i] / ResDen[i];
     });
+
+    // A frame in steady state doesn't allocate
+    assert(Allocations().Transient() == kernelAllocations);
 }
 
 
@@ -356,24 +506,19 @@ void BM3D_Process_Base::Kernel(FLType *dstY, FLType *dstU, FLType *dstV,
     const FLType *srcY, const FLType *srcU, const FLType *srcV,
     const FLType *refY, const FLType *refU, const FLType *refV) const
 {
-    std::thread::id threadId = std::this_thread::get_id();
+#ifndef NDEBUG
+    const size_t kernelAllocations = Allocations().Transient();
+#endif
+
+    BufferPool::Buffer buffer[3];
     FLType *ResNumY = dstY, *ResDenY = nullptr;
     FLType *ResNumU = dstU, *ResDenU = nullptr;
     FLType *ResNumV = dstV, *ResDenV = nullptr;
 
     if (d.process[0])
     {
-        if (!d.buffer0.count(threadId))
-        {
-            std::unique_lock<std::shared_mutex> lock(d.mutex0);
-            AlignedMalloc(ResDenY, dst_pcount[0]);
-            d.buffer0.emplace(threadId, ResDenY);
-        }
-        else
-        {
-            std::shared_lock<std::shared_mutex> lock(d.mutex0);
-            ResDenY = d.buffer0.at(threadId);
-        }
+        buffer[0] = d.buffer[0].Acquire(dst_pcount[0]);
+        ResDenY = buffer[0].get();
 
         memset(ResNumY, 0, sizeof(FLType) * dst_pcount[0]);
         memset(ResDenY, 0, sizeof(FLType) * dst_pcount[0]);
@@ -381,17 +526,8 @@ void BM3D_Process_Base::Kernel(FLType *dstY, FLType *dstU, FLType *dstV,
 
     if (d.process[1])
     {
-        if (!d.buffer1.count(threadId))
-        {
-            std::unique_lock<std::shared_mutex> lock(d.mutex1);
-            AlignedMalloc(ResDenU, dst_pcount[1]);
-            d.buffer1.emplace(threadId, ResDenU);
-        }
-        else
-        {
-            std::shared_lock<std::shared_mutex> lock(d.mutex1);
-            ResDenU = d.buffer1.at(threadId);
-        }
+        buffer[1] = d.buffer[1].Acquire(dst_pcount[1]);
+        ResDenU = buffer[1].get();
 
         memset(ResNumU, 0, sizeof(FLType) * dst_pcount[1]);
         memset(ResDenU, 0, sizeof(FLType) * dst_pcount[1]);
@@ -399,58 +535,151 @@ void BM3D_Process_Base::Kernel(FLType *dstY, FLType *dstU, FLType *dstV,
 
     if (d.process[2])
     {
-        if (!d.buffer2.count(threadId))
-        {
-            std::unique_lock<std::shared_mutex> lock(d.mutex2);
-            AlignedMalloc(ResDenV, dst_pcount[2]);
-            d.buffer2.emplace(threadId, ResDenV);
-        }
-        else
-        {
-            std::shared_lock<std::shared_mutex> lock(d.mutex2);
-            ResDenV = d.buffer2.at(threadId);
-        }
+        buffer[2] = d.buffer[2].Acquire(dst_pcount[2]);
+        ResDenV = buffer[2].get();
 
         memset(ResNumV, 0, sizeof(FLType) * dst_pcount[2]);
         memset(ResDenV, 0, sizeof(FLType) * dst_pcount[2]);
     }
 
-    const PCType BlockPosBottom = height - d.para.BlockSize;
     const PCType BlockPosRight = width - d.para.BlockSize;
 
-    for (PCType j = 0;; j += d.para.BlockStep)
+    // The state shared by the workers is taken from the arena of the calling thread
+    PlaneArena::Frame shared;
+
+    const ChunkLayout &layout = Layout();
+    const size_t count = layout.count();
+    const size_t threads = Min(static_cast<size_t>(d.threads), count);
+    FLType *const ResNums[3] = { ResNumY, ResNumU, ResNumV };
+    FLType *const ResDens[3] = { ResDenY, ResDenU, ResDenV };
+    std::vector<Accumulator> *acc[3] = {};
+    WorkStealing scheduler(count, threads, shared);
+
+    for (int plane = 0; plane < 3; ++plane)
     {
-        // Handle scan of reference block - vertical
-        if (j >= BlockPosBottom + d.para.BlockStep)
+        if (!d.process[plane]) continue;
+
+        acc[plane] = &Accumulator::Local(plane, count);
+
+        for (size_t c = 0; c < count; ++c)
         {
-            break;
+            (*acc[plane])[c].Reset(ResNums[plane], ResDens[plane], dst_stride[plane]);
         }
-        else if (j > BlockPosBottom)
+    }
+
+    std::optional<BlockMoments> momentsMap;
+    const BlockMoments *moments = FullSearchApplicable() ? nullptr : BlockMomentsMap(momentsMap, refY, shared);
+    const FLType *srcs[3] = { srcY, srcU, srcV };
+    const FLType *refs[3] = { refY, refU, refV };
+
+    // The 3 planes are filtered together unless any of them is skipped
+    const bool fused = d.process[0] && d.process[1] && d.process[2];
+
+    const auto merge = [&](size_t c)
+    {
+        for (int plane = 0; plane < 3; ++plane)
         {
-            j = BlockPosBottom;
+            if (d.process[plane]) (*acc[plane])[c].Merge(d.para.BlockSize);
         }
+    };
 
-        for (PCType i = 0;; i += d.para.BlockStep)
+    const auto worker = [&](size_t t)
+    {
+#ifndef NDEBUG
+        const size_t allocations = Allocations().Transient();
+#endif
+
+        // The buffers of the worker are taken from the arena of its thread, and reused by its following frames
+        PlaneArena::Frame scratch;
+        Workspace &ws = Local();
+
+        FullSearch *fs = FullSearchEngine(ws, refY, scratch);
+        HierarchicalSearch *hs = HierarchicalEngine(ws, refY, scratch);
+        PredictiveSearch *ps = PredictiveEngine(ws, refY, scratch);
+        std::optional<TransformCache> srcCacheMap[3], refCacheMap[3];
+        TransformCache *srcCache[3] = {}, *refCache[3] = {};
+        Accumulator *accs[3] = {};
+
+        for (int plane = 0; plane < 3; ++plane)
         {
-            // Handle scan of reference block - horizontal
-            if (i >= BlockPosRight + d.para.BlockStep)
+            if (d.process[plane])
             {
-                break;
+                srcCache[plane] = TransformCacheMap(srcCacheMap[plane], srcs[plane],
+                    src_height[plane], src_width[plane], src_stride[plane], plane, scratch);
             }
-            else if (i > BlockPosRight)
+            if (d.process[plane] && d.wiener)
+            {
+                refCache[plane] = TransformCacheMap(refCacheMap[plane], refs[plane],
+                    ref_height[plane], ref_width[plane], ref_stride[plane], plane, scratch);
+            }
+        }
+
+        // The groups are views over the scratch, the source groups followed by the reference groups
+        FLType *groups = scratch.Get((d.wiener ? 2 : 1) * (fused ? 3 : 1) * d.f[0].GroupStride(d.para.GroupSize));
+
+        const auto filter = [&](int plane, const PosPairCode &code)
+        {
+            if (!d.process[plane]) return;
+
+            CollaborativeFilter(plane, *accs[plane], srcs[plane], refs[plane],
+                srcCache[plane], refCache[plane], groups, code);
+        };
+
+        PosPairTopK &matchCode = ws.matchCode;
+        size_t c;
+
+        while (scheduler.Next(t, c))
+        {
+            for (int plane = 0; plane < 3; ++plane)
             {
-                i = BlockPosRight;
+                if (!d.process[plane]) continue;
+
+                accs[plane] = &(*acc[plane])[c];
+                accs[plane]->Bound(layout.top[c], layout.bottom[c], layout.deferred[c], d.para.BlockSize);
             }
 
-            // Form a group by block matching between reference block and its spatial neighborhood in the reference plane
-            PosPairCode matchCode = BlockMatching(refY, j, i);
+            for (size_t r = layout.chunks[c]; r < layout.chunks[c + 1]; ++r)
+            {
+                const PCType j = layout.rows[r];
+
+                for (PCType i = 0;; i += d.para.BlockStep)
+                {
+                    // Handle scan of reference block - horizontal
+                    if (i >= BlockPosRight + d.para.BlockStep)
+                    {
+                        break;
+                    }
+                    else if (i > BlockPosRight)
+                    {
+                        i = BlockPosRight;
+                    }
+
+                    // Form a group by block matching between reference block and its spatial neighborhood in the reference plane
+                    BlockMatching(matchCode, refY, j, i, fs, hs, ps, moments);
+
+                    // Get the filtered result through collaborative filtering and aggregation of matched blocks
+                    if (fused)
+                    {
+                        CollaborativeFilter3(accs, srcs, refs, srcCache, refCache, groups, matchCode.get());
+                    }
+                    else
+                    {
+                        filter(0, matchCode.get());
+                        filter(1, matchCode.get());
+                        filter(2, matchCode.get());
+                    }
+                }
+            }
 
-            // Get the filtered result through collaborative filtering and aggregation of matched blocks
-            if (d.process[0]) CollaborativeFilter(0, ResNumY, ResDenY, srcY, refY, matchCode);
-            if (d.process[1]) CollaborativeFilter(1, ResNumU, ResDenU, srcU, refU, matchCode);
-            if (d.process[2]) CollaborativeFilter(2, ResNumV, ResDenV, srcV, refV, matchCode);
+            scheduler.Finish(c, std::cref(merge));
         }
-    }
+
+        // Only the storage kept for the following frames may grow
+        assert(Allocations().Transient() == allocations);
+    };
+
+    if (threads > 1) d.pool->Run(threads, std::cref(worker));
+    else worker(0);
 
     // The filtered blocks are sumed and averaged to form the final filtered image
     if (d.process[0]) LOOP_VH(dst_height[0], dst_width[0], dst_stride[0], [&](PCType i)
@@ -467,26 +696,345 @@ void BM3D_Process_Base::Kernel(FLType *dstY, FLType *dstU, FLType *dstV,
     {
         dstV[i] = ResNumV[i] / ResDenV[i];
     });
+
+    // A frame in steady state doesn't allocate
+    assert(Allocations().Transient() == kernelAllocations);
+}
+
+
+std::vector<PCType> BM3D_Process_Base::ReferenceRows() const
+{
+    const PCType BlockPosBottom = height - d.para.BlockSize;
+    std::vector<PCType> rows;
+
+    for (PCType j = 0;; j += d.para.BlockStep)
+    {
+        // Handle scan of reference block - vertical
+        if (j >= BlockPosBottom + d.para.BlockStep)
+        {
+            break;
+        }
+        else if (j > BlockPosBottom)
+        {
+            j = BlockPosBottom;
+        }
+
+        rows.push_back(j);
+    }
+
+    return rows;
 }
 
 
-BM3D_Process_Base::PosPairCode BM3D_Process_Base::BlockMatching(
-    const FLType *ref, PCType j, PCType i) const
+const ChunkLayout &BM3D_Process_Base::Layout() const
 {
+    // The layout only depends on the format and the parameters, and it's kept by the filter
+    std::call_once(d.layout_once, [&]()
+    {
+        const RetainedAllocations retained;
+
+        d.layout.rows = ReferenceRows();
+        Accumulator::Chunks(d.layout, d.pool ? d.threads : 1, MatchReach(),
+            height, width, d.para.BlockSize, d.para.BlockStep, d.para.GroupSize);
+    });
+
+    return d.layout;
+}
+
+
+PCType BM3D_Process_Base::MatchReach() const
+{
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0)
+    {
+        return 0;
+    }
+
+    // The coarse matches are rounded by 2 pixels and refined within +-BMstep
+    if (d.bm_mode == 1)
+    {
+        return d.para.BMrange + d.para.BMstep + 1;
+    }
+
+    // Each predicted search may drift from the window by predict_range until the window is searched again
+    if (d.bm_mode == 2)
+    {
+        return d.para.BMrange + PredictiveSearch::refresh_interval * PredictiveSearch::predict_range;
+    }
+
+    return d.para.BMrange;
+}
+
+
+bool BM3D_Process_Base::FullSearchApplicable() const
+{
+    return d.para.GroupSize > 1 && d.para.thMSE > 0 && d.bm_mode == 0
+        && FullSearch::Worthwhile(ref_width[0], d.para.BlockSize, d.para.BlockStep, d.para.BMrange, d.para.BMstep);
+}
+
+
+FullSearch *BM3D_Process_Base::FullSearchEngine(Workspace &ws, const FLType *ref, PlaneArena::Frame &scratch) const
+{
+    if (!FullSearchApplicable())
+    {
+        return nullptr;
+    }
+
+    ws.fs.Reset(ref, ref_height[0], ref_width[0], ref_stride[0],
+        d.para.BlockSize, d.para.BlockStep, d.para.BMrange, d.para.BMstep, d.para.thMSE, d.simd, scratch);
+
+    return ws.fs.Valid() ? &ws.fs : nullptr;
+}
+
+
+HierarchicalSearch *BM3D_Process_Base::HierarchicalEngine(Workspace &ws, const FLType *ref, PlaneArena::Frame &scratch) const
+{
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0 || d.bm_mode != 1
+        || !HierarchicalSearch::Applicable(ref_height[0], ref_width[0], d.para.BlockSize))
+    {
+        return nullptr;
+    }
+
+    ws.hs.Reset(ref, ref_height[0], ref_width[0], ref_stride[0],
+        d.para.BlockSize, d.para.BMrange, d.para.BMstep, d.para.thMSE, d.simd, scratch);
+
+    return &ws.hs;
+}
+
+
+PredictiveSearch *BM3D_Process_Base::PredictiveEngine(Workspace &ws, const FLType *ref, PlaneArena::Frame &scratch) const
+{
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0 || d.bm_mode != 2)
+    {
+        return nullptr;
+    }
+
+    ws.ps.Reset(ref, ref_height[0], ref_width[0], ref_stride[0],
+        d.para.BlockSize, d.para.BMrange, d.para.BMstep, d.para.thMSE, d.simd, scratch);
+
+    return &ws.ps;
+}
+
+
+const BlockMoments *BM3D_Process_Base::BlockMomentsMap(std::optional<BlockMoments> &moments,
+    const FLType *ref, PlaneArena::Frame &scratch) const
+{
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0 || ref_int8 || ref_int16)
+    {
+        return nullptr;
+    }
+
+    moments.emplace(ref, ref_height[0], ref_width[0], ref_stride[0], d.para.BlockSize, scratch);
+
+    return moments->Valid() ? &*moments : nullptr;
+}
+
+
+TransformCache *BM3D_Process_Base::TransformCacheMap(std::optional<TransformCache> &cache, const FLType *src,
+    PCType height, PCType width, PCType stride, int plane, PlaneArena::Frame &scratch) const
+{
+    if (!d.dct_cache)
+    {
+        return nullptr;
+    }
+
+    // The matched blocks of a row of reference blocks lie within MatchReach of it
+    cache.emplace(src, height, width, stride, d.para.BlockSize, MatchReach() * 2 + 1, d.f[plane], scratch);
+
+    return &*cache;
+}
+
+
+void BM3D_Process_Base::BlockMatching(PosPairTopK &match_code,
+    const FLType *ref, PCType j, PCType i, FullSearch *fs, HierarchicalSearch *hs, PredictiveSearch *ps,
+    const BlockMoments *moments) const
+{
+    // The reference block is always the first element in the group
+    match_code.reset(d.para.GroupSize);
+    match_code.push_fixed(PosPair(KeyType(0), PosType(j, i)));
+
     // Skip block matching if GroupSize is 1 or thMSE is not positive,
     // and take the reference block as the only element in the group
     if (d.para.GroupSize == 1 || d.para.thMSE <= 0)
     {
-        return PosPairCode(1, PosPair(KeyType(0), PosType(j, i)));
+        return;
     }
-    
-    // Get reference block from the reference plane
-    block_type refBlock(ref, ref_stride[0], d.para.BlockSize, d.para.BlockSize, PosType(j, i));
 
-    // Block matching
-    return refBlock.BlockMatchingMulti(ref,
-        ref_height[0], ref_width[0], ref_stride[0], FLType(1),
-        d.para.BMrange, d.para.BMstep, d.para.thMSE, 1, d.para.GroupSize, true);
+    // Same match code as below, with the distances shared between neighbouring reference blocks
+    if (fs)
+    {
+        fs->Match(match_code, j, i);
+    }
+    // Coarse-to-fine search, much cheaper than the window search but may miss some of its matches
+    else if (hs)
+    {
+        hs->Match(match_code, j, i, moments);
+    }
+    // Window search seeded by the matches of the previous reference block, also cheaper but may miss some matches
+    else if (ps)
+    {
+        ps->Match(match_code, j, i, moments);
+    }
+    // Integer input is matched on its own samples, the threshold is scaled by the value range
+    else if (ref_int8)
+    {
+        WindowMatching(match_code, ref_int8, static_cast<uint8_t>(ref_int_range), j, i, nullptr);
+    }
+    else if (ref_int16)
+    {
+        WindowMatching(match_code, ref_int16, static_cast<uint16_t>(ref_int_range), j, i, nullptr);
+    }
+    else
+    {
+        WindowMatching(match_code, ref, FLType(1), j, i, moments);
+    }
+
+    match_code.sort();
+}
+
+
+BM3D_Process_Base::block_group BM3D_Process_Base::ForwardGroup(int plane, FLType *buffer, const FLType *src, PCType stride,
+    TransformCache *cache, const PosPairCode &code, PCType GroupSize) const
+{
+    if (!cache)
+    {
+        block_group group(buffer, src, stride, code, GroupSize, d.para.BlockSize, d.para.BlockSize);
+        d.f[plane].Forward(group.data(), GroupSize);
+        return group;
+    }
+
+    // Gather the cached 2D transforms of the matched blocks, then transform along the group axis
+    block_group group(buffer, code, GroupSize, d.para.BlockSize, d.para.BlockSize);
+    const PCType BlockPixels = d.para.BlockSize * d.para.BlockSize;
+
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        cache->CopyTo(group.data() + z * BlockPixels, group.GetPos(z));
+    }
+
+    d.f[plane].Forward1D(group.data(), GroupSize);
+    return group;
+}
+
+
+PCType BM3D_Process_Base::FilterGroupSize(int plane, const PosPairCode &code) const
+{
+    PCType GroupSize = static_cast<PCType>(code.size());
+    // When para.GroupSize > 0, limit GroupSize up to para.GroupSize
+    if (d.para.GroupSize > 0 && GroupSize > d.para.GroupSize)
+    {
+        GroupSize = d.para.GroupSize;
+    }
+
+    // Haar and Walsh-Hadamard transforms only take power-of-2 sizes
+    return d.f[plane].FitGroupSize(GroupSize);
+}
+
+
+void BM3D_Process_Base::CollaborativeFilter(int plane, Accumulator &acc,
+    const FLType *src, const FLType *ref,
+    TransformCache *srcCache, TransformCache *refCache,
+    FLType *buffer, const PosPairCode &code) const
+{
+    const PCType GroupSize = FilterGroupSize(plane, code);
+    const size_t stride = d.f[plane].GroupStride(d.para.GroupSize);
+
+    // Construct source group (and reference group for Wiener filtering) guided by matched pos code and apply forward 3D transform to them
+    block_group srcGroup = ForwardGroup(plane, buffer, src, src_stride[plane], srcCache, code, GroupSize);
+    block_group refGroup = d.wiener ? ForwardGroup(plane, buffer + stride, ref, ref_stride[plane], refCache, code, GroupSize) : block_group();
+
+    // Filter the transformed group and apply backward 3D transform to it
+    bool inverted = false;
+    const FLType denWeight = FilterGroup(plane, srcGroup.data(), d.wiener ? refGroup.data() : nullptr, GroupSize, inverted);
+    if (!inverted) d.f[plane].Backward(srcGroup.data(), GroupSize);
+
+    // Also include the normalization factor to compensate for the amplification introduced in 3D transform
+    const FLType numWeight = static_cast<FLType>(denWeight / d.f[plane].FinalAMP(GroupSize));
+
+    // Store the weighted filtered group to the numerator part of the estimation
+    // Store the weight to the denominator part of the estimation
+    const PCType BlockPixels = d.para.BlockSize * d.para.BlockSize;
+
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        acc.Add(srcGroup.GetPos(z), srcGroup.data() + z * BlockPixels, d.para.BlockSize, numWeight, denWeight);
+    }
+}
+
+
+void BM3D_Process_Base::CollaborativeFilter3(Accumulator *const *acc,
+    const FLType *const *src, const FLType *const *ref,
+    TransformCache *const *srcCache, TransformCache *const *refCache,
+    FLType *buffer, const PosPairCode &code) const
+{
+    const PCType GroupSize = FilterGroupSize(0, code);
+    const PCType BlockSize = d.para.BlockSize;
+    const PCType BlockPixels = BlockSize * BlockSize;
+    const size_t stride = d.f[0].GroupStride(d.para.GroupSize);
+    const int groups = d.wiener ? 6 : 3;
+
+    // The source groups of the 3 planes, followed by the reference groups for Wiener filtering
+    FLType *data[6];
+    const FLType *planes[6] = { src[0], src[1], src[2], ref[0], ref[1], ref[2] };
+    TransformCache *caches[6] = { srcCache[0], srcCache[1], srcCache[2], refCache[0], refCache[1], refCache[2] };
+    PCType strides[6] = { src_stride[0], src_stride[1], src_stride[2], ref_stride[0], ref_stride[1], ref_stride[2] };
+
+    for (int g = 0; g < groups; ++g)
+    {
+        data[g] = buffer + g * stride;
+    }
+
+    // Gather the matched blocks of all the planes in one pass
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        const PosType pos = code[z].second;
+
+        for (int g = 0; g < groups; ++g)
+        {
+            FLType *dstp = data[g] + z * BlockPixels;
+
+            if (caches[g])
+            {
+                caches[g]->CopyTo(dstp, pos);
+            }
+            else
+            {
+                MatCopy(dstp, planes[g] + pos.y * strides[g] + pos.x, BlockSize, BlockSize, BlockSize, strides[g]);
+            }
+        }
+    }
+
+    // Transform, filter and transform back the group of each plane
+    FLType numWeight[3], denWeight[3];
+
+    for (int g = 0; g < groups; ++g)
+    {
+        const auto &f = d.f[g % 3];
+
+        if (caches[g]) f.Forward1D(data[g], GroupSize);
+        else f.Forward(data[g], GroupSize);
+    }
+
+    for (int plane = 0; plane < 3; ++plane)
+    {
+        bool inverted = false;
+        denWeight[plane] = FilterGroup(plane, data[plane], d.wiener ? data[plane + 3] : nullptr, GroupSize, inverted);
+        if (!inverted) d.f[plane].Backward(data[plane], GroupSize);
+
+        // Also include the normalization factor to compensate for the amplification introduced in 3D transform
+        numWeight[plane] = static_cast<FLType>(denWeight[plane] / d.f[plane].FinalAMP(GroupSize));
+    }
+
+    // Store the weighted filtered groups to the numerator part of the estimation
+    // Store the weights to the denominator part of the estimation
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        const PosType pos = code[z].second;
+
+        for (int plane = 0; plane < 3; ++plane)
+        {
+            acc[plane]->Add(pos, data[plane] + z * BlockPixels, BlockSize, numWeight[plane], denWeight[plane]);
+        }
+    }
 }
 
 
@@ -494,6 +1042,49 @@ BM3D_Process_Base::PosPairCode BM3D_Process_Base::BlockMatching(
 // Template functions of class BM3D_Process_Base
 
 
+template < typename _St1 >
+void BM3D_Process_Base::WindowMatching(PosPairTopK &match_code, const _St1 *ref, _St1 ref_range, PCType j, PCType i,
+    const BlockMoments *moments) const
+{
+    // Get reference block from the reference plane, into the storage of the largest block_size
+    alignas(MEMORY_ALIGNMENT) _St1 block[64 * 64];
+    Block<_St1, FLType> refBlock(block, ref, ref_stride[0], d.para.BlockSize, d.para.BlockSize, PosType(j, i));
+
+    // Block matching
+    refBlock.BlockMatchingMulti(match_code, ref,
+        ref_height[0], ref_width[0], ref_stride[0], ref_range,
+        d.para.BMrange, d.para.BMstep, d.para.thMSE, true, d.simd, moments);
+}
+
+
+template < typename _Ty >
+bool BM3D_Process_Base::IntegerMatching(const _Ty *refY)
+{
+    // The incremental full search and the hierarchical search only work on the floating point plane
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0 || d.bm_mode != 0
+        || FullSearch::Worthwhile(ref_width[0], d.para.BlockSize, d.para.BlockStep, d.para.BMrange, d.para.BMstep))
+    {
+        return false;
+    }
+
+    // The floating point plane is (refY - sFloor) / (sCeil - sFloor)
+    _Ty sFloor, sNeutral, sCeil;
+    GetQuanPara(sFloor, sNeutral, sCeil, fi->bitsPerSample, full, false);
+    ref_int_range = sCeil - sFloor;
+
+    if constexpr (std::is_same<_Ty, uint8_t>::value)
+    {
+        ref_int8 = refY;
+    }
+    else
+    {
+        ref_int16 = refY;
+    }
+
+    return true;
+}
+
+
 template < typename _Ty >
 void BM3D_Process_Base::process_core()
 {
@@ -520,31 +1111,34 @@ void BM3D_Process_Base::process_core_gray()
 {
     FLType *dstYd = nullptr, *srcYd = nullptr, *refYd = nullptr;
 
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
+
     // Get write/read pointer
     auto dstY = reinterpret_cast<_Ty *>(vsapi->getWritePtr(dst, 0));
     auto srcY = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(src, 0));
     auto refY = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(ref, 0));
 
-    // Allocate memory for floating point Y data
-    AlignedMalloc(dstYd, dst_pcount[0]);
-    AlignedMalloc(srcYd, src_pcount[0]);
-    if (d.rdef) AlignedMalloc(refYd, ref_pcount[0]);
-    else refYd = srcYd;
+    // Block matching runs on the integer ref plane (the src plane without ref) when it can,
+    // then the basic estimate doesn't need the floating point copy of ref
+    const bool intMatch = IntegerMatching(refY);
+    const bool refConv = d.rdef && (!intMatch || d.wiener);
+
+    // Take memory for floating point Y data from the arena
+    dstYd = planes.Get(dst_pcount[0]);
+    srcYd = planes.Get(src_pcount[0]);
+    if (refConv) refYd = planes.Get(ref_pcount[0]);
+    else if (!d.rdef) refYd = srcYd;
 
     // Convert src and ref from integer Y data to floating point Y data
     Int2Float(srcYd, srcY, src_height[0], src_width[0], src_stride[0], src_stride[0], false, full, false);
-    if (d.rdef) Int2Float(refYd, refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
+    if (refConv) Int2Float(refYd, refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
 
     // Execute kernel
     Kernel(dstYd, srcYd, refYd);
 
     // Convert dst from floating point Y data to integer Y data
     Float2Int(dstY, dstYd, dst_height[0], dst_width[0], dst_stride[0], dst_stride[0], false, full, !isFloat(_Ty));
-
-    // Free memory for floating point Y data
-    AlignedFree(dstYd);
-    AlignedFree(srcYd);
-    if (d.rdef) AlignedFree(refYd);
 }
 
 template <>
@@ -567,6 +1161,9 @@ void BM3D_Process_Base::process_core_yuv()
     FLType *srcYd = nullptr, *srcUd = nullptr, *srcVd = nullptr;
     FLType *refYd = nullptr, *refUd = nullptr, *refVd = nullptr;
 
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
+
     // Get write/read pointer
     auto dstY = reinterpret_cast<_Ty *>(vsapi->getWritePtr(dst, 0));
     auto dstU = reinterpret_cast<_Ty *>(vsapi->getWritePtr(dst, 1));
@@ -580,20 +1177,25 @@ void BM3D_Process_Base::process_core_yuv()
     auto refU = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(ref, 1));
     auto refV = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(ref, 2));
 
-    // Allocate memory for floating point YUV data
-    if (d.process[0]) AlignedMalloc(dstYd, dst_pcount[0]);
-    if (d.process[1]) AlignedMalloc(dstUd, dst_pcount[1]);
-    if (d.process[2]) AlignedMalloc(dstVd, dst_pcount[2]);
+    // Block matching runs on the integer ref plane (the src plane without ref) when it can,
+    // then only Wiener filtering of Y needs the floating point copy of ref
+    const bool intMatch = IntegerMatching(refY);
+    const bool refConvY = d.rdef && (!intMatch || (d.wiener && d.process[0]));
+
+    // Take memory for floating point YUV data from the arena
+    if (d.process[0]) dstYd = planes.Get(dst_pcount[0]);
+    if (d.process[1]) dstUd = planes.Get(dst_pcount[1]);
+    if (d.process[2]) dstVd = planes.Get(dst_pcount[2]);
 
-    if (d.process[0] || !d.rdef) AlignedMalloc(srcYd, src_pcount[0]);
-    if (d.process[1]) AlignedMalloc(srcUd, src_pcount[1]);
-    if (d.process[2]) AlignedMalloc(srcVd, src_pcount[2]);
+    if (d.process[0] || !d.rdef) srcYd = planes.Get(src_pcount[0]);
+    if (d.process[1]) srcUd = planes.Get(src_pcount[1]);
+    if (d.process[2]) srcVd = planes.Get(src_pcount[2]);
 
     if (d.rdef)
     {
-        AlignedMalloc(refYd, ref_pcount[0]);
-        if (d.wiener && d.process[1]) AlignedMalloc(refUd, ref_pcount[1]);
-        if (d.wiener && d.process[2]) AlignedMalloc(refVd, ref_pcount[2]);
+        if (refConvY) refYd = planes.Get(ref_pcount[0]);
+        if (d.wiener && d.process[1]) refUd = planes.Get(ref_pcount[1]);
+        if (d.wiener && d.process[2]) refVd = planes.Get(ref_pcount[2]);
     }
     else
     {
@@ -609,7 +1211,7 @@ void BM3D_Process_Base::process_core_yuv()
 
     if (d.rdef)
     {
-        Int2Float(refYd, refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
+        if (refConvY) Int2Float(refYd, refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
         if (d.wiener && d.process[1]) Int2Float(refUd, refU, ref_height[1], ref_width[1], ref_stride[1], ref_stride[1], true, full, false);
         if (d.wiener && d.process[2]) Int2Float(refVd, refV, ref_height[2], ref_width[2], ref_stride[2], ref_stride[2], true, full, false);
     }
@@ -621,22 +1223,6 @@ void BM3D_Process_Base::process_core_yuv()
     if (d.process[0]) Float2Int(dstY, dstYd, dst_height[0], dst_width[0], dst_stride[0], dst_stride[0], false, full, !isFloat(_Ty));
     if (d.process[1]) Float2Int(dstU, dstUd, dst_height[1], dst_width[1], dst_stride[1], dst_stride[1], true, full, !isFloat(_Ty));
     if (d.process[2]) Float2Int(dstV, dstVd, dst_height[2], dst_width[2], dst_stride[2], dst_stride[2], true, full, !isFloat(_Ty));
-
-    // Free memory for floating point YUV data
-    if (d.process[0]) AlignedFree(dstYd);
-    if (d.process[1]) AlignedFree(dstUd);
-    if (d.process[2]) AlignedFree(dstVd);
-
-    if (d.process[0] || !d.rdef) AlignedFree(srcYd);
-    if (d.process[1]) AlignedFree(srcUd);
-    if (d.process[2]) AlignedFree(srcVd);
-
-    if (d.rdef)
-    {
-        AlignedFree(refYd);
-        if (d.wiener && d.process[1]) AlignedFree(refUd);
-        if (d.wiener && d.process[2]) AlignedFree(refVd);
-    }
 }
 
 template <>
@@ -667,6 +1253,9 @@ void BM3D_Process_Base::process_core_rgb()
     FLType *srcYd = nullptr, *srcUd = nullptr, *srcVd = nullptr;
     FLType *refYd = nullptr, *refUd = nullptr, *refVd = nullptr;
 
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
+
     // Get write/read pointer
     auto dstR = reinterpret_cast<_Ty *>(vsapi->getWritePtr(dst, 0));
     auto dstG = reinterpret_cast<_Ty *>(vsapi->getWritePtr(dst, 1));
@@ -680,20 +1269,20 @@ void BM3D_Process_Base::process_core_rgb()
     auto refG = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(ref, 1));
     auto refB = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(ref, 2));
 
-    // Allocate memory for floating point YUV data
-    AlignedMalloc(dstYd, dst_pcount[0]);
-    AlignedMalloc(dstUd, dst_pcount[1]);
-    AlignedMalloc(dstVd, dst_pcount[2]);
+    // Take memory for floating point YUV data from the arena
+    dstYd = planes.Get(dst_pcount[0]);
+    dstUd = planes.Get(dst_pcount[1]);
+    dstVd = planes.Get(dst_pcount[2]);
 
-    AlignedMalloc(srcYd, src_pcount[0]);
-    AlignedMalloc(srcUd, src_pcount[1]);
-    AlignedMalloc(srcVd, src_pcount[2]);
+    srcYd = planes.Get(src_pcount[0]);
+    srcUd = planes.Get(src_pcount[1]);
+    srcVd = planes.Get(src_pcount[2]);
 
     if (d.rdef)
     {
-        AlignedMalloc(refYd, ref_pcount[0]);
-        if (d.wiener) AlignedMalloc(refUd, ref_pcount[1]);
-        if (d.wiener) AlignedMalloc(refVd, ref_pcount[2]);
+        refYd = planes.Get(ref_pcount[0]);
+        if (d.wiener) refUd = planes.Get(ref_pcount[1]);
+        if (d.wiener) refVd = planes.Get(ref_pcount[2]);
     }
     else
     {
@@ -730,22 +1319,6 @@ void BM3D_Process_Base::process_core_rgb()
     FloatYUV2RGB(dstR, dstG, dstB, dstYd, dstUd, dstVd,
         dst_height[0], dst_width[0], dst_stride[0], dst_stride[0],
         ColorMatrix::OPP, true, !isFloat(_Ty));
-
-    // Free memory for floating point YUV data
-    AlignedFree(dstYd);
-    AlignedFree(dstUd);
-    AlignedFree(dstVd);
-
-    AlignedFree(srcYd);
-    AlignedFree(srcUd);
-    AlignedFree(srcVd);
-
-    if (d.rdef)
-    {
-        AlignedFree(refYd);
-        if (d.wiener) AlignedFree(refUd);
-        if (d.wiener) AlignedFree(refVd);
-    }
 }
 
 
@@ -69,37 +69,23 @@ int BM3D_Basic_Data::arguments_process(const VSMap *in, VSMap *out)
 // Functions of class BM3D_Basic_Process
 
 
-void BM3D_Basic_Process::CollaborativeFilter(int plane,
-    FLType *ResNum, FLType *ResDen,
-    const FLType *src, const FLType *ref,
-    const PosPairCode &code) const
+FLType BM3D_Basic_Process::FilterGroup(int plane, FLType *srcData, const FLType *, PCType GroupSize, bool &inverted) const
 {
-    PCType GroupSize = static_cast<PCType>(code.size());
-    // When para.GroupSize > 0, limit GroupSize up to para.GroupSize
-    if (d.para.GroupSize > 0 && GroupSize > d.para.GroupSize)
-    {
-        GroupSize = d.para.GroupSize;
-    }
-
-    // Construct source group guided by matched pos code
-    block_group srcGroup(src, src_stride[plane], code, GroupSize, d.para.BlockSize, d.para.BlockSize);
+    const ptrdiff_t size = GroupSize * d.para.BlockSize * d.para.BlockSize;
 
     // Initialize retianed coefficients of hard threshold filtering
     int retainedCoefs = 0;
 
-    // Apply forward 3D transform to the source group
-    d.f[plane].fp[GroupSize - 1].execute_r2r(srcGroup.data(), srcGroup.data());
-
     // Apply hard-thresholding to the source group
-    auto srcp = srcGroup.data();
-    auto thrp = d.f[plane].thrTable[GroupSize - 1].get();
-    const auto upper = srcp + srcGroup.size();
+    auto srcp = srcData;
+    auto thrp = d.f[plane].ThrTable(GroupSize);
+    const auto upper = srcp + size;
 
 #if defined(__SSE2__)
     static const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(~0x80000000));
     static const ptrdiff_t simd_step = 4;
-    const ptrdiff_t simd_residue = srcGroup.size() % simd_step;
-    const ptrdiff_t simd_width = srcGroup.size() - simd_residue;
+    const ptrdiff_t simd_residue = size % simd_step;
+    const ptrdiff_t simd_width = size - simd_residue;
 
     __m128i cmp_sum = _mm_setzero_si128();
 
@@ -133,18 +119,11 @@ void BM3D_Basic_Process::CollaborativeFilter(int plane,
         }
     }
 
-    // Apply backward 3D transform to the filtered group
-    d.f[plane].bp[GroupSize - 1].execute_r2r(srcGroup.data(), srcGroup.data());
+    // Flat groups are left with a few coefficients, whose backward transform takes a shortcut
+    inverted = d.f[plane].BackwardSparse(srcData, GroupSize, retainedCoefs);
 
     // Calculate weight for the filtered group
-    // Also include the normalization factor to compensate for the amplification introduced in 3D transform
-    FLType denWeight = retainedCoefs < 1 ? 1 : FLType(1) / static_cast<FLType>(retainedCoefs);
-    FLType numWeight = static_cast<FLType>(denWeight / d.f[plane].finalAMP[GroupSize - 1]);
-
-    // Store the weighted filtered group to the numerator part of the basic estimation
-    // Store the weight to the denominator part of the basic estimation
-    srcGroup.AddTo(ResNum, dst_stride[plane], numWeight);
-    srcGroup.CountTo(ResDen, dst_stride[plane], denWeight);
+    return retainedCoefs < 1 ? 1 : FLType(1) / static_cast<FLType>(retainedCoefs);
 }
 
 
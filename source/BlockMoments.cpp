@@ -0,0 +1,160 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <limits>
+#include "BlockMoments.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class BlockMoments
+
+
+BlockMoments::BlockMoments(const FLType *src, PCType height, PCType width, PCType stride, PCType block_size,
+    PlaneArena::Frame &scratch)
+    : height_(height), width_(width), block_size_(block_size), map_width_(width - block_size + 1),
+    pixel_count_(static_cast<double>(block_size) * block_size), inv_pixel_count_(1 / pixel_count_)
+{
+    const PCType map_height = height_ - block_size_ + 1;
+
+    FLType vmin = src[0];
+    FLType vmax = src[0];
+
+    for (PCType j = 0; j < height_; ++j)
+    {
+        for (PCType i = 0; i < width_; ++i)
+        {
+            const FLType v = src[j * stride + i];
+            vmin = Min(vmin, v);
+            vmax = Max(vmax, v);
+        }
+    }
+
+    // Centering the values halves their magnitude, and the sums of squares lose less to the cancellation
+    offset_ = static_cast<FLType>((static_cast<double>(vmax) + vmin) / 2);
+    const double M = Max(static_cast<double>(vmax) - offset_, offset_ - static_cast<double>(vmin));
+
+    const double eps_f = std::numeric_limits<FLType>::epsilon();
+    const double n = pixel_count_;
+
+    // The maps are stored in float, the norm never exceeds sqrt(n) * M
+    Errors(M, sum_error_, norm_error_);
+    sum_error_ += eps_f * n * M;
+    norm_error_ += eps_f * std::sqrt(n) * M;
+
+    rel_ = (n + 8) * eps_f;
+    underflow_ = n * std::numeric_limits<FLType>::min();
+
+    if (!std::isfinite(M))
+    {
+        sum_error_ = std::numeric_limits<double>::infinity();
+        norm_error_ = std::numeric_limits<double>::infinity();
+        return;
+    }
+
+    sum_ = scratch.Get(static_cast<size_t>(map_height) * map_width_);
+    norm_ = scratch.Get(static_cast<size_t>(map_height) * map_width_);
+
+    // Box sums by columns and then by rows, the column sums are returned to the arena at the end
+    PlaneArena::Frame local;
+    double *colsum = local.Get<double>(width_);
+    double *colsqr = local.Get<double>(width_);
+
+    for (PCType j = 0; j < map_height; ++j)
+    {
+        std::fill_n(colsum, width_, 0.0);
+        std::fill_n(colsqr, width_, 0.0);
+
+        for (PCType y = j; y < j + block_size_; ++y)
+        {
+            const FLType *srcp = src + y * stride;
+
+            for (PCType i = 0; i < width_; ++i)
+            {
+                const double v = srcp[i] - offset_;
+                colsum[i] += v;
+                colsqr[i] += v * v;
+            }
+        }
+
+        FLType *sump = sum_ + static_cast<size_t>(j) * map_width_;
+        FLType *normp = norm_ + static_cast<size_t>(j) * map_width_;
+
+        for (PCType i = 0; i < map_width_; ++i)
+        {
+            double s = 0;
+            double q = 0;
+
+            for (PCType x = i; x < i + block_size_; ++x)
+            {
+                s += colsum[x];
+                q += colsqr[x];
+            }
+
+            sump[i] = static_cast<FLType>(s);
+            normp[i] = static_cast<FLType>(std::sqrt(Max(q - s * s / n, 0.0)));
+        }
+    }
+}
+
+
+void BlockMoments::Errors(double M, double &sum_error, double &norm_error) const
+{
+    // Every sum has at most 2 * block_size terms accumulated in 2 passes, each partial sum bounded by n * M (or n * M^2),
+    // the centered sum of squares then loses at most the error of s^2 / n
+    const double eps_d = std::numeric_limits<double>::epsilon();
+    const double n = pixel_count_;
+
+    sum_error = 2 * n * n * eps_d * M;
+    const double sqr_error = 2 * n * n * eps_d * M * M;
+    const double centered_error = sqr_error + 2 * M * sum_error + sum_error * sum_error / n + 4 * n * eps_d * M * M;
+
+    // |sqrt(a) - sqrt(b)| <= sqrt(|a - b|)
+    norm_error = std::sqrt(centered_error);
+}
+
+
+BlockMoments::Moments BlockMoments::Measure(const FLType *src, PCType stride) const
+{
+    double s = 0;
+    double q = 0;
+    double M = 0;
+
+    for (PCType y = 0; y < block_size_; ++y)
+    {
+        const FLType *srcp = src + y * stride;
+
+        for (PCType x = 0; x < block_size_; ++x)
+        {
+            const double v = srcp[x] - offset_;
+            s += v;
+            q += v * v;
+            M = Max(M, Abs(v));
+        }
+    }
+
+    Moments moments = { s, std::sqrt(Max(q - s * s / pixel_count_, 0.0)), 0, 0 };
+    Errors(M, moments.sum_error, moments.norm_error);
+
+    return moments;
+}
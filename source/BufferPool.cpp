@@ -0,0 +1,104 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+
+
+
+#include <thread>
+#include "BufferPool.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class BufferPool
+
+
+BufferPool::BufferPool(size_t capacity)
+    : capacity_(capacity > 0 ? capacity : Max(static_cast<size_t>(std::thread::hardware_concurrency()), size_t(1))),
+    slots_(new Slot[capacity_])
+{}
+
+
+BufferPool::~BufferPool()
+{
+    for (size_t k = 0; k < capacity_; ++k)
+    {
+        FLType *data = slots_[k].data.load(std::memory_order_relaxed);
+        if (data) AlignedFree(data);
+    }
+}
+
+
+BufferPool::Buffer BufferPool::Acquire(size_t count)
+{
+    const size_t start = Start();
+
+    for (size_t k = 0; k < capacity_; ++k)
+    {
+        Slot &slot = slots_[(start + k) % capacity_];
+
+        // The plain load skips the empty slots without taking their cache lines exclusively
+        if (slot.data.load(std::memory_order_relaxed))
+        {
+            FLType *data = slot.data.exchange(nullptr, std::memory_order_acquire);
+            if (data) return Buffer(this, data);
+        }
+    }
+
+    // The new buffer is kept by the pool once released
+    const RetainedAllocations retained;
+    FLType *data = nullptr;
+    AlignedMalloc(data, count);
+    return Buffer(this, data);
+}
+
+
+void BufferPool::Release(FLType *data)
+{
+    const size_t start = Start();
+
+    for (size_t k = 0; k < capacity_; ++k)
+    {
+        Slot &slot = slots_[(start + k) % capacity_];
+        FLType *expected = nullptr;
+
+        if (!slot.data.load(std::memory_order_relaxed)
+            && slot.data.compare_exchange_strong(expected, data, std::memory_order_release, std::memory_order_relaxed))
+        {
+            return;
+        }
+    }
+
+    AlignedFree(data);
+}
+
+
+size_t BufferPool::Start() const
+{
+    // Each thread is numbered once, the first time it uses any pool
+    static std::atomic<size_t> next{ 0 };
+    thread_local const size_t index = next.fetch_add(1, std::memory_order_relaxed);
+
+    return index % capacity_;
+}
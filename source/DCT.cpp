@@ -0,0 +1,138 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <cmath>
+#include <cstring>
+#include "DCT.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+
+// Row k of the matrix of length n, computed in double precision:
+//     REDFT10: y[k] = 2 * sum of x[j] * cos(pi * (j + 1/2) * k / n) over j in [0, n)
+//     REDFT01: y[k] = x[0] + 2 * sum of x[j] * cos(pi * j * (k + 1/2) / n) over j in [1, n)
+static std::vector<FLType> DCTMatrix(PCType n, bool forward)
+{
+    const double pi = 3.14159265358979323846;
+    std::vector<FLType> matrix(n * n);
+
+    for (PCType k = 0; k < n; ++k)
+    {
+        for (PCType j = 0; j < n; ++j)
+        {
+            double coef;
+
+            if (forward)
+            {
+                coef = 2 * cos(pi * (j + 0.5) * k / n);
+            }
+            else
+            {
+                coef = j == 0 ? 1 : 2 * cos(pi * j * (k + 0.5) / n);
+            }
+
+            matrix[k * n + j] = static_cast<FLType>(coef);
+        }
+    }
+
+    return matrix;
+}
+
+
+static std::vector<FLType> Transpose(const std::vector<FLType> &matrix, PCType n)
+{
+    std::vector<FLType> result(n * n);
+
+    for (PCType k = 0; k < n; ++k)
+    {
+        for (PCType j = 0; j < n; ++j)
+        {
+            result[j * n + k] = matrix[k * n + j];
+        }
+    }
+
+    return result;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class BlockDCT
+
+
+BlockDCT::BlockDCT(PCType block_size, PCType group_size, SIMDLevel level)
+    : block_size_(block_size), mul_rows_(MulRows_Func(level, block_size)),
+    forward_(DCTMatrix(block_size, true)), forward_t_(Transpose(forward_, block_size)),
+    backward_(DCTMatrix(block_size, false)), backward_t_(Transpose(backward_, block_size)),
+    group_forward_(group_size), group_backward_(group_size)
+{
+    for (PCType n = 1; n <= group_size; ++n)
+    {
+        group_forward_[n - 1] = DCTMatrix(n, true);
+        group_backward_[n - 1] = DCTMatrix(n, false);
+    }
+}
+
+
+bool BlockDCT::Supported(PCType block_size, PCType group_size)
+{
+    return group_size <= MaxGroupSize && MulRows_Func(SIMDLevel::None, block_size) != nullptr;
+}
+
+
+void BlockDCT::Transform2D(FLType *data, PCType group_size,
+    const std::vector<FLType> &matrix, const std::vector<FLType> &matrix_t) const
+{
+    const PCType BS = block_size_;
+    const PCType pixels = BS * BS;
+    alignas(64) FLType temp[16 * 16];
+
+    for (PCType z = 0; z < group_size; ++z, data += pixels)
+    {
+        // Transform along x: temp = block * matrix^T
+        mul_rows_(temp, BS, data, BS, matrix_t.data(), BS);
+
+        // Transform along y: block = matrix * temp
+        mul_rows_(data, BS, matrix.data(), BS, temp, BS);
+    }
+}
+
+
+void BlockDCT::TransformGroup(FLType *data, PCType group_size, const std::vector<FLType> &matrix) const
+{
+    const PCType BS = block_size_;
+    const PCType pixels = BS * BS;
+    alignas(64) FLType temp[MaxGroupSize * 16];
+
+    // Row y of every block forms a matrix of group_size rows, transformed along the group axis at once
+    for (PCType y = 0; y < BS; ++y)
+    {
+        for (PCType z = 0; z < group_size; ++z)
+        {
+            memcpy(temp + z * BS, data + z * pixels + y * BS, sizeof(FLType) * BS);
+        }
+
+        mul_rows_(data + y * BS, pixels, matrix.data(), group_size, temp, group_size);
+    }
+}
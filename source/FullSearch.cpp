@@ -0,0 +1,325 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include <limits>
+#include "FullSearch.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class FullSearch
+
+
+void FullSearch::Reset(const FLType *ref, PCType height, PCType width, PCType stride,
+    PCType block_size, PCType block_step, PCType range, PCType step, double thMSE, SIMDLevel simd,
+    PlaneArena::Frame &scratch)
+{
+    ref_ = ref;
+    height_ = height;
+    width_ = width;
+    stride_ = stride;
+    block_size_ = block_size;
+    block_step_ = block_step;
+    step_ = step;
+    radius_ = range / step;
+    diameter_ = range / step * 2 + 1;
+    thMSE_ = thMSE;
+    ssd_ = SSD_Func(simd);
+    slide_ = SSDSlide_Func(simd);
+    row_ = -1;
+    hint_ = std::numeric_limits<FLType>::infinity();
+
+    const PCType BlockPosRight = width_ - block_size_;
+
+    Reserve(cols_, static_cast<size_t>((BlockPosRight + block_step_ * 2 - 1) / block_step_));
+    cols_.clear();
+
+    for (PCType i = 0; i < BlockPosRight + block_step_; i += block_step_)
+    {
+        cols_.push_back(Min(i, BlockPosRight));
+    }
+
+    const size_t disp_count = static_cast<size_t>(diameter_) * diameter_;
+
+    // Rounding errors of the SSD kernel (block_size^2 terms) and of the float storage of the estimates
+    rel_ = (static_cast<double>(block_size_) * block_size_ + 8) * std::numeric_limits<FLType>::epsilon();
+
+    // The column sums are filled before use and the distances are set for every row
+    colsum_ = scratch.Get<double>(disp_count * width_);
+    Reserve(colsum_row_, diameter_);
+    Reserve(prefix_, width_ + 1);
+    Reserve(upper_, disp_count);
+    colsum_row_.assign(diameter_, -1);
+    prefix_.resize(width_ + 1);
+    dist_ = scratch.Get(cols_.size() * disp_count);
+    block_ = scratch.Get(static_cast<size_t>(block_size_) * block_size_);
+
+    // The squared difference of two pixels never exceeds the square of the value range of the plane
+    FLType vmin = ref_[0];
+    FLType vmax = ref_[0];
+
+    for (PCType j = 0; j < height_; ++j)
+    {
+        for (PCType i = 0; i < width_; ++i)
+        {
+            const FLType v = ref_[j * stride_ + i];
+            vmin = Min(vmin, v);
+            vmax = Max(vmax, v);
+        }
+    }
+
+    const double sqr_max = (static_cast<double>(vmax) - vmin) * (static_cast<double>(vmax) - vmin);
+
+    // Each column sum is updated once per row (block_size times when restarted), and a prefix sum accumulates a whole row of them.
+    // The bound is kept looser than the analysis, it only costs a few more exact measurements.
+    error_ = 4 * std::numeric_limits<double>::epsilon() * block_size_ * sqr_max
+        * (2.0 * width_ * width_ + width_ + 2.0 * height_ * block_size_);
+
+    if (!std::isfinite(sqr_max))
+    {
+        error_ = std::numeric_limits<double>::infinity();
+    }
+}
+
+
+bool FullSearch::Worthwhile(PCType width, PCType block_size, PCType block_step, PCType range, PCType step)
+{
+    // Cost per candidate: about 2 * block_step^2 updates of column sums plus the prefix sums,
+    // against block_size^2 for measuring a candidate directly
+    const size_t diameter = range / step * 2 + 1;
+    const size_t colsum_bytes = diameter * diameter * width * sizeof(double);
+
+    return 2 * block_step * block_step + block_step < block_size * block_size
+        && colsum_bytes <= (size_t(64) << 20);
+}
+
+
+void FullSearch::Accumulate(double *colsum, PCType y0, PCType y1, PCType dy, PCType dx) const
+{
+    const PCType x0 = Max(PCType(0), -dx);
+    const PCType x1 = Min(width_, width_ - dx);
+
+    for (PCType y = y0; y < y1; ++y)
+    {
+        const FLType *refp = ref_ + y * stride_;
+        const FLType *srcp = ref_ + (y + dy) * stride_ + dx;
+
+        for (PCType x = x0; x < x1; ++x)
+        {
+            const double temp = static_cast<double>(refp[x]) - static_cast<double>(srcp[x]);
+            colsum[x] += temp * temp;
+        }
+    }
+}
+
+
+void FullSearch::Slide(double *colsum, PCType y0, PCType y1, PCType dy, PCType dx) const
+{
+    const PCType x0 = Max(PCType(0), -dx);
+    const PCType x1 = Min(width_, width_ - dx);
+
+    // Row y leaves the blocks while row y + block_size enters them
+    for (PCType y = y0; y < y1; ++y)
+    {
+        const FLType *refp = ref_ + y * stride_ + x0;
+        const FLType *srcp = ref_ + (y + dy) * stride_ + dx + x0;
+
+        slide_(colsum + x0, refp, srcp, refp + block_size_ * stride_, srcp + block_size_ * stride_, x1 - x0);
+    }
+}
+
+
+void FullSearch::Row(PCType j)
+{
+    const size_t disp_count = static_cast<size_t>(diameter_) * diameter_;
+    const PCType BlockPosBottom = height_ - block_size_;
+    const PCType BlockPosRight = width_ - block_size_;
+    const FLType invalid = std::numeric_limits<FLType>::infinity();
+
+    for (PCType ky = 0; ky < diameter_; ++ky)
+    {
+        const PCType dy = (ky - radius_) * step_;
+
+        if (j + dy < 0 || j + dy > BlockPosBottom)
+        {
+            colsum_row_[ky] = -1;
+
+            for (size_t c = 0; c < cols_.size(); ++c)
+            {
+                std::fill_n(dist_ + c * disp_count + ky * diameter_, diameter_, invalid);
+            }
+
+            continue;
+        }
+
+        // Slide the column sums down from the previous row when the two rows of blocks overlap
+        const PCType prev = colsum_row_[ky];
+        const bool slide = prev >= 0 && j > prev && j - prev < block_size_;
+
+        for (PCType kx = 0; kx < diameter_; ++kx)
+        {
+            const PCType dx = (kx - radius_) * step_;
+            double *colsum = colsum_ + (static_cast<size_t>(ky) * diameter_ + kx) * width_;
+
+            if (slide)
+            {
+                Slide(colsum, prev, j, dy, dx);
+            }
+            else
+            {
+                std::fill_n(colsum, width_, 0.0);
+                Accumulate(colsum, j, j + block_size_, dy, dx);
+            }
+
+            const PCType x0 = Max(PCType(0), -dx);
+            const PCType x1 = Min(width_, width_ - dx);
+
+            prefix_[x0] = 0;
+
+            for (PCType x = x0; x < x1; ++x)
+            {
+                prefix_[x + 1] = prefix_[x] + colsum[x];
+            }
+
+            for (size_t c = 0; c < cols_.size(); ++c)
+            {
+                const PCType i = cols_[c];
+                FLType &dist = dist_[c * disp_count + ky * diameter_ + kx];
+
+                // The reference block itself is not a candidate
+                if (i + dx < 0 || i + dx > BlockPosRight || (dy == 0 && dx == 0))
+                {
+                    dist = invalid;
+                }
+                else
+                {
+                    dist = static_cast<FLType>(prefix_[i + block_size_] - prefix_[i]);
+                }
+            }
+        }
+
+        colsum_row_[ky] = j;
+    }
+}
+
+
+double FullSearch::Margin(double dist) const
+{
+    return rel_ * (dist + error_) + error_;
+}
+
+
+void FullSearch::Match(PosPairTopK &match_code, PCType j, PCType i)
+{
+    const size_t match_size = match_code.capacity();
+
+    if (j != row_)
+    {
+        Row(j);
+        row_ = j;
+    }
+
+    const size_t disp_count = static_cast<size_t>(diameter_) * diameter_;
+    const size_t c = (i + block_step_ - 1) / block_step_;
+    const FLType *dist = dist_ + c * disp_count;
+
+    // Same threshold and scaling as Block::BlockMatchingMulti
+    block_type refBlock(block_, ref_, stride_, block_size_, block_size_, PosType(j, i));
+
+    double MSE2SSE = static_cast<double>(refBlock.PixelCount()) / double(255 * 255);
+    double distMul = double(1) / MSE2SSE;
+    FLType thSSE = static_cast<FLType>(thMSE_ * MSE2SSE);
+
+    // Any match_size - 1 candidates surely within the threshold bound the distance of the last selected one.
+    // The upper bound of the error grows with the estimate, so the (match_size - 1)-th smallest estimate gives the bound.
+    // Neighbouring reference blocks have similar distances, thus the estimates are first filtered by the last one.
+    double bound = thSSE;
+
+    if (match_size > 1)
+    {
+        const size_t kth = match_size - 2;
+
+        for (FLType filter : { hint_, std::numeric_limits<FLType>::infinity() })
+        {
+            upper_.clear();
+
+            for (size_t k = 0; k < disp_count; ++k)
+            {
+                const FLType estimate = dist[k];
+
+                if (estimate <= filter)
+                {
+                    const double margin = Margin(estimate);
+
+                    if (estimate - margin > 0 && estimate + margin <= thSSE)
+                    {
+                        upper_.push_back(estimate);
+                    }
+                }
+            }
+
+            if (upper_.size() > kth || filter == std::numeric_limits<FLType>::infinity())
+            {
+                break;
+            }
+        }
+
+        if (upper_.size() > kth)
+        {
+            std::nth_element(upper_.begin(), upper_.begin() + kth, upper_.end());
+            const FLType estimate = upper_[kth];
+            bound = Min(bound, estimate + Margin(estimate));
+            hint_ = estimate * FLType(1.25);
+        }
+        else
+        {
+            hint_ = std::numeric_limits<FLType>::infinity();
+        }
+    }
+
+    // Candidates farther than the bound can't even tie with the selected ones after scaling to keys.
+    // Solving estimate - Margin(estimate) <= bound for the estimate gives the limit, which is rounded up
+    bound *= 1 + std::ldexp(1.0, -20);
+    const double limit = (bound + Margin(0)) / (1 - rel_) * (1 + std::ldexp(1.0, -40));
+
+    for (PCType ky = 0; ky < diameter_; ++ky)
+    {
+        for (PCType kx = 0; kx < diameter_; ++kx)
+        {
+            if (!(dist[ky * diameter_ + kx] <= limit))
+            {
+                continue;
+            }
+
+            const PosType pos(j + (ky - radius_) * step_, i + (kx - radius_) * step_);
+            const FLType ssd = ssd_(refBlock.data(), ref_ + pos.y * stride_ + pos.x, stride_, block_size_, block_size_, thSSE);
+
+            // Only match similar blocks but not identical blocks
+            if (ssd <= thSSE && ssd != 0)
+            {
+                match_code.push(PosPair(static_cast<KeyType>(ssd * distMul), pos));
+            }
+        }
+    }
+
+}
@@ -0,0 +1,105 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include "HierarchicalSearch.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class HierarchicalSearch
+
+
+void HierarchicalSearch::Reset(const FLType *ref, PCType height, PCType width, PCType stride,
+    PCType block_size, PCType range, PCType step, double thMSE, SIMDLevel simd,
+    PlaneArena::Frame &scratch)
+{
+    ref_ = ref;
+    height_ = height;
+    width_ = width;
+    stride_ = stride;
+    block_size_ = block_size;
+    range_ = range;
+    step_ = step;
+    thMSE_ = thMSE;
+    simd_ = simd;
+    coarse_height_ = height / 2;
+    coarse_width_ = width / 2;
+    coarse_block_size_ = block_size / 2;
+
+    const PCType pos_height = height_ - block_size_ + 1;
+    const PCType pos_width = width_ - block_size_ + 1;
+
+    coarse_ = scratch.Get(static_cast<size_t>(coarse_height_) * coarse_width_);
+    block_ = scratch.Get(static_cast<size_t>(block_size_) * block_size_ + static_cast<size_t>(coarse_block_size_) * coarse_block_size_);
+    search_pos_.bind(scratch.Get<uint32_t>(static_cast<size_t>(pos_height) * pos_width), pos_height, pos_width);
+
+    // Averaging keeps the value range, so the same threshold applies to the coarse blocks
+    for (PCType j = 0; j < coarse_height_; ++j)
+    {
+        const FLType *refp0 = ref_ + j * 2 * stride_;
+        const FLType *refp1 = refp0 + stride_;
+        FLType *dstp = coarse_ + j * coarse_width_;
+
+        for (PCType i = 0; i < coarse_width_; ++i)
+        {
+            dstp[i] = (refp0[i * 2] + refp0[i * 2 + 1] + refp1[i * 2] + refp1[i * 2 + 1]) * FLType(0.25);
+        }
+    }
+}
+
+
+bool HierarchicalSearch::Applicable(PCType height, PCType width, PCType block_size)
+{
+    return block_size >= 4 && height >= 4 && width >= 4;
+}
+
+
+void HierarchicalSearch::Match(PosPairTopK &match_code, PCType j, PCType i, const BlockMoments *moments)
+{
+    const PCType BlockPosBottom = height_ - block_size_;
+    const PCType BlockPosRight = width_ - block_size_;
+
+    // Coarse search over the whole window, the block at (j / 2, i / 2) always fits in the coarse plane
+    block_type coarseBlock(block_ + block_size_ * block_size_, coarse_, coarse_width_,
+        coarse_block_size_, coarse_block_size_, PosType(j / 2, i / 2));
+
+    coarse_match_.reset(match_code.capacity());
+    coarseBlock.BlockMatchingMulti(coarse_match_, coarse_, coarse_height_, coarse_width_, coarse_width_, FLType(1),
+        range_ / 2, Max(step_ / 2, PCType(1)), thMSE_, true, simd_);
+
+    // Seed the fine search with the reference block and the coarse matches mapped back to full resolution
+    Reserve(seeds_, match_code.capacity() + 1);
+    seeds_.clear();
+    seeds_.push_back(PosType(j, i));
+
+    for (const auto &e : coarse_match_.get())
+    {
+        seeds_.push_back(PosType(Min(e.second.y * 2, BlockPosBottom), Min(e.second.x * 2, BlockPosRight)));
+    }
+
+    // Refine within +-step around each seed, the reference block itself is rejected as an identical block
+    block_type refBlock(block_, ref_, stride_, block_size_, block_size_, PosType(j, i));
+    refBlock.GenSearchPos(search_pos_, seeds_, height_, width_, step_, 1);
+
+    refBlock.BlockMatchingMulti(match_code, ref_, stride_, FLType(1), search_pos_.get(), thMSE_, simd_, moments);
+}
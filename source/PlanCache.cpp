@@ -0,0 +1,168 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+#include <cstdio>
+#include <random>
+#include "PlanCache.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class PlanCache
+
+
+std::mutex PlanCache::mutex_;
+std::map<PlanCache::KeyType, std::weak_ptr<const PlanCache::fftw::plan>> PlanCache::plans_;
+size_t PlanCache::learned_ = 0;
+std::map<std::string, size_t> PlanCache::synced_;
+
+
+PlanCache::plan_ptr PlanCache::Plan(int rank, const int *n, int howmany, int stride, int dist,
+    const fftw::r2r_kind *kind, unsigned flags)
+{
+    KeyType key = { rank, howmany, stride, dist, static_cast<int>(flags) };
+    size_t count = 1;
+
+    for (int i = 0; i < rank; ++i)
+    {
+        key.push_back(n[i]);
+        key.push_back(static_cast<int>(kind[i]));
+        count *= n[i];
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    plan_ptr plan = plans_[key].lock();
+
+    if (plan)
+    {
+        return plan;
+    }
+
+    // Extent of the transformed data, in which the planner of FFTW may overwrite everything
+    const size_t size = (count - 1) * stride + static_cast<size_t>(howmany - 1) * dist + 1;
+
+    FLType *temp = nullptr;
+    AlignedMalloc(temp, size);
+
+    // Plan from the wisdom first, so that only the plans measured here are counted as learned
+    fftw::plan *p = new fftw::plan();
+    p->many_r2r(rank, n, howmany, temp, nullptr, stride, dist, temp, nullptr, stride, dist, kind, flags | FFTW_WISDOM_ONLY);
+
+    if (p->p == nullptr)
+    {
+        p->many_r2r(rank, n, howmany, temp, nullptr, stride, dist, temp, nullptr, stride, dist, kind, flags);
+        ++learned_;
+    }
+
+    AlignedFree(temp);
+
+    plan.reset(p, [key](fftw::plan *memory)
+    {
+        Release(key, memory);
+    });
+
+    plans_[key] = plan;
+
+    return plan;
+}
+
+
+PlanCache::plan_ptr PlanCache::Plan2D(int n0, int n1, fftw::r2r_kind kind, unsigned flags)
+{
+    const int n[2] = { n0, n1 };
+    const fftw::r2r_kind kinds[2] = { kind, kind };
+
+    return Plan(2, n, 1, 1, 0, kinds, flags);
+}
+
+
+PlanCache::plan_ptr PlanCache::Plan3D(int n0, int n1, int n2, fftw::r2r_kind kind, unsigned flags)
+{
+    const int n[3] = { n0, n1, n2 };
+    const fftw::r2r_kind kinds[3] = { kind, kind, kind };
+
+    return Plan(3, n, 1, 1, 0, kinds, flags);
+}
+
+
+void PlanCache::ImportWisdom(const std::string &filename)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (synced_.count(filename))
+    {
+        return;
+    }
+
+    fftw::import_wisdom_from_filename(filename.c_str());
+    synced_.emplace(filename, learned_);
+}
+
+
+void PlanCache::ExportWisdom(const std::string &filename)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto iter = synced_.find(filename);
+
+    if ((iter == synced_.end() ? 0 : iter->second) == learned_)
+    {
+        return;
+    }
+
+    const std::string temp = filename + "." + std::to_string(std::random_device()()) + ".tmp";
+
+    fftw::export_wisdom_to_filename(temp.c_str());
+
+    // Renaming onto an existing file fails on Windows
+    if (std::rename(temp.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(filename.c_str());
+
+        if (std::rename(temp.c_str(), filename.c_str()) != 0)
+        {
+            std::remove(temp.c_str());
+            return;
+        }
+    }
+
+    synced_[filename] = learned_;
+}
+
+
+void PlanCache::Release(const KeyType &key, fftw::plan *plan)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // The key may have been planned again after the last reference was dropped and before the lock was acquired
+    auto iter = plans_.find(key);
+
+    if (iter != plans_.end() && iter->second.expired())
+    {
+        plans_.erase(iter);
+    }
+
+    delete plan;
+}
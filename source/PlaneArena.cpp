@@ -0,0 +1,168 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+
+
+
+#include "PlaneArena.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class PlaneArena::Frame
+
+
+PlaneArena::Frame::Frame()
+    : arena_(Local()), mark_(arena_.taken_.size())
+{}
+
+
+PlaneArena::Frame::~Frame()
+{
+    arena_.Release(mark_);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class PlaneArena
+
+
+std::atomic<size_t> PlaneArena::in_use_{ 0 };
+std::atomic<size_t> PlaneArena::peak_{ 0 };
+std::atomic<size_t> PlaneArena::reserved_{ 0 };
+std::atomic<size_t> PlaneArena::peak_reserved_{ 0 };
+
+
+PlaneArena::~PlaneArena()
+{
+    for (auto &c : classes_)
+    {
+        for (auto &e : c.idle)
+        {
+            AlignedFree(e);
+        }
+
+        reserved_.fetch_sub(c.bytes * c.idle.size(), std::memory_order_relaxed);
+    }
+}
+
+
+PlaneArena::Usage PlaneArena::Stats()
+{
+    Usage usage;
+
+    usage.in_use = in_use_.load(std::memory_order_relaxed);
+    usage.peak = peak_.load(std::memory_order_relaxed);
+    usage.reserved = reserved_.load(std::memory_order_relaxed);
+    usage.peak_reserved = peak_reserved_.load(std::memory_order_relaxed);
+
+    return usage;
+}
+
+
+PlaneArena &PlaneArena::Local()
+{
+    thread_local _Myt arena;
+    return arena;
+}
+
+
+size_t PlaneArena::RoundUp(size_t bytes)
+{
+    size_t step = 4096;
+
+    while (step * 8 < bytes)
+    {
+        step <<= 1;
+    }
+
+    return (bytes + step - 1) / step * step;
+}
+
+
+void PlaneArena::Raise(std::atomic<size_t> &peak, size_t value)
+{
+    size_t prev = peak.load(std::memory_order_relaxed);
+
+    while (prev < value && !peak.compare_exchange_weak(prev, value, std::memory_order_relaxed))
+    {
+    }
+}
+
+
+void *PlaneArena::Take(size_t bytes)
+{
+    // The arena only allocates to grow the storage kept by the thread
+    const RetainedAllocations retained;
+
+    bytes = RoundUp(bytes);
+    FLType *data = nullptr;
+
+    auto c = classes_.begin();
+    while (c != classes_.end() && c->bytes != bytes) ++c;
+
+    if (c == classes_.end())
+    {
+        c = classes_.insert(c, Class{ bytes, {} });
+    }
+
+    if (c->idle.empty())
+    {
+        AlignedMalloc(data, bytes / sizeof(FLType));
+        Raise(peak_reserved_, reserved_.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    }
+    else
+    {
+        data = c->idle.back();
+        c->idle.pop_back();
+    }
+
+    taken_.push_back(Taken{ data, bytes });
+    Raise(peak_, in_use_.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+
+    return data;
+}
+
+
+void PlaneArena::Release(size_t mark)
+{
+    const RetainedAllocations retained;
+
+    while (taken_.size() > mark)
+    {
+        const Taken e = taken_.back();
+        taken_.pop_back();
+
+        for (auto &c : classes_)
+        {
+            if (c.bytes == e.bytes)
+            {
+                c.idle.push_back(e.data);
+                break;
+            }
+        }
+
+        in_use_.fetch_sub(e.bytes, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,118 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+#include "PredictiveSearch.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class PredictiveSearch
+
+
+void PredictiveSearch::Reset(const FLType *ref, PCType height, PCType width, PCType stride,
+    PCType block_size, PCType range, PCType step, double thMSE, SIMDLevel simd,
+    PlaneArena::Frame &scratch)
+{
+    ref_ = ref;
+    height_ = height;
+    width_ = width;
+    stride_ = stride;
+    block_size_ = block_size;
+    range_ = range;
+    step_ = step;
+    thMSE_ = thMSE;
+    simd_ = simd;
+    prev_pos_ = PosType(-1, -1);
+    prev_match_.clear();
+    predicted_ = 0;
+    window_size_ = 0;
+    block_ = scratch.Get(static_cast<size_t>(block_size) * block_size);
+
+    const PCType pos_height = height_ - block_size_ + 1;
+    const PCType pos_width = width_ - block_size_ + 1;
+
+    search_pos_.bind(scratch.Get<uint32_t>(static_cast<size_t>(pos_height) * pos_width), pos_height, pos_width);
+}
+
+
+void PredictiveSearch::Match(PosPairTopK &match_code, PCType j, PCType i, const BlockMoments *moments)
+{
+    const PCType BlockPosRight = width_ - block_size_;
+
+    Reserve(seeds_, match_code.capacity() + 1);
+    Reserve(prev_match_, match_code.capacity());
+
+    block_type refBlock(block_, ref_, stride_, block_size_, block_size_, PosType(j, i));
+
+    if (prev_pos_.y != j || prev_pos_.x >= i || predicted_ >= refresh_interval)
+    {
+        WindowMatch(match_code, refBlock, moments);
+    }
+    else
+    {
+        // The previous matches shifted by the same distance as the reference block, the reference block is also a seed
+        const PCType shift = i - prev_pos_.x;
+
+        seeds_.clear();
+        seeds_.push_back(PosType(j, i));
+
+        for (const auto &pos : prev_match_)
+        {
+            seeds_.push_back(PosType(pos.y, Min(pos.x + shift, BlockPosRight)));
+        }
+
+        refBlock.GenSearchPos(search_pos_, seeds_, height_, width_, predict_range, 1);
+        refBlock.BlockMatchingMulti(match_code, ref_, stride_, FLType(1), search_pos_.get(), thMSE_, simd_, moments);
+
+        // Fall back to the window search when the prediction lost some of the similar blocks
+        if (match_code.size() < window_size_)
+        {
+            match_code.reset(match_code.capacity());
+            match_code.push_fixed(PosPair(KeyType(0), PosType(j, i)));
+            WindowMatch(match_code, refBlock, moments);
+        }
+        else
+        {
+            ++predicted_;
+        }
+    }
+
+    prev_pos_ = PosType(j, i);
+    prev_match_.clear();
+
+    for (const auto &e : match_code.get())
+    {
+        prev_match_.push_back(e.second);
+    }
+}
+
+
+void PredictiveSearch::WindowMatch(PosPairTopK &match_code, const block_type &refBlock, const BlockMoments *moments)
+{
+    refBlock.BlockMatchingMulti(match_code, ref_, height_, width_, stride_, FLType(1),
+        range_, step_, thMSE_, true, simd_, moments);
+
+    predicted_ = 0;
+    window_size_ = match_code.size();
+}
@@ -0,0 +1,1753 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+#include "SIMD.h"
+
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+
+// Contraction into FMA would make the results depend on the instruction set
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#elif defined(_MSC_VER)
+#pragma fp_contract(off)
+#endif
+
+
+// AVX2 and AVX-512 kernels are compiled per function, the rest of the plugin keeps the baseline instruction set
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define SIMD_TARGET_AVX512 __attribute__((target("avx512f")))
+#define SIMD_HAS_AVX
+#elif defined(__SSE2__) && defined(_MSC_VER)
+#define SIMD_TARGET_AVX2
+#define SIMD_TARGET_AVX512
+#define SIMD_HAS_AVX
+#endif
+
+// GCC before 13 takes the undefined upper halves of the AVX-512 widening, extraction and approximation intrinsics
+// for uninitialized reads, a false positive of -Wmaybe-uninitialized silenced over the AVX-512 kernels using them
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13
+#define SIMD_AVX512_WARNINGS_BEGIN _Pragma("GCC diagnostic push") _Pragma("GCC diagnostic ignored \"-Wmaybe-uninitialized\"")
+#define SIMD_AVX512_WARNINGS_END _Pragma("GCC diagnostic pop")
+#else
+#define SIMD_AVX512_WARNINGS_BEGIN
+#define SIMD_AVX512_WARNINGS_END
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// CPU detection
+
+
+#if defined(__SSE2__)
+static void CPUID(int leaf, int subleaf, unsigned regs[4])
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, leaf, subleaf);
+    for (int i = 0; i < 4; ++i) regs[i] = static_cast<unsigned>(r[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t XGETBV()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__ __volatile__("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<uint64_t>(edx) << 32) | eax;
+#endif
+}
+
+static SIMDLevel SIMDLevel_Detect()
+{
+    SIMDLevel level = SIMDLevel::SSE2;
+
+#if defined(SIMD_HAS_AVX)
+    unsigned regs[4];
+
+    CPUID(0, 0, regs);
+    const unsigned max_leaf = regs[0];
+
+    CPUID(1, 0, regs);
+    const bool osxsave = (regs[2] & (1u << 27)) != 0;
+    const bool avx = (regs[2] & (1u << 28)) != 0;
+    const bool fma = (regs[2] & (1u << 12)) != 0;
+
+    if (max_leaf < 7 || !osxsave || !avx || !fma)
+    {
+        return level;
+    }
+
+    // The OS must preserve the YMM (and ZMM) states on context switch
+    const uint64_t xcr0 = XGETBV();
+    CPUID(7, 0, regs);
+
+    if ((regs[1] & (1u << 5)) && (xcr0 & 0x06) == 0x06)
+    {
+        level = SIMDLevel::AVX2;
+
+        if ((regs[1] & (1u << 16)) && (xcr0 & 0xE6) == 0xE6)
+        {
+            level = SIMDLevel::AVX512;
+        }
+    }
+#endif
+
+    return level;
+}
+#else
+static SIMDLevel SIMDLevel_Detect()
+{
+    return SIMDLevel::None;
+}
+#endif
+
+
+SIMDLevel SIMDLevel_CPU()
+{
+    static const SIMDLevel level = SIMDLevel_Detect();
+    return level;
+}
+
+
+SIMDLevel SIMDLevel_Select(int opt)
+{
+    const SIMDLevel cpu = SIMDLevel_CPU();
+
+    if (opt <= 0)
+    {
+        return cpu;
+    }
+
+    return static_cast<SIMDLevel>(Min(opt, static_cast<int>(cpu)));
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sum of squared differences
+
+
+static FLType SSD_Residue(FLType dist, const FLType *refp, const FLType *srcp, PCType src_stride,
+    PCType height, PCType width, PCType simd_width, FLType bound)
+{
+    for (PCType y = 0; y < height; ++y)
+    {
+        for (PCType x = simd_width; x < width; ++x)
+        {
+            const FLType temp = refp[x] - srcp[x];
+            dist += temp * temp;
+        }
+
+        if (dist > bound)
+        {
+            break;
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    return dist;
+}
+
+
+static FLType SSD_C(const FLType *refp, const FLType *srcp, PCType src_stride, PCType height, PCType width, FLType bound)
+{
+    return SSD_Residue(FLType(0), refp, srcp, src_stride, height, width, 0, bound);
+}
+
+
+#if defined(__SSE2__)
+static FLType SSD_Reduce(const __m128 &sum)
+{
+    alignas(16) FLType sum_f32[4];
+    _mm_store_ps(sum_f32, sum);
+    return sum_f32[0] + sum_f32[1] + sum_f32[2] + sum_f32[3];
+}
+
+
+static FLType SSD_SSE2(const FLType *refp, const FLType *srcp, PCType src_stride, PCType height, PCType width, FLType bound)
+{
+    const PCType simd_width = width - width % 8;
+    FLType dist = 0;
+
+    if (simd_width > 0)
+    {
+        __m128 sum0 = _mm_setzero_ps();
+        __m128 sum1 = _mm_setzero_ps();
+        __m128 sum2 = _mm_setzero_ps();
+        __m128 sum3 = _mm_setzero_ps();
+        bool odd = false;
+
+        auto refp0 = refp;
+        auto srcp0 = srcp;
+
+        for (PCType y = 0; y < height; ++y)
+        {
+            for (PCType x = 0; x < simd_width; x += 8)
+            {
+                const __m128 d1 = _mm_sub_ps(_mm_loadu_ps(refp0 + x), _mm_loadu_ps(srcp0 + x));
+                const __m128 d2 = _mm_sub_ps(_mm_loadu_ps(refp0 + x + 4), _mm_loadu_ps(srcp0 + x + 4));
+                const __m128 d1sqr = _mm_mul_ps(d1, d1);
+                const __m128 d2sqr = _mm_mul_ps(d2, d2);
+
+                if (odd)
+                {
+                    sum2 = _mm_add_ps(sum2, d1sqr);
+                    sum3 = _mm_add_ps(sum3, d2sqr);
+                }
+                else
+                {
+                    sum0 = _mm_add_ps(sum0, d1sqr);
+                    sum1 = _mm_add_ps(sum1, d2sqr);
+                }
+
+                odd = !odd;
+            }
+
+            // Checked every other row, which is enough to skip most of a far candidate
+            if (y & 1)
+            {
+                dist = SSD_Reduce(_mm_add_ps(_mm_add_ps(sum0, sum2), _mm_add_ps(sum1, sum3)));
+
+                if (dist > bound)
+                {
+                    return dist;
+                }
+            }
+
+            refp0 += width;
+            srcp0 += src_stride;
+        }
+
+        dist = SSD_Reduce(_mm_add_ps(_mm_add_ps(sum0, sum2), _mm_add_ps(sum1, sum3)));
+    }
+
+    return simd_width < width ? SSD_Residue(dist, refp, srcp, src_stride, height, width, simd_width, bound) : dist;
+}
+#endif
+
+
+#if defined(SIMD_HAS_AVX)
+SIMD_TARGET_AVX2
+static inline FLType SSD_Reduce(const __m256 &sum0, const __m256 &sum1)
+{
+    const __m256 sum = _mm256_add_ps(sum0, sum1);
+    return SSD_Reduce(_mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)));
+}
+
+
+SIMD_TARGET_AVX2
+static FLType SSD_AVX2(const FLType *refp, const FLType *srcp, PCType src_stride, PCType height, PCType width, FLType bound)
+{
+    const PCType simd_width = width - width % 8;
+    FLType dist = 0;
+
+    if (simd_width > 0)
+    {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        bool odd = false;
+
+        auto refp0 = refp;
+        auto srcp0 = srcp;
+
+        for (PCType y = 0; y < height; ++y)
+        {
+            for (PCType x = 0; x < simd_width; x += 8)
+            {
+                const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(refp0 + x), _mm256_loadu_ps(srcp0 + x));
+                const __m256 dsqr = _mm256_mul_ps(d, d);
+
+                if (odd)
+                {
+                    sum1 = _mm256_add_ps(sum1, dsqr);
+                }
+                else
+                {
+                    sum0 = _mm256_add_ps(sum0, dsqr);
+                }
+
+                odd = !odd;
+            }
+
+            if (y & 1)
+            {
+                dist = SSD_Reduce(sum0, sum1);
+
+                if (dist > bound)
+                {
+                    return dist;
+                }
+            }
+
+            refp0 += width;
+            srcp0 += src_stride;
+        }
+
+        dist = SSD_Reduce(sum0, sum1);
+    }
+
+    return simd_width < width ? SSD_Residue(dist, refp, srcp, src_stride, height, width, simd_width, bound) : dist;
+}
+
+
+SIMD_AVX512_WARNINGS_BEGIN
+
+SIMD_TARGET_AVX512
+static inline __m512 SSD_Combine(const __m256 &lo, const __m256 &hi)
+{
+    return _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castpd256_pd512(_mm256_castps_pd(lo)), _mm256_castps_pd(hi), 1));
+}
+
+
+SIMD_TARGET_AVX512
+static inline FLType SSD_Reduce(const __m512 &sum)
+{
+    return SSD_Reduce(_mm512_castps512_ps256(sum), _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(sum), 1)));
+}
+
+
+SIMD_TARGET_AVX512
+static FLType SSD_AVX512(const FLType *refp, const FLType *srcp, PCType src_stride, PCType height, PCType width, FLType bound)
+{
+    const PCType simd_width = width - width % 8;
+    FLType dist = 0;
+
+    if (simd_width > 0)
+    {
+        __m512 sum = _mm512_setzero_ps();
+
+        // Two consecutive chunks (possibly from different rows) are processed in one vector
+        const FLType *refc = nullptr;
+        const FLType *srcc = nullptr;
+
+        auto refp0 = refp;
+        auto srcp0 = srcp;
+
+        for (PCType y = 0; y < height; ++y)
+        {
+            for (PCType x = 0; x < simd_width; x += 8)
+            {
+                if (!refc)
+                {
+                    refc = refp0 + x;
+                    srcc = srcp0 + x;
+                    continue;
+                }
+
+                const __m512 r = SSD_Combine(_mm256_loadu_ps(refc), _mm256_loadu_ps(refp0 + x));
+                const __m512 s = SSD_Combine(_mm256_loadu_ps(srcc), _mm256_loadu_ps(srcp0 + x));
+                const __m512 d = _mm512_sub_ps(r, s);
+                sum = _mm512_add_ps(sum, _mm512_mul_ps(d, d));
+                refc = nullptr;
+            }
+
+            // A pending chunk is left out, the partial sum is still a lower bound
+            if ((y & 1) && !refc)
+            {
+                dist = SSD_Reduce(sum);
+
+                if (dist > bound)
+                {
+                    return dist;
+                }
+            }
+
+            refp0 += width;
+            srcp0 += src_stride;
+        }
+
+        if (refc)
+        {
+            const __m256 d = _mm256_sub_ps(_mm256_loadu_ps(refc), _mm256_loadu_ps(srcc));
+            sum = _mm512_add_ps(sum, SSD_Combine(_mm256_mul_ps(d, d), _mm256_setzero_ps()));
+        }
+
+        dist = SSD_Reduce(sum);
+    }
+
+    return simd_width < width ? SSD_Residue(dist, refp, srcp, src_stride, height, width, simd_width, bound) : dist;
+}
+
+SIMD_AVX512_WARNINGS_END
+#endif
+
+
+SSDFunc SSD_Func(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+        return SSD_AVX512;
+    case SIMDLevel::AVX2:
+        return SSD_AVX2;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return SSD_SSE2;
+#endif
+    default:
+        return SSD_C;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sum of squared differences at horizontally adjacent positions
+
+
+// The 16 partial sums of SSDFunc are kept per lane, p[l] being partial sum l of every position,
+// and reduced in the same order
+#if defined(__SSE2__)
+static inline __m128 SSDBatch_Reduce(const __m128 *p)
+{
+    __m128 s4[4];
+
+    for (int l = 0; l < 4; ++l)
+    {
+        s4[l] = _mm_add_ps(_mm_add_ps(p[l], p[l + 8]), _mm_add_ps(p[l + 4], p[l + 12]));
+    }
+
+    return _mm_add_ps(_mm_add_ps(_mm_add_ps(s4[0], s4[1]), s4[2]), s4[3]);
+}
+
+
+static inline void SSDBatch_Chunk(__m128 *p, const FLType *refp, const FLType *srcp)
+{
+    for (int l = 0; l < 8; ++l)
+    {
+        const __m128 d = _mm_sub_ps(_mm_set1_ps(refp[l]), _mm_loadu_ps(srcp + l));
+        p[l] = _mm_add_ps(p[l], _mm_mul_ps(d, d));
+    }
+}
+
+
+static void SSDBatch_SSE2(FLType *dist, const FLType *refp, const FLType *srcp, PCType src_stride,
+    PCType height, PCType width, FLType bound)
+{
+    const PCType simd_width = width - width % 8;
+    const __m128 bound_v = _mm_set1_ps(bound);
+    __m128 sum = _mm_setzero_ps();
+
+    if (simd_width > 0)
+    {
+        __m128 p[16];
+        bool odd = false;
+
+        for (auto &e : p)
+        {
+            e = _mm_setzero_ps();
+        }
+
+        auto refp0 = refp;
+        auto srcp0 = srcp;
+
+        for (PCType y = 0; y < height; ++y)
+        {
+            for (PCType x = 0; x < simd_width; x += 8)
+            {
+                if (odd)
+                {
+                    SSDBatch_Chunk(p + 8, refp0 + x, srcp0 + x);
+                }
+                else
+                {
+                    SSDBatch_Chunk(p, refp0 + x, srcp0 + x);
+                }
+
+                odd = !odd;
+            }
+
+            if (y & 1)
+            {
+                sum = SSDBatch_Reduce(p);
+
+                if (_mm_movemask_ps(_mm_cmpgt_ps(sum, bound_v)) == 0xF)
+                {
+                    _mm_storeu_ps(dist, sum);
+                    return;
+                }
+            }
+
+            refp0 += width;
+            srcp0 += src_stride;
+        }
+
+        sum = SSDBatch_Reduce(p);
+    }
+
+    for (PCType y = simd_width < width ? 0 : height; y < height; ++y)
+    {
+        for (PCType x = simd_width; x < width; ++x)
+        {
+            const __m128 d = _mm_sub_ps(_mm_set1_ps(refp[x]), _mm_loadu_ps(srcp + x));
+            sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+        }
+
+        if (_mm_movemask_ps(_mm_cmpgt_ps(sum, bound_v)) == 0xF)
+        {
+            break;
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    _mm_storeu_ps(dist, sum);
+}
+#endif
+
+
+#if defined(SIMD_HAS_AVX)
+SIMD_TARGET_AVX2
+static inline __m256 SSDBatch_Reduce(const __m256 *p)
+{
+    __m256 s4[4];
+
+    for (int l = 0; l < 4; ++l)
+    {
+        s4[l] = _mm256_add_ps(_mm256_add_ps(p[l], p[l + 8]), _mm256_add_ps(p[l + 4], p[l + 12]));
+    }
+
+    return _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(s4[0], s4[1]), s4[2]), s4[3]);
+}
+
+
+SIMD_TARGET_AVX2
+static inline void SSDBatch_Chunk(__m256 *p, const FLType *refp, const FLType *srcp)
+{
+    for (int l = 0; l < 8; ++l)
+    {
+        const __m256 d = _mm256_sub_ps(_mm256_set1_ps(refp[l]), _mm256_loadu_ps(srcp + l));
+        p[l] = _mm256_add_ps(p[l], _mm256_mul_ps(d, d));
+    }
+}
+
+
+SIMD_TARGET_AVX2
+static void SSDBatch_AVX2(FLType *dist, const FLType *refp, const FLType *srcp, PCType src_stride,
+    PCType height, PCType width, FLType bound)
+{
+    const PCType simd_width = width - width % 8;
+    const __m256 bound_v = _mm256_set1_ps(bound);
+    __m256 sum = _mm256_setzero_ps();
+
+    if (simd_width > 0)
+    {
+        __m256 p[16];
+        bool odd = false;
+
+        for (auto &e : p)
+        {
+            e = _mm256_setzero_ps();
+        }
+
+        auto refp0 = refp;
+        auto srcp0 = srcp;
+
+        for (PCType y = 0; y < height; ++y)
+        {
+            for (PCType x = 0; x < simd_width; x += 8)
+            {
+                if (odd)
+                {
+                    SSDBatch_Chunk(p + 8, refp0 + x, srcp0 + x);
+                }
+                else
+                {
+                    SSDBatch_Chunk(p, refp0 + x, srcp0 + x);
+                }
+
+                odd = !odd;
+            }
+
+            if (y & 1)
+            {
+                sum = SSDBatch_Reduce(p);
+
+                if (_mm256_movemask_ps(_mm256_cmp_ps(sum, bound_v, _CMP_GT_OQ)) == 0xFF)
+                {
+                    _mm256_storeu_ps(dist, sum);
+                    return;
+                }
+            }
+
+            refp0 += width;
+            srcp0 += src_stride;
+        }
+
+        sum = SSDBatch_Reduce(p);
+    }
+
+    for (PCType y = simd_width < width ? 0 : height; y < height; ++y)
+    {
+        for (PCType x = simd_width; x < width; ++x)
+        {
+            const __m256 d = _mm256_sub_ps(_mm256_set1_ps(refp[x]), _mm256_loadu_ps(srcp + x));
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(d, d));
+        }
+
+        if (_mm256_movemask_ps(_mm256_cmp_ps(sum, bound_v, _CMP_GT_OQ)) == 0xFF)
+        {
+            break;
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    _mm256_storeu_ps(dist, sum);
+}
+
+
+SIMD_TARGET_AVX512
+static inline __m512 SSDBatch_Reduce(const __m512 *p)
+{
+    __m512 s4[4];
+
+    for (int l = 0; l < 4; ++l)
+    {
+        s4[l] = _mm512_add_ps(_mm512_add_ps(p[l], p[l + 8]), _mm512_add_ps(p[l + 4], p[l + 12]));
+    }
+
+    return _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(s4[0], s4[1]), s4[2]), s4[3]);
+}
+
+
+SIMD_TARGET_AVX512
+static inline void SSDBatch_Chunk(__m512 *p, const FLType *refp, const FLType *srcp)
+{
+    for (int l = 0; l < 8; ++l)
+    {
+        const __m512 d = _mm512_sub_ps(_mm512_set1_ps(refp[l]), _mm512_loadu_ps(srcp + l));
+        p[l] = _mm512_add_ps(p[l], _mm512_mul_ps(d, d));
+    }
+}
+
+
+SIMD_TARGET_AVX512
+static void SSDBatch_AVX512(FLType *dist, const FLType *refp, const FLType *srcp, PCType src_stride,
+    PCType height, PCType width, FLType bound)
+{
+    const PCType simd_width = width - width % 8;
+    const __m512 bound_v = _mm512_set1_ps(bound);
+    __m512 sum = _mm512_setzero_ps();
+
+    if (simd_width > 0)
+    {
+        __m512 p[16];
+        bool odd = false;
+
+        for (auto &e : p)
+        {
+            e = _mm512_setzero_ps();
+        }
+
+        auto refp0 = refp;
+        auto srcp0 = srcp;
+
+        for (PCType y = 0; y < height; ++y)
+        {
+            for (PCType x = 0; x < simd_width; x += 8)
+            {
+                if (odd)
+                {
+                    SSDBatch_Chunk(p + 8, refp0 + x, srcp0 + x);
+                }
+                else
+                {
+                    SSDBatch_Chunk(p, refp0 + x, srcp0 + x);
+                }
+
+                odd = !odd;
+            }
+
+            if (y & 1)
+            {
+                sum = SSDBatch_Reduce(p);
+
+                if (_mm512_cmp_ps_mask(sum, bound_v, _CMP_GT_OQ) == 0xFFFF)
+                {
+                    _mm512_storeu_ps(dist, sum);
+                    return;
+                }
+            }
+
+            refp0 += width;
+            srcp0 += src_stride;
+        }
+
+        sum = SSDBatch_Reduce(p);
+    }
+
+    for (PCType y = simd_width < width ? 0 : height; y < height; ++y)
+    {
+        for (PCType x = simd_width; x < width; ++x)
+        {
+            const __m512 d = _mm512_sub_ps(_mm512_set1_ps(refp[x]), _mm512_loadu_ps(srcp + x));
+            sum = _mm512_add_ps(sum, _mm512_mul_ps(d, d));
+        }
+
+        if (_mm512_cmp_ps_mask(sum, bound_v, _CMP_GT_OQ) == 0xFFFF)
+        {
+            break;
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    _mm512_storeu_ps(dist, sum);
+}
+#endif
+
+
+SSDBatchFunc SSDBatch_Func(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+        return SSDBatch_AVX512;
+    case SIMDLevel::AVX2:
+        return SSDBatch_AVX2;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return SSDBatch_SSE2;
+#endif
+    default:
+        return nullptr;
+    }
+}
+
+
+PCType SSDBatch_Size(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+        return 16;
+    case SIMDLevel::AVX2:
+        return 8;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return 4;
+#endif
+    default:
+        return 0;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sum of squared differences of integer samples
+
+
+template < typename _Ty >
+static uint64_t SSDInt_Residue(const _Ty *refp, const _Ty *srcp, PCType x0, PCType width)
+{
+    uint64_t dist = 0;
+
+    for (PCType x = x0; x < width; ++x)
+    {
+        const int64_t temp = static_cast<int64_t>(refp[x]) - static_cast<int64_t>(srcp[x]);
+        dist += static_cast<uint64_t>(temp * temp);
+    }
+
+    return dist;
+}
+
+
+template < typename _Ty >
+static double SSDInt_C(const _Ty *refp, const _Ty *srcp, PCType src_stride, PCType height, PCType width, double bound)
+{
+    uint64_t dist = 0;
+
+    for (PCType y = 0; y < height; ++y)
+    {
+        dist += SSDInt_Residue(refp, srcp, 0, width);
+
+        if (static_cast<double>(dist) > bound)
+        {
+            break;
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    return static_cast<double>(dist);
+}
+
+
+#if defined(__SSE2__)
+static inline uint64_t SSDInt_Reduce(const __m128i &sum)
+{
+    alignas(16) uint64_t sum_u64[2];
+    _mm_store_si128(reinterpret_cast<__m128i *>(sum_u64), sum);
+    return sum_u64[0] + sum_u64[1];
+}
+
+
+// Squares of 8 differences of 8-bit samples summed into 4 lanes of 32 bits, no overflow for blocks up to 64x64
+static inline __m128i SSD8_Chunk(const uint8_t *refp, const uint8_t *srcp)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(refp)), zero),
+        _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(srcp)), zero));
+    return _mm_madd_epi16(d, d);
+}
+
+
+static double SSD8_SSE2(const uint8_t *refp, const uint8_t *srcp, PCType src_stride, PCType height, PCType width, double bound)
+{
+    const PCType simd_width = width - width % 8;
+    __m128i sum = _mm_setzero_si128();
+    uint64_t rest = 0;
+    uint64_t dist = 0;
+
+    for (PCType y = 0; y < height; ++y)
+    {
+        for (PCType x = 0; x < simd_width; x += 8)
+        {
+            sum = _mm_add_epi32(sum, SSD8_Chunk(refp + x, srcp + x));
+        }
+
+        rest += SSDInt_Residue(refp, srcp, simd_width, width);
+
+        if (y & 1)
+        {
+            dist = SSDInt_Reduce(_mm_add_epi64(_mm_unpacklo_epi32(sum, _mm_setzero_si128()),
+                _mm_unpackhi_epi32(sum, _mm_setzero_si128()))) + rest;
+
+            if (static_cast<double>(dist) > bound)
+            {
+                return static_cast<double>(dist);
+            }
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    dist = SSDInt_Reduce(_mm_add_epi64(_mm_unpacklo_epi32(sum, _mm_setzero_si128()),
+        _mm_unpackhi_epi32(sum, _mm_setzero_si128()))) + rest;
+
+    return static_cast<double>(dist);
+}
+
+
+// Squares of 8 differences of 16-bit samples, each up to 2^32 - 2^17 + 1, summed into 2 lanes of 64 bits
+static inline __m128i SSD16_Chunk(const uint16_t *refp, const uint16_t *srcp)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i *>(refp));
+    const __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(srcp));
+    const __m128i d = _mm_or_si128(_mm_subs_epu16(r, s), _mm_subs_epu16(s, r));
+    const __m128i lo = _mm_mullo_epi16(d, d);
+    const __m128i hi = _mm_mulhi_epu16(d, d);
+    const __m128i sqr0 = _mm_unpacklo_epi16(lo, hi);
+    const __m128i sqr1 = _mm_unpackhi_epi16(lo, hi);
+    return _mm_add_epi64(_mm_add_epi64(_mm_unpacklo_epi32(sqr0, zero), _mm_unpackhi_epi32(sqr0, zero)),
+        _mm_add_epi64(_mm_unpacklo_epi32(sqr1, zero), _mm_unpackhi_epi32(sqr1, zero)));
+}
+
+
+static double SSD16_SSE2(const uint16_t *refp, const uint16_t *srcp, PCType src_stride, PCType height, PCType width, double bound)
+{
+    const PCType simd_width = width - width % 8;
+    __m128i sum = _mm_setzero_si128();
+    uint64_t rest = 0;
+    uint64_t dist = 0;
+
+    for (PCType y = 0; y < height; ++y)
+    {
+        for (PCType x = 0; x < simd_width; x += 8)
+        {
+            sum = _mm_add_epi64(sum, SSD16_Chunk(refp + x, srcp + x));
+        }
+
+        rest += SSDInt_Residue(refp, srcp, simd_width, width);
+
+        if (y & 1)
+        {
+            dist = SSDInt_Reduce(sum) + rest;
+
+            if (static_cast<double>(dist) > bound)
+            {
+                return static_cast<double>(dist);
+            }
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    dist = SSDInt_Reduce(sum) + rest;
+
+    return static_cast<double>(dist);
+}
+#endif
+
+
+#if defined(SIMD_HAS_AVX)
+SIMD_TARGET_AVX2
+static inline uint64_t SSDInt_Reduce(const __m256i &sum)
+{
+    return SSDInt_Reduce(_mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1)));
+}
+
+
+SIMD_TARGET_AVX2
+static inline __m256i SSDInt_Widen(const __m256i &sum)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    return _mm256_add_epi64(_mm256_unpacklo_epi32(sum, zero), _mm256_unpackhi_epi32(sum, zero));
+}
+
+
+SIMD_TARGET_AVX2
+static double SSD8_AVX2(const uint8_t *refp, const uint8_t *srcp, PCType src_stride, PCType height, PCType width, double bound)
+{
+    const PCType simd_width16 = width - width % 16;
+    const PCType simd_width = width - width % 8;
+    __m256i sum = _mm256_setzero_si256();
+    __m128i sum8 = _mm_setzero_si128();
+    uint64_t rest = 0;
+    uint64_t dist = 0;
+
+    for (PCType y = 0; y < height; ++y)
+    {
+        for (PCType x = 0; x < simd_width16; x += 16)
+        {
+            const __m256i d = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(refp + x))),
+                _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(srcp + x))));
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(d, d));
+        }
+
+        if (simd_width16 < simd_width)
+        {
+            sum8 = _mm_add_epi32(sum8, SSD8_Chunk(refp + simd_width16, srcp + simd_width16));
+        }
+
+        rest += SSDInt_Residue(refp, srcp, simd_width, width);
+
+        if (y & 1)
+        {
+            dist = SSDInt_Reduce(SSDInt_Widen(_mm256_add_epi32(sum, _mm256_castsi128_si256(sum8)))) + rest;
+
+            if (static_cast<double>(dist) > bound)
+            {
+                return static_cast<double>(dist);
+            }
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    dist = SSDInt_Reduce(SSDInt_Widen(_mm256_add_epi32(sum, _mm256_castsi128_si256(sum8)))) + rest;
+
+    return static_cast<double>(dist);
+}
+
+
+SIMD_TARGET_AVX2
+static double SSD16_AVX2(const uint16_t *refp, const uint16_t *srcp, PCType src_stride, PCType height, PCType width, double bound)
+{
+    const PCType simd_width16 = width - width % 16;
+    const PCType simd_width = width - width % 8;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i sum = _mm256_setzero_si256();
+    __m128i sum8 = _mm_setzero_si128();
+    uint64_t rest = 0;
+    uint64_t dist = 0;
+
+    for (PCType y = 0; y < height; ++y)
+    {
+        for (PCType x = 0; x < simd_width16; x += 16)
+        {
+            const __m256i r = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(refp + x));
+            const __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(srcp + x));
+            const __m256i d = _mm256_or_si256(_mm256_subs_epu16(r, s), _mm256_subs_epu16(s, r));
+            const __m256i lo = _mm256_mullo_epi16(d, d);
+            const __m256i hi = _mm256_mulhi_epu16(d, d);
+            const __m256i sqr0 = _mm256_unpacklo_epi16(lo, hi);
+            const __m256i sqr1 = _mm256_unpackhi_epi16(lo, hi);
+            sum = _mm256_add_epi64(sum, _mm256_add_epi64(_mm256_unpacklo_epi32(sqr0, zero), _mm256_unpackhi_epi32(sqr0, zero)));
+            sum = _mm256_add_epi64(sum, _mm256_add_epi64(_mm256_unpacklo_epi32(sqr1, zero), _mm256_unpackhi_epi32(sqr1, zero)));
+        }
+
+        if (simd_width16 < simd_width)
+        {
+            sum8 = _mm_add_epi64(sum8, SSD16_Chunk(refp + simd_width16, srcp + simd_width16));
+        }
+
+        rest += SSDInt_Residue(refp, srcp, simd_width, width);
+
+        if (y & 1)
+        {
+            dist = SSDInt_Reduce(sum) + SSDInt_Reduce(sum8) + rest;
+
+            if (static_cast<double>(dist) > bound)
+            {
+                return static_cast<double>(dist);
+            }
+        }
+
+        refp += width;
+        srcp += src_stride;
+    }
+
+    dist = SSDInt_Reduce(sum) + SSDInt_Reduce(sum8) + rest;
+
+    return static_cast<double>(dist);
+}
+#endif
+
+
+// The AVX-512 level uses the AVX2 kernels, the blocks are too narrow to fill wider vectors of integers
+SSD8Func SSD8_Func(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+    case SIMDLevel::AVX2:
+        return SSD8_AVX2;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return SSD8_SSE2;
+#endif
+    default:
+        return SSDInt_C<uint8_t>;
+    }
+}
+
+
+SSD16Func SSD16_Func(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+    case SIMDLevel::AVX2:
+        return SSD16_AVX2;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return SSD16_SSE2;
+#endif
+    default:
+        return SSDInt_C<uint16_t>;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Running column sums of squared differences
+
+
+static void SSDSlide_C(double *colsum, const FLType *ref0, const FLType *src0,
+    const FLType *ref1, const FLType *src1, PCType width)
+{
+    for (PCType x = 0; x < width; ++x)
+    {
+        const double temp0 = static_cast<double>(ref0[x]) - static_cast<double>(src0[x]);
+        const double temp1 = static_cast<double>(ref1[x]) - static_cast<double>(src1[x]);
+        colsum[x] += temp1 * temp1 - temp0 * temp0;
+    }
+}
+
+
+#if defined(__SSE2__)
+static inline __m128d SSDSlide_Diff(const __m128 &ref0, const __m128 &src0, const __m128 &ref1, const __m128 &src1)
+{
+    const __m128d d0 = _mm_sub_pd(_mm_cvtps_pd(ref0), _mm_cvtps_pd(src0));
+    const __m128d d1 = _mm_sub_pd(_mm_cvtps_pd(ref1), _mm_cvtps_pd(src1));
+    return _mm_sub_pd(_mm_mul_pd(d1, d1), _mm_mul_pd(d0, d0));
+}
+
+
+static void SSDSlide_SSE2(double *colsum, const FLType *ref0, const FLType *src0,
+    const FLType *ref1, const FLType *src1, PCType width)
+{
+    const PCType simd_width = width - width % 4;
+
+    for (PCType x = 0; x < simd_width; x += 4)
+    {
+        const __m128 r0 = _mm_loadu_ps(ref0 + x);
+        const __m128 s0 = _mm_loadu_ps(src0 + x);
+        const __m128 r1 = _mm_loadu_ps(ref1 + x);
+        const __m128 s1 = _mm_loadu_ps(src1 + x);
+
+        _mm_storeu_pd(colsum + x, _mm_add_pd(_mm_loadu_pd(colsum + x), SSDSlide_Diff(r0, s0, r1, s1)));
+        _mm_storeu_pd(colsum + x + 2, _mm_add_pd(_mm_loadu_pd(colsum + x + 2), SSDSlide_Diff(
+            _mm_movehl_ps(r0, r0), _mm_movehl_ps(s0, s0), _mm_movehl_ps(r1, r1), _mm_movehl_ps(s1, s1))));
+    }
+
+    SSDSlide_C(colsum + simd_width, ref0 + simd_width, src0 + simd_width,
+        ref1 + simd_width, src1 + simd_width, width - simd_width);
+}
+#endif
+
+
+#if defined(SIMD_HAS_AVX)
+SIMD_TARGET_AVX2
+static void SSDSlide_AVX2(double *colsum, const FLType *ref0, const FLType *src0,
+    const FLType *ref1, const FLType *src1, PCType width)
+{
+    const PCType simd_width = width - width % 4;
+
+    for (PCType x = 0; x < simd_width; x += 4)
+    {
+        const __m256d d0 = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(ref0 + x)), _mm256_cvtps_pd(_mm_loadu_ps(src0 + x)));
+        const __m256d d1 = _mm256_sub_pd(_mm256_cvtps_pd(_mm_loadu_ps(ref1 + x)), _mm256_cvtps_pd(_mm_loadu_ps(src1 + x)));
+        const __m256d diff = _mm256_sub_pd(_mm256_mul_pd(d1, d1), _mm256_mul_pd(d0, d0));
+
+        _mm256_storeu_pd(colsum + x, _mm256_add_pd(_mm256_loadu_pd(colsum + x), diff));
+    }
+
+    // SSDSlide_C is built for the baseline instruction set, thus the upper halves are cleared before calling it
+    _mm256_zeroupper();
+    SSDSlide_C(colsum + simd_width, ref0 + simd_width, src0 + simd_width,
+        ref1 + simd_width, src1 + simd_width, width - simd_width);
+}
+
+
+SIMD_AVX512_WARNINGS_BEGIN
+
+SIMD_TARGET_AVX512
+static void SSDSlide_AVX512(double *colsum, const FLType *ref0, const FLType *src0,
+    const FLType *ref1, const FLType *src1, PCType width)
+{
+    const PCType simd_width = width - width % 8;
+
+    for (PCType x = 0; x < simd_width; x += 8)
+    {
+        const __m512d d0 = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(ref0 + x)), _mm512_cvtps_pd(_mm256_loadu_ps(src0 + x)));
+        const __m512d d1 = _mm512_sub_pd(_mm512_cvtps_pd(_mm256_loadu_ps(ref1 + x)), _mm512_cvtps_pd(_mm256_loadu_ps(src1 + x)));
+        const __m512d diff = _mm512_sub_pd(_mm512_mul_pd(d1, d1), _mm512_mul_pd(d0, d0));
+
+        _mm512_storeu_pd(colsum + x, _mm512_add_pd(_mm512_loadu_pd(colsum + x), diff));
+    }
+
+    // SSDSlide_C is built for the baseline instruction set, thus the upper halves are cleared before calling it
+    _mm256_zeroupper();
+    SSDSlide_C(colsum + simd_width, ref0 + simd_width, src0 + simd_width,
+        ref1 + simd_width, src1 + simd_width, width - simd_width);
+}
+
+SIMD_AVX512_WARNINGS_END
+#endif
+
+
+SSDSlideFunc SSDSlide_Func(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+        return SSDSlide_AVX512;
+    case SIMDLevel::AVX2:
+        return SSDSlide_AVX2;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return SSDSlide_SSE2;
+#endif
+    default:
+        return SSDSlide_C;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Products of small matrices whose rows hold block_size values
+
+
+// The kernels are specialized for the row length L, a row shorter than the vector width is passed down to the narrower level.
+// When L is not a multiple of the vector width, the last vector overlaps the previous one instead of leaving a scalar tail,
+// the overlapped columns are computed twice in the same order and stored with the same values.
+// RB rows are computed at once, whose chains of additions are independent and hide the latency of each other.
+constexpr PCType MulRows_Offset(PCType L, PCType V, PCType v)
+{
+    return v * V < L - V ? v * V : L - V;
+}
+
+constexpr PCType MulRows_BlockRows(PCType vectors)
+{
+    return vectors < 8 ? 8 / vectors : 1;
+}
+
+
+template < PCType L >
+static void MulRows_C(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src, PCType rows)
+{
+    for (PCType r = 0; r < rows; ++r, dst += dst_stride, coef += count)
+    {
+        for (PCType x = 0; x < L; ++x)
+        {
+            FLType sum = 0;
+
+            for (PCType m = 0; m < count; ++m)
+            {
+                sum += coef[m] * src[m * L + x];
+            }
+
+            dst[x] = sum;
+        }
+    }
+}
+
+
+#if defined(__SSE2__)
+template < PCType L, PCType RB >
+static inline void MulRowsBlock_SSE2(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src)
+{
+    constexpr PCType vectors = (L + 3) / 4;
+
+    __m128 sum[RB][vectors];
+
+    for (PCType b = 0; b < RB; ++b)
+    {
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            sum[b][v] = _mm_setzero_ps();
+        }
+    }
+
+    for (PCType m = 0; m < count; ++m, src += L)
+    {
+        __m128 s[vectors];
+
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            s[v] = _mm_loadu_ps(src + MulRows_Offset(L, 4, v));
+        }
+
+        for (PCType b = 0; b < RB; ++b)
+        {
+            const __m128 c = _mm_set1_ps(coef[b * count + m]);
+
+            for (PCType v = 0; v < vectors; ++v)
+            {
+                sum[b][v] = _mm_add_ps(sum[b][v], _mm_mul_ps(c, s[v]));
+            }
+        }
+    }
+
+    for (PCType b = 0; b < RB; ++b)
+    {
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            _mm_storeu_ps(dst + b * dst_stride + MulRows_Offset(L, 4, v), sum[b][v]);
+        }
+    }
+}
+
+
+template < PCType L >
+static void MulRows_SSE2(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src, PCType rows)
+{
+    if constexpr (L >= 4)
+    {
+        constexpr PCType RB = MulRows_BlockRows((L + 3) / 4);
+        PCType r = 0;
+
+        for (; r + RB <= rows; r += RB)
+        {
+            MulRowsBlock_SSE2<L, RB>(dst + r * dst_stride, dst_stride, coef + r * count, count, src);
+        }
+
+        for (; r < rows; ++r)
+        {
+            MulRowsBlock_SSE2<L, 1>(dst + r * dst_stride, dst_stride, coef + r * count, count, src);
+        }
+    }
+    else
+    {
+        MulRows_C<L>(dst, dst_stride, coef, count, src, rows);
+    }
+}
+#endif
+
+
+#if defined(SIMD_HAS_AVX)
+template < PCType L, PCType RB >
+SIMD_TARGET_AVX2
+static inline void MulRowsBlock_AVX2(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src)
+{
+    constexpr PCType vectors = (L + 7) / 8;
+
+    __m256 sum[RB][vectors];
+
+    for (PCType b = 0; b < RB; ++b)
+    {
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            sum[b][v] = _mm256_setzero_ps();
+        }
+    }
+
+    for (PCType m = 0; m < count; ++m, src += L)
+    {
+        __m256 s[vectors];
+
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            s[v] = _mm256_loadu_ps(src + MulRows_Offset(L, 8, v));
+        }
+
+        for (PCType b = 0; b < RB; ++b)
+        {
+            const __m256 c = _mm256_set1_ps(coef[b * count + m]);
+
+            for (PCType v = 0; v < vectors; ++v)
+            {
+                sum[b][v] = _mm256_add_ps(sum[b][v], _mm256_mul_ps(c, s[v]));
+            }
+        }
+    }
+
+    for (PCType b = 0; b < RB; ++b)
+    {
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            _mm256_storeu_ps(dst + b * dst_stride + MulRows_Offset(L, 8, v), sum[b][v]);
+        }
+    }
+}
+
+
+template < PCType L >
+SIMD_TARGET_AVX2
+static void MulRows_AVX2(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src, PCType rows)
+{
+    if constexpr (L >= 8)
+    {
+        constexpr PCType RB = MulRows_BlockRows((L + 7) / 8);
+        PCType r = 0;
+
+        for (; r + RB <= rows; r += RB)
+        {
+            MulRowsBlock_AVX2<L, RB>(dst + r * dst_stride, dst_stride, coef + r * count, count, src);
+        }
+
+        for (; r < rows; ++r)
+        {
+            MulRowsBlock_AVX2<L, 1>(dst + r * dst_stride, dst_stride, coef + r * count, count, src);
+        }
+    }
+    else
+    {
+        MulRows_SSE2<L>(dst, dst_stride, coef, count, src, rows);
+    }
+}
+
+
+template < PCType L, PCType RB >
+SIMD_TARGET_AVX512
+static inline void MulRowsBlock_AVX512(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src)
+{
+    constexpr PCType vectors = (L + 15) / 16;
+
+    __m512 sum[RB][vectors];
+
+    for (PCType b = 0; b < RB; ++b)
+    {
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            sum[b][v] = _mm512_setzero_ps();
+        }
+    }
+
+    for (PCType m = 0; m < count; ++m, src += L)
+    {
+        __m512 s[vectors];
+
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            s[v] = _mm512_loadu_ps(src + MulRows_Offset(L, 16, v));
+        }
+
+        for (PCType b = 0; b < RB; ++b)
+        {
+            const __m512 c = _mm512_set1_ps(coef[b * count + m]);
+
+            for (PCType v = 0; v < vectors; ++v)
+            {
+                sum[b][v] = _mm512_add_ps(sum[b][v], _mm512_mul_ps(c, s[v]));
+            }
+        }
+    }
+
+    for (PCType b = 0; b < RB; ++b)
+    {
+        for (PCType v = 0; v < vectors; ++v)
+        {
+            _mm512_storeu_ps(dst + b * dst_stride + MulRows_Offset(L, 16, v), sum[b][v]);
+        }
+    }
+}
+
+
+template < PCType L >
+SIMD_TARGET_AVX512
+static void MulRows_AVX512(FLType *dst, PCType dst_stride, const FLType *coef, PCType count, const FLType *src, PCType rows)
+{
+    if constexpr (L >= 16)
+    {
+        constexpr PCType RB = MulRows_BlockRows((L + 15) / 16);
+        PCType r = 0;
+
+        for (; r + RB <= rows; r += RB)
+        {
+            MulRowsBlock_AVX512<L, RB>(dst + r * dst_stride, dst_stride, coef + r * count, count, src);
+        }
+
+        for (; r < rows; ++r)
+        {
+            MulRowsBlock_AVX512<L, 1>(dst + r * dst_stride, dst_stride, coef + r * count, count, src);
+        }
+    }
+    else
+    {
+        MulRows_AVX2<L>(dst, dst_stride, coef, count, src, rows);
+    }
+}
+#endif
+
+
+template < PCType L >
+static MulRowsFunc MulRows_Level(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+        return MulRows_AVX512<L>;
+    case SIMDLevel::AVX2:
+        return MulRows_AVX2<L>;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return MulRows_SSE2<L>;
+#endif
+    default:
+        return MulRows_C<L>;
+    }
+}
+
+
+MulRowsFunc MulRows_Func(SIMDLevel level, PCType block_size)
+{
+    switch (block_size)
+    {
+    case 4:
+        return MulRows_Level<4>(level);
+    case 8:
+        return MulRows_Level<8>(level);
+    case 11:
+        return MulRows_Level<11>(level);
+    case 16:
+        return MulRows_Level<16>(level);
+    default:
+        return nullptr;
+    }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Empirical Wiener shrinkage of the 3D transform coefficients
+
+
+static FLType Wiener_Residue(FLType *src, const FLType *ref, PCType first, PCType size, FLType sigma_sqr)
+{
+    FLType sum = 0;
+
+    for (PCType k = first; k < size; ++k)
+    {
+        const FLType refSquare = ref[k] * ref[k];
+        const FLType wienerCoef = refSquare / (refSquare + sigma_sqr);
+        src[k] *= wienerCoef;
+        sum += wienerCoef * wienerCoef;
+    }
+
+    return sum;
+}
+
+
+static FLType Wiener_Reduce(const FLType *p)
+{
+    FLType s8[8], s4[4];
+
+    for (int k = 0; k < 8; ++k) s8[k] = p[k] + p[k + 8];
+    for (int k = 0; k < 4; ++k) s4[k] = s8[k] + s8[k + 4];
+
+    return ((s4[0] + s4[1]) + s4[2]) + s4[3];
+}
+
+
+static FLType Wiener_C(FLType *src, const FLType *ref, PCType size, FLType sigma_sqr)
+{
+    const PCType width = size - size % 16;
+    FLType p[16] = {};
+
+    for (PCType c = 0; c < width; c += 16)
+    {
+        for (PCType k = 0; k < 16; ++k)
+        {
+            const FLType refSquare = ref[c + k] * ref[c + k];
+            const FLType wienerCoef = refSquare / (refSquare + sigma_sqr);
+            src[c + k] *= wienerCoef;
+            p[k] += wienerCoef * wienerCoef;
+        }
+    }
+
+    return Wiener_Reduce(p) + Wiener_Residue(src, ref, width, size, sigma_sqr);
+}
+
+
+#if defined(__SSE2__)
+template < WienerMode mode >
+static inline __m128 Wiener_Coef_SSE2(const __m128 &r, const __m128 &sgm_sqr)
+{
+    const __m128 r2 = _mm_mul_ps(r, r);
+    const __m128 den = _mm_add_ps(r2, sgm_sqr);
+
+    if constexpr (mode == WienerMode::Exact)
+    {
+        return _mm_div_ps(r2, den);
+    }
+    else
+    {
+        __m128 x = _mm_rcp_ps(den);
+
+        if constexpr (mode == WienerMode::Refined)
+        {
+            x = _mm_mul_ps(x, _mm_sub_ps(_mm_set1_ps(2), _mm_mul_ps(den, x)));
+        }
+
+        return _mm_mul_ps(r2, x);
+    }
+}
+
+
+template < WienerMode mode >
+static FLType Wiener_SSE2(FLType *src, const FLType *ref, PCType size, FLType sigma_sqr)
+{
+    const PCType width = size - size % 16;
+    const __m128 sgm_sqr = _mm_set1_ps(sigma_sqr);
+    __m128 p[4] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+
+    for (PCType c = 0; c < width; c += 16)
+    {
+        for (int v = 0; v < 4; ++v)
+        {
+            const __m128 w = Wiener_Coef_SSE2<mode>(_mm_loadu_ps(ref + c + v * 4), sgm_sqr);
+            _mm_storeu_ps(src + c + v * 4, _mm_mul_ps(_mm_loadu_ps(src + c + v * 4), w));
+            p[v] = _mm_add_ps(p[v], _mm_mul_ps(w, w));
+        }
+    }
+
+    alignas(16) FLType sum[16];
+
+    for (int v = 0; v < 4; ++v)
+    {
+        _mm_store_ps(sum + v * 4, p[v]);
+    }
+
+    return Wiener_Reduce(sum) + Wiener_Residue(src, ref, width, size, sigma_sqr);
+}
+#endif
+
+
+#if defined(SIMD_HAS_AVX)
+// The coefficient, the shrinkage and the accumulation are fused by FMA, except for the exact mode
+template < WienerMode mode >
+SIMD_TARGET_AVX2
+static inline __m256 Wiener_Coef_AVX2(const __m256 &r, const __m256 &sgm_sqr)
+{
+    const __m256 r2 = _mm256_mul_ps(r, r);
+
+    if constexpr (mode == WienerMode::Exact)
+    {
+        return _mm256_div_ps(r2, _mm256_add_ps(r2, sgm_sqr));
+    }
+    else
+    {
+        const __m256 den = _mm256_fmadd_ps(r, r, sgm_sqr);
+        __m256 x = _mm256_rcp_ps(den);
+
+        if constexpr (mode == WienerMode::Refined)
+        {
+            x = _mm256_mul_ps(x, _mm256_fnmadd_ps(den, x, _mm256_set1_ps(2)));
+        }
+
+        return _mm256_mul_ps(r2, x);
+    }
+}
+
+
+template < WienerMode mode >
+SIMD_TARGET_AVX2
+static FLType Wiener_AVX2(FLType *src, const FLType *ref, PCType size, FLType sigma_sqr)
+{
+    const PCType width = size - size % 16;
+    const __m256 sgm_sqr = _mm256_set1_ps(sigma_sqr);
+    __m256 p[2] = { _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+    for (PCType c = 0; c < width; c += 16)
+    {
+        for (int v = 0; v < 2; ++v)
+        {
+            const __m256 w = Wiener_Coef_AVX2<mode>(_mm256_loadu_ps(ref + c + v * 8), sgm_sqr);
+            _mm256_storeu_ps(src + c + v * 8, _mm256_mul_ps(_mm256_loadu_ps(src + c + v * 8), w));
+
+            if constexpr (mode == WienerMode::Exact) p[v] = _mm256_add_ps(p[v], _mm256_mul_ps(w, w));
+            else p[v] = _mm256_fmadd_ps(w, w, p[v]);
+        }
+    }
+
+    // Wiener_Reduce and Wiener_Residue are built for the baseline instruction set,
+    // thus the upper halves are cleared before calling them, which the compiler does not do here
+    alignas(32) FLType sum[16];
+    _mm256_store_ps(sum, p[0]);
+    _mm256_store_ps(sum + 8, p[1]);
+    _mm256_zeroupper();
+
+    return Wiener_Reduce(sum) + Wiener_Residue(src, ref, width, size, sigma_sqr);
+}
+
+
+SIMD_AVX512_WARNINGS_BEGIN
+
+template < WienerMode mode >
+SIMD_TARGET_AVX512
+static inline __m512 Wiener_Coef_AVX512(const __m512 &r, const __m512 &sgm_sqr)
+{
+    const __m512 r2 = _mm512_mul_ps(r, r);
+
+    if constexpr (mode == WienerMode::Exact)
+    {
+        return _mm512_div_ps(r2, _mm512_add_ps(r2, sgm_sqr));
+    }
+    else
+    {
+        const __m512 den = _mm512_fmadd_ps(r, r, sgm_sqr);
+        __m512 x = _mm512_rcp14_ps(den);
+
+        if constexpr (mode == WienerMode::Refined)
+        {
+            x = _mm512_mul_ps(x, _mm512_fnmadd_ps(den, x, _mm512_set1_ps(2)));
+        }
+
+        return _mm512_mul_ps(r2, x);
+    }
+}
+
+
+template < WienerMode mode >
+SIMD_TARGET_AVX512
+static FLType Wiener_AVX512(FLType *src, const FLType *ref, PCType size, FLType sigma_sqr)
+{
+    const PCType width = size - size % 16;
+    const __m512 sgm_sqr = _mm512_set1_ps(sigma_sqr);
+    __m512 p = _mm512_setzero_ps();
+
+    for (PCType c = 0; c < width; c += 16)
+    {
+        const __m512 w = Wiener_Coef_AVX512<mode>(_mm512_loadu_ps(ref + c), sgm_sqr);
+        _mm512_storeu_ps(src + c, _mm512_mul_ps(_mm512_loadu_ps(src + c), w));
+
+        if constexpr (mode == WienerMode::Exact) p = _mm512_add_ps(p, _mm512_mul_ps(w, w));
+        else p = _mm512_fmadd_ps(w, w, p);
+    }
+
+    alignas(64) FLType sum[16];
+    _mm512_store_ps(sum, p);
+    _mm256_zeroupper();
+
+    return Wiener_Reduce(sum) + Wiener_Residue(src, ref, width, size, sigma_sqr);
+}
+
+SIMD_AVX512_WARNINGS_END
+#endif
+
+
+template < WienerMode mode >
+static WienerFunc Wiener_Level(SIMDLevel level)
+{
+    switch (level)
+    {
+#if defined(SIMD_HAS_AVX)
+    case SIMDLevel::AVX512:
+        return Wiener_AVX512<mode>;
+    case SIMDLevel::AVX2:
+        return Wiener_AVX2<mode>;
+#endif
+#if defined(__SSE2__)
+    case SIMDLevel::SSE2:
+        return Wiener_SSE2<mode>;
+#endif
+    default:
+        return Wiener_C;
+    }
+}
+
+
+WienerFunc Wiener_Func(SIMDLevel level, WienerMode mode)
+{
+    switch (mode)
+    {
+    case WienerMode::Refined:
+        return Wiener_Level<WienerMode::Refined>(level);
+    case WienerMode::Exact:
+        return Wiener_Level<WienerMode::Exact>(level);
+    default:
+        return Wiener_Level<WienerMode::Fast>(level);
+    }
+}
@@ -0,0 +1,254 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+
+#include <algorithm>
+#include <new>
+#include "Helper.h"
+#include "ThreadPool.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class ThreadPool
+
+
+std::mutex ThreadPool::shared_mutex_;
+std::weak_ptr<ThreadPool> ThreadPool::shared_;
+
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+
+    ready_.notify_all();
+
+    for (auto &e : workers_)
+    {
+        e.join();
+    }
+}
+
+
+std::shared_ptr<ThreadPool> ThreadPool::Shared(int &threads)
+{
+    threads = Min(threads, Max(static_cast<int>(std::thread::hardware_concurrency()), 1));
+
+    if (threads <= 1)
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(shared_mutex_);
+
+    auto pool = shared_.lock();
+
+    if (!pool)
+    {
+        pool = std::make_shared<ThreadPool>();
+        shared_ = pool;
+    }
+
+    std::lock_guard<std::mutex> pool_lock(pool->mutex_);
+
+    while (static_cast<int>(pool->workers_.size()) < threads - 1)
+    {
+        pool->workers_.emplace_back(&ThreadPool::Work, pool.get());
+    }
+
+    return pool;
+}
+
+
+void ThreadPool::Run(size_t count, const std::function<void(size_t)> &func)
+{
+    Batch batch = { &func, count, nullptr };
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    Reserve(tasks_, tasks_.size() + count);
+
+    for (size_t k = 0; k < count; ++k)
+    {
+        tasks_.push_back({ &batch, k });
+    }
+
+    ready_.notify_all();
+
+    // Help with the tasks of this call still queued, then wait for the ones still running on the workers
+    while (batch.pending > 0)
+    {
+        auto iter = std::find_if(tasks_.begin(), tasks_.end(), [&](const Task &e) { return e.batch == &batch; });
+
+        if (iter == tasks_.end())
+        {
+            done_.wait(lock);
+            continue;
+        }
+
+        const Task task = *iter;
+        tasks_.erase(iter);
+
+        Execute(task, lock);
+    }
+
+    if (batch.error) std::rethrow_exception(batch.error);
+}
+
+
+void ThreadPool::Work()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (true)
+    {
+        ready_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+
+        if (tasks_.empty())
+        {
+            return;
+        }
+
+        const Task task = tasks_.front();
+        tasks_.erase(tasks_.begin());
+
+        Execute(task, lock);
+    }
+}
+
+
+void ThreadPool::Execute(const Task &task, std::unique_lock<std::mutex> &lock)
+{
+    std::exception_ptr e;
+
+    lock.unlock();
+
+    try
+    {
+        (*task.batch->func)(task.index);
+    }
+    catch (...)
+    {
+        e = std::current_exception();
+    }
+
+    lock.lock();
+
+    // The batch may be destroyed by its call of Run as soon as the lock is released
+    Batch &batch = *task.batch;
+    if (e && !batch.error) batch.error = e;
+    if (--batch.pending == 0) done_.notify_all();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class WorkStealing
+
+
+WorkStealing::WorkStealing(size_t count, size_t threads, PlaneArena::Frame &scratch)
+    : ranges_(scratch.Get<Range>(threads)), threads_(threads), finished_(scratch.Get<bool>(count)), count_(count)
+{
+    for (size_t t = 0; t < threads; ++t)
+    {
+        new (ranges_ + t) Range;
+        ranges_[t].begin = count * t / threads;
+        ranges_[t].end = count * (t + 1) / threads;
+    }
+
+    std::fill_n(finished_, count, false);
+}
+
+
+WorkStealing::~WorkStealing()
+{
+    for (size_t t = 0; t < threads_; ++t)
+    {
+        ranges_[t].~Range();
+    }
+}
+
+
+bool WorkStealing::Next(size_t thread, size_t &chunk)
+{
+    {
+        Range &own = ranges_[thread];
+        std::lock_guard<std::mutex> lock(own.mutex);
+
+        if (own.begin < own.end)
+        {
+            chunk = own.begin++;
+            return true;
+        }
+    }
+
+    while (true)
+    {
+        // The victim is chosen without locking, and checked again under its lock
+        size_t victim = threads_;
+        size_t most = 0;
+
+        for (size_t t = 0; t < threads_; ++t)
+        {
+            // end is read first, as begin never passes it
+            const size_t end = ranges_[t].end;
+            const size_t left = end - ranges_[t].begin;
+
+            if (t != thread && left > most)
+            {
+                victim = t;
+                most = left;
+            }
+        }
+
+        if (victim == threads_)
+        {
+            return false;
+        }
+
+        Range &range = ranges_[victim];
+        std::lock_guard<std::mutex> lock(range.mutex);
+
+        if (range.begin < range.end)
+        {
+            chunk = --range.end;
+            return true;
+        }
+    }
+}
+
+
+void WorkStealing::Finish(size_t chunk, const std::function<void(size_t)> &merge)
+{
+    std::lock_guard<std::mutex> lock(merge_mutex_);
+
+    finished_[chunk] = true;
+
+    while (merged_ < count_ && finished_[merged_])
+    {
+        merge(merged_++);
+    }
+}
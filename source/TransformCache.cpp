@@ -0,0 +1,99 @@
+/*
+* BM3D denoising filter - VapourSynth plugin
+* Copyright (c) 2015-2016 mawen1250
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+
+#include "TransformCache.h"
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Functions of class TransformCache
+
+
+TransformCache::TransformCache(const FLType *src, PCType height, PCType width, PCType stride,
+    PCType block_size, PCType rows, const BM3D_FilterData &filter, PlaneArena::Frame &scratch)
+    : plane_(src), src_(&plane_), stride_(stride), block_size_(block_size),
+    pos_height_(height - block_size + 1), pos_width_(width - block_size + 1),
+    rows_(Min(rows, pos_height_)), slot_size_(SlotSize(block_size)), filter_(filter)
+{
+    Allocate(static_cast<size_t>(rows_) * pos_width_, scratch);
+}
+
+
+TransformCache::TransformCache(const FLType *const *src, int frames, PCType height, PCType width, PCType stride,
+    PCType block_size, size_t slots, const BM3D_FilterData &filter, PlaneArena::Frame &scratch)
+    : src_(src), stride_(stride), block_size_(block_size),
+    pos_height_(height - block_size + 1), pos_width_(width - block_size + 1), slot_size_(SlotSize(block_size)), filter_(filter)
+{
+    const size_t blocks = static_cast<size_t>(frames) * pos_height_ * pos_width_;
+    int bits = 1;
+
+    while (bits < 48 && (size_t(1) << bits) < Min(slots, blocks))
+    {
+        ++bits;
+    }
+
+    shift_ = 64 - bits;
+    Allocate(size_t(1) << bits, scratch);
+}
+
+
+void TransformCache::Allocate(size_t slots, PlaneArena::Frame &scratch)
+{
+    data_ = scratch.Get(slots * slot_size_);
+    tag_ = scratch.Get<size_t>(slots);
+    std::fill_n(tag_, slots, size_t(Empty));
+}
+
+
+size_t TransformCache::SlotSize(PCType block_size)
+{
+    return (static_cast<size_t>(block_size) * block_size + 15) / 16 * 16;
+}
+
+
+void TransformCache::CopyTo(FLType *dst, const PosType &pos, int frame)
+{
+    const size_t key = (static_cast<size_t>(frame) * pos_height_ + pos.y) * pos_width_ + pos.x;
+
+    // Fibonacci hashing spreads the neighbouring blocks over the slots
+    const size_t slot = rows_ > 0 ? static_cast<size_t>(pos.y % rows_) * pos_width_ + pos.x
+        : static_cast<size_t>((static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> shift_);
+    FLType *slotp = data_ + slot * slot_size_;
+
+    if (tag_[slot] != key)
+    {
+        const FLType *srcp = src_[frame] + pos.y * stride_ + pos.x;
+        FLType *dstp = slotp;
+
+        for (PCType y = 0; y < block_size_; ++y, srcp += stride_, dstp += block_size_)
+        {
+            memcpy(dstp, srcp, sizeof(FLType) * block_size_);
+        }
+
+        filter_.Forward2D(slotp);
+        tag_[slot] = key;
+    }
+
+    memcpy(dst, slotp, sizeof(FLType) * block_size_ * block_size_);
+}
@@ -188,6 +188,9 @@ void VAggregate_Process::process_core_gray()
 
     std::vector<const FLType *> ResNumY, ResDenY;
 
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
+
     // Get write pointer
     auto dstY = reinterpret_cast<_Dt1 *>(vsapi->getWritePtr(dst, 0));
 
@@ -201,17 +204,14 @@ void VAggregate_Process::process_core_gray()
         ResDenY.push_back(srcY + src_pcount[0] * (o * 2 + 1));
     }
 
-    // Allocate memory for floating point Y data
-    AlignedMalloc(dstYd, dst_pcount[0]);
+    // Take memory for floating point Y data from the arena
+    dstYd = planes.Get(dst_pcount[0]);
 
     // Execute kernel
     Kernel(dstYd, ResNumY, ResDenY);
 
     // Convert dst from floating point Y data to integer Y data
     Float2Int(dstY, dstYd, dst_height[0], dst_width[0], dst_stride[0], dst_stride[0], false, full, !isFloat(_Dt1));
-
-    // Free memory for floating point YUV data
-    AlignedFree(dstYd);
 }
 
 template <>
@@ -246,6 +246,9 @@ void VAggregate_Process::process_core_yuv()
     std::vector<const FLType *> ResNumU, ResDenU;
     std::vector<const FLType *> ResNumV, ResDenV;
 
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
+
     // Get write pointer
     auto dstY = reinterpret_cast<_Dt1 *>(vsapi->getWritePtr(dst, 0));
     auto dstU = reinterpret_cast<_Dt1 *>(vsapi->getWritePtr(dst, 1));
@@ -268,10 +271,10 @@ void VAggregate_Process::process_core_yuv()
         ResDenV.push_back(srcV + src_pcount[2] * (o * 2 + 1));
     }
 
-    // Allocate memory for floating point YUV data
-    if (process_plane[0]) AlignedMalloc(dstYd, dst_pcount[0]);
-    if (process_plane[1]) AlignedMalloc(dstUd, dst_pcount[1]);
-    if (process_plane[2]) AlignedMalloc(dstVd, dst_pcount[2]);
+    // Take memory for floating point YUV data from the arena
+    if (process_plane[0]) dstYd = planes.Get(dst_pcount[0]);
+    if (process_plane[1]) dstUd = planes.Get(dst_pcount[1]);
+    if (process_plane[2]) dstVd = planes.Get(dst_pcount[2]);
 
     // Execute kernel
     Kernel(dstYd, dstUd, dstVd, ResNumY, ResDenY, ResNumU, ResDenU, ResNumV, ResDenV);
@@ -280,11 +283,6 @@ void VAggregate_Process::process_core_yuv()
     if (process_plane[0]) Float2Int(dstY, dstYd, dst_height[0], dst_width[0], dst_stride[0], dst_stride[0], false, full, !isFloat(_Dt1));
     if (process_plane[1]) Float2Int(dstU, dstUd, dst_height[1], dst_width[1], dst_stride[1], dst_stride[1], true, full, !isFloat(_Dt1));
     if (process_plane[2]) Float2Int(dstV, dstVd, dst_height[2], dst_width[2], dst_stride[2], dst_stride[2], true, full, !isFloat(_Dt1));
-
-    // Free memory for floating point YUV data
-    if (process_plane[0]) AlignedFree(dstYd);
-    if (process_plane[1]) AlignedFree(dstUd);
-    if (process_plane[2]) AlignedFree(dstVd);
 }
 
 template <>
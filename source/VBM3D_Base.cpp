@@ -22,6 +22,10 @@
 */
 
 
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <type_traits>
 #include "VBM3D_Base.h"
 
 
@@ -346,6 +350,99 @@ int VBM3D_Data_Base::arguments_process(const VSMap *in, VSMap *out)
             throw std::string("Unsupported \"matrix\" specified");
         }
 
+        // opt - int
+        int opt = vsapi->mapGetIntSaturated(in, "opt", 0, &error);
+
+        if (error)
+        {
+            opt = 0;
+        }
+        else if (opt < 0 || opt > 3)
+        {
+            throw std::string("Invalid \"opt\" assigned, must be an integer in [0, 3]");
+        }
+
+        simd = SIMDLevel_Select(opt);
+
+        // bm_mode - int
+        bm_mode = vsapi->mapGetIntSaturated(in, "bm_mode", 0, &error);
+
+        if (error)
+        {
+            bm_mode = 0;
+        }
+        else if (bm_mode < 0 || bm_mode > 1)
+        {
+            throw std::string("Invalid \"bm_mode\" assigned, must be an integer in [0, 1]");
+        }
+
+        // group_transform - int
+        group_transform = vsapi->mapGetIntSaturated(in, "group_transform", 0, &error);
+
+        if (error)
+        {
+            group_transform = 0;
+        }
+        else if (group_transform < 0 || group_transform > 2)
+        {
+            throw std::string("Invalid \"group_transform\" assigned, must be an integer in [0, 2]");
+        }
+
+        // dct_cache - int
+        dct_cache = vsapi->mapGetIntSaturated(in, "dct_cache", 0, &error);
+
+        if (error)
+        {
+            dct_cache = 0;
+        }
+        else if (dct_cache < 0 || dct_cache > 1)
+        {
+            throw std::string("Invalid \"dct_cache\" assigned, must be an integer in [0, 1]");
+        }
+
+        // wisdom - data
+        auto wisdom_file = vsapi->mapGetData(in, "wisdom", 0, &error);
+
+        if (error)
+        {
+            const char *env = std::getenv("BM3D_WISDOM");
+            wisdom = env ? env : "";
+        }
+        else
+        {
+            wisdom = wisdom_file;
+        }
+
+        // plan_flags - int
+        plan_flags = vsapi->mapGetIntSaturated(in, "plan_flags", 0, &error);
+
+        if (error)
+        {
+            plan_flags = 2;
+        }
+        else if (plan_flags < 0 || plan_flags > 2)
+        {
+            throw std::string("Invalid \"plan_flags\" assigned, must be an integer in [0, 2]");
+        }
+
+        // threads - int
+        threads = vsapi->mapGetIntSaturated(in, "threads", 0, &error);
+
+        if (error)
+        {
+            threads = 1;
+        }
+        else if (threads < 0)
+        {
+            throw std::string("Invalid \"threads\" assigned, must be a non-negative integer");
+        }
+        else if (threads == 0)
+        {
+            threads = Max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        }
+
+        pool = ThreadPool::Shared(threads);
+
         // process
         for (int i = 0; i < VSMaxPlaneCount; i++)
         {
@@ -393,13 +490,19 @@ void VBM3D_Data_Base::init_filter_data()
 
     para.thMSE *= normY;
 
+    // Plans measured by the previous processes are loaded from the wisdom file
+    if (!wisdom.empty()) PlanCache::ImportWisdom(wisdom);
+
+    const unsigned flags = plan_flags == 0 ? FFTW_ESTIMATE : plan_flags == 1 ? FFTW_MEASURE : FFTW_PATIENT;
+
     // Initialize BM3D data - FFTW plans, unnormalized transform amplification factor, hard threshold table, etc.
+    // The ones depending on the group size are only built when a group of the size is filtered
     if (process[0]) f[0] = BM3D_FilterData(wiener, para.sigma[0] / double(255) * normY,
-        para.GroupSize, para.BlockSize, para.lambda);
+        para.GroupSize, para.BlockSize, para.lambda, group_transform, simd, dct_cache != 0, flags);
     if (process[1]) f[1] = BM3D_FilterData(wiener, para.sigma[1] / double(255) * normU,
-        para.GroupSize, para.BlockSize, para.lambda);
+        para.GroupSize, para.BlockSize, para.lambda, group_transform, simd, dct_cache != 0, flags);
     if (process[2]) f[2] = BM3D_FilterData(wiener, para.sigma[2] / double(255) * normV,
-        para.GroupSize, para.BlockSize, para.lambda);
+        para.GroupSize, para.BlockSize, para.lambda, group_transform, simd, dct_cache != 0, flags);
 }
 
 
@@ -407,53 +510,139 @@ void VBM3D_Data_Base::init_filter_data()
 // Functions of class VBM3D_Process_Base
 
 
-void VBM3D_Process_Base::Kernel(const std::vector<FLType *> &dst,
-    const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref) const
+VBM3D_Process_Base::Workspace &VBM3D_Process_Base::Local()
 {
-    std::vector<FLType *> ResNum(frames), ResDen(frames);
+    thread_local Workspace ws;
+    return ws;
+}
+
 
-    for (int f = 0; f < frames; ++f)
+VBM3D_Process_Base::FrameLists &VBM3D_Process_Base::FrameLists::Local(int frames)
+{
+    thread_local FrameLists lists;
+    const size_t count = static_cast<size_t>(frames);
+
+    lists.src.clear();
+    lists.ref.clear();
+    lists.ref_int8.clear();
+    lists.ref_int16.clear();
+    Reserve(lists.src, count);
+    Reserve(lists.ref, count);
+    Reserve(lists.ref_int8, count);
+    Reserve(lists.ref_int16, count);
+
+    for (int plane = 0; plane < 3; ++plane)
     {
-        ResNum[f] = dst[f * 2];
-        ResDen[f] = dst[f * 2 + 1];
+        lists.dst[plane].clear();
+        lists.srcf[plane].clear();
+        lists.reff[plane].clear();
+        Reserve(lists.dst[plane], count * 2);
+        Reserve(lists.srcf[plane], count);
+        Reserve(lists.reff[plane], count);
     }
 
+    return lists;
+}
+
+
+void VBM3D_Process_Base::Kernel(const std::vector<FLType *> &dst,
+    const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref) const
+{
+#ifndef NDEBUG
+    const size_t kernelAllocations = Allocations().Transient();
+#endif
+
+    // The numerator and the denominator of each frame follow each other
     memset(dst[0], 0, sizeof(FLType) * dst_pcount[0] * frames * 2);
 
-    const PCType BlockPosBottom = height - d.para.BlockSize;
     const PCType BlockPosRight = width - d.para.BlockSize;
 
-    for (PCType j = 0;; j += d.para.BlockStep)
+    // The state shared by the workers is taken from the arena of the calling thread
+    PlaneArena::Frame shared;
+
+    const ChunkLayout &layout = Layout();
+    const size_t count = layout.count();
+    const size_t threads = Min(static_cast<size_t>(d.threads), count);
+    WorkStealing scheduler(count, threads, shared);
+
+    // The accumulator of the frames for each chunk
+    std::vector<Accumulator> &acc = Accumulator::Local(0, count);
+
+    for (size_t c = 0; c < count; ++c)
     {
-        // Handle scan of reference block - vertical
-        if (j >= BlockPosBottom + d.para.BlockStep)
-        {
-            break;
-        }
-        else if (j > BlockPosBottom)
-        {
-            j = BlockPosBottom;
-        }
+        acc[c].Reset(dst[0], dst[1], dst_stride[0], dst_pcount[0] * 2);
+    }
+
+    const BlockMoments *const *moments = BlockMomentsMap(ref, shared);
+
+    const auto merge = [&](size_t c)
+    {
+        acc[c].Merge(d.para.BlockSize);
+    };
+
+    const auto worker = [&](size_t t)
+    {
+#ifndef NDEBUG
+        const size_t allocations = Allocations().Transient();
+#endif
+
+        // The buffers of the worker are taken from the arena of its thread, and reused by its following frames
+        PlaneArena::Frame scratch;
+        Workspace &ws = Local();
+
+        HierarchicalSearch *hs = HierarchicalEngine(ws, ref, scratch);
+        std::optional<TransformCache> srcCacheMap, refCacheMap;
+        TransformCache *srcCache = TransformCacheMap(srcCacheMap, src, src_height[0], src_width[0], src_stride[0], 0, scratch);
+        TransformCache *refCache = d.wiener ? TransformCacheMap(refCacheMap, ref, ref_height[0], ref_width[0], ref_stride[0], 0, scratch) : nullptr;
+        size_t c;
+
+        SearchPosMap(ws.searchPos, scratch);
+        Reserve(ws.curPosCode, d.para.PSnum);
+        Reserve(ws.prePosCode, d.para.PSnum);
+
+        // The groups are views over the scratch, the source group followed by the reference group
+        FLType *groups = scratch.Get((d.wiener ? 2 : 1) * d.f[0].GroupStride(d.para.GroupSize));
 
-        for (PCType i = 0;; i += d.para.BlockStep)
+        while (scheduler.Next(t, c))
         {
-            // Handle scan of reference block - horizontal
-            if (i >= BlockPosRight + d.para.BlockStep)
-            {
-                break;
-            }
-            else if (i > BlockPosRight)
+            acc[c].Bound(layout.top[c], layout.bottom[c], layout.deferred[c], d.para.BlockSize);
+
+            for (size_t r = layout.chunks[c]; r < layout.chunks[c + 1]; ++r)
             {
-                i = BlockPosRight;
-            }
+                const PCType j = layout.rows[r];
 
-            // Form a group by block matching between reference block and its spatial-temporal neighborhood in the reference planes
-            Pos3PairCode matchCode = BlockMatching(ref, j, i);
+                for (PCType i = 0;; i += d.para.BlockStep)
+                {
+                    // Handle scan of reference block - horizontal
+                    if (i >= BlockPosRight + d.para.BlockStep)
+                    {
+                        break;
+                    }
+                    else if (i > BlockPosRight)
+                    {
+                        i = BlockPosRight;
+                    }
+
+                    // Form a group by block matching between reference block and its spatial-temporal neighborhood in the reference planes
+                    BlockMatching(ws.matchCode, ws.frameMatch, ws.searchPos, ws.curPosCode, ws.prePosCode, ref, moments, j, i, hs);
+
+                    // Get the filtered result through collaborative filtering and aggregation of matched blocks
+                    CollaborativeFilter(0, acc[c], src, ref, srcCache, refCache, groups, ws.matchCode.get());
+                }
+            }
 
-            // Get the filtered result through collaborative filtering and aggregation of matched blocks
-            CollaborativeFilter(0, ResNum, ResDen, src, ref, matchCode);
+            scheduler.Finish(c, std::cref(merge));
         }
-    }
+
+        // Only the storage kept for the following frames may grow
+        assert(Allocations().Transient() == allocations);
+    };
+
+    if (threads > 1) d.pool->Run(threads, std::cref(worker));
+    else worker(0);
+
+    // A frame in steady state doesn't allocate
+    assert(Allocations().Transient() == kernelAllocations);
 }
 
 
@@ -461,45 +650,146 @@ void VBM3D_Process_Base::Kernel(const std::vector<FLType *> &dstY, const std::ve
     const std::vector<const FLType *> &srcY, const std::vector<const FLType *> &srcU, const std::vector<const FLType *> &srcV,
     const std::vector<const FLType *> &refY, const std::vector<const FLType *> &refU, const std::vector<const FLType *> &refV) const
 {
-    std::vector<FLType *> ResNumY(frames), ResDenY(frames);
-    std::vector<FLType *> ResNumU(frames), ResDenU(frames);
-    std::vector<FLType *> ResNumV(frames), ResDenV(frames);
+#ifndef NDEBUG
+    const size_t kernelAllocations = Allocations().Transient();
+#endif
+
+    const std::vector<FLType *> *dsts[3] = { &dstY, &dstU, &dstV };
 
-    if (d.process[0])
+    // The numerator and the denominator of each frame follow each other
+    for (int plane = 0; plane < 3; ++plane)
     {
-        for (int f = 0; f < frames; ++f)
+        if (d.process[plane]) memset((*dsts[plane])[0], 0, sizeof(FLType) * dst_pcount[plane] * frames * 2);
+    }
+
+    const PCType BlockPosRight = width - d.para.BlockSize;
+
+    // The state shared by the workers is taken from the arena of the calling thread
+    PlaneArena::Frame shared;
+
+    const ChunkLayout &layout = Layout();
+    const size_t count = layout.count();
+    const size_t threads = Min(static_cast<size_t>(d.threads), count);
+    WorkStealing scheduler(count, threads, shared);
+
+    // The accumulator of the frames of each plane for each chunk
+    std::vector<Accumulator> *acc[3] = {};
+
+    for (int plane = 0; plane < 3; ++plane)
+    {
+        if (!d.process[plane]) continue;
+
+        acc[plane] = &Accumulator::Local(plane, count);
+
+        for (size_t c = 0; c < count; ++c)
         {
-            ResNumY[f] = dstY[f * 2];
-            ResDenY[f] = dstY[f * 2 + 1];
+            (*acc[plane])[c].Reset((*dsts[plane])[0], (*dsts[plane])[1], dst_stride[plane], dst_pcount[plane] * 2);
         }
-
-        memset(dstY[0], 0, sizeof(FLType) * dst_pcount[0] * frames * 2);
     }
 
-    if (d.process[1])
+    const BlockMoments *const *moments = BlockMomentsMap(refY, shared);
+    const std::vector<const FLType *> *srcs[3] = { &srcY, &srcU, &srcV };
+    const std::vector<const FLType *> *refs[3] = { &refY, &refU, &refV };
+
+    const auto merge = [&](size_t c)
     {
-        for (int f = 0; f < frames; ++f)
+        for (int plane = 0; plane < 3; ++plane)
         {
-            ResNumU[f] = dstU[f * 2];
-            ResDenU[f] = dstU[f * 2 + 1];
+            if (d.process[plane]) (*acc[plane])[c].Merge(d.para.BlockSize);
         }
+    };
 
-        memset(dstU[0], 0, sizeof(FLType) * dst_pcount[1] * frames * 2);
-    }
-
-    if (d.process[2])
+    const auto worker = [&](size_t t)
     {
-        for (int f = 0; f < frames; ++f)
+#ifndef NDEBUG
+        const size_t allocations = Allocations().Transient();
+#endif
+
+        // The buffers of the worker are taken from the arena of its thread, and reused by its following frames
+        PlaneArena::Frame scratch;
+        Workspace &ws = Local();
+
+        HierarchicalSearch *hs = HierarchicalEngine(ws, refY, scratch);
+        std::optional<TransformCache> srcCacheMap[3], refCacheMap[3];
+        TransformCache *srcCache[3] = {}, *refCache[3] = {};
+
+        for (int plane = 0; plane < 3; ++plane)
         {
-            ResNumV[f] = dstV[f * 2];
-            ResDenV[f] = dstV[f * 2 + 1];
+            if (d.process[plane])
+            {
+                srcCache[plane] = TransformCacheMap(srcCacheMap[plane], *srcs[plane],
+                    src_height[plane], src_width[plane], src_stride[plane], plane, scratch);
+            }
+            if (d.process[plane] && d.wiener)
+            {
+                refCache[plane] = TransformCacheMap(refCacheMap[plane], *refs[plane],
+                    ref_height[plane], ref_width[plane], ref_stride[plane], plane, scratch);
+            }
         }
 
-        memset(dstV[0], 0, sizeof(FLType) * dst_pcount[2] * frames * 2);
-    }
+        size_t c;
+
+        SearchPosMap(ws.searchPos, scratch);
+        Reserve(ws.curPosCode, d.para.PSnum);
+        Reserve(ws.prePosCode, d.para.PSnum);
+
+        // The groups are views over the scratch, shared by the planes as they're filtered in turn
+        FLType *groups = scratch.Get((d.wiener ? 2 : 1) * d.f[0].GroupStride(d.para.GroupSize));
+
+        while (scheduler.Next(t, c))
+        {
+            for (int plane = 0; plane < 3; ++plane)
+            {
+                if (d.process[plane]) (*acc[plane])[c].Bound(layout.top[c], layout.bottom[c], layout.deferred[c], d.para.BlockSize);
+            }
+
+            for (size_t r = layout.chunks[c]; r < layout.chunks[c + 1]; ++r)
+            {
+                const PCType j = layout.rows[r];
+
+                for (PCType i = 0;; i += d.para.BlockStep)
+                {
+                    // Handle scan of reference block - horizontal
+                    if (i >= BlockPosRight + d.para.BlockStep)
+                    {
+                        break;
+                    }
+                    else if (i > BlockPosRight)
+                    {
+                        i = BlockPosRight;
+                    }
+
+                    // Form a group by block matching between reference block and its spatial-temporal neighborhood in the reference planes
+                    BlockMatching(ws.matchCode, ws.frameMatch, ws.searchPos, ws.curPosCode, ws.prePosCode, refY, moments, j, i, hs);
+
+                    // Get the filtered result through collaborative filtering and aggregation of matched blocks
+                    for (int plane = 0; plane < 3; ++plane)
+                    {
+                        if (d.process[plane]) CollaborativeFilter(plane, (*acc[plane])[c], *srcs[plane], *refs[plane],
+                            srcCache[plane], refCache[plane], groups, ws.matchCode.get());
+                    }
+                }
+            }
+
+            scheduler.Finish(c, std::cref(merge));
+        }
+
+        // Only the storage kept for the following frames may grow
+        assert(Allocations().Transient() == allocations);
+    };
+
+    if (threads > 1) d.pool->Run(threads, std::cref(worker));
+    else worker(0);
+
+    // A frame in steady state doesn't allocate
+    assert(Allocations().Transient() == kernelAllocations);
+}
+
 
+std::vector<PCType> VBM3D_Process_Base::ReferenceRows() const
+{
     const PCType BlockPosBottom = height - d.para.BlockSize;
-    const PCType BlockPosRight = width - d.para.BlockSize;
+    std::vector<PCType> rows;
 
     for (PCType j = 0;; j += d.para.BlockStep)
     {
@@ -513,156 +803,306 @@ void VBM3D_Process_Base::Kernel(const std::vector<FLType *> &dstY, const std::ve
             j = BlockPosBottom;
         }
 
-        for (PCType i = 0;; i += d.para.BlockStep)
-        {
-            // Handle scan of reference block - horizontal
-            if (i >= BlockPosRight + d.para.BlockStep)
-            {
-                break;
-            }
-            else if (i > BlockPosRight)
-            {
-                i = BlockPosRight;
-            }
+        rows.push_back(j);
+    }
 
-            // Form a group by block matching between reference block and its spatial-temporal neighborhood in the reference planes
-            Pos3PairCode matchCode = BlockMatching(refY, j, i);
+    return rows;
+}
 
-            // Get the filtered result through collaborative filtering and aggregation of matched blocks
-            if (d.process[0]) CollaborativeFilter(0, ResNumY, ResDenY, srcY, refY, matchCode);
-            if (d.process[1]) CollaborativeFilter(1, ResNumU, ResDenU, srcU, refU, matchCode);
-            if (d.process[2]) CollaborativeFilter(2, ResNumV, ResDenV, srcV, refV, matchCode);
+
+const ChunkLayout &VBM3D_Process_Base::Layout() const
+{
+    // The layout only depends on the format and the parameters, and it's kept by the filter
+    std::call_once(d.layout_once, [&]()
+    {
+        const RetainedAllocations retained;
+
+        d.layout.rows = ReferenceRows();
+        Accumulator::Chunks(d.layout, d.pool ? d.threads : 1, MatchReach(),
+            height, width, d.para.BlockSize, d.para.BlockStep, d.para.GroupSize);
+    });
+
+    return d.layout;
+}
+
+
+PCType VBM3D_Process_Base::MatchReach() const
+{
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0)
+    {
+        return 0;
+    }
+
+    // The coarse matches are rounded by 2 pixels and refined within +-BMstep
+    const PCType reach = d.bm_mode == 1 ? d.para.BMrange + d.para.BMstep + 1 : d.para.BMrange;
+
+    // The predictive search moves by up to PSrange from the matches in each further frame
+    return reach + d.para.radius * d.para.PSrange;
+}
+
+
+HierarchicalSearch *VBM3D_Process_Base::HierarchicalEngine(Workspace &ws, const std::vector<const FLType *> &ref, PlaneArena::Frame &scratch) const
+{
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0 || d.bm_mode != 1
+        || !HierarchicalSearch::Applicable(ref_height[0], ref_width[0], d.para.BlockSize))
+    {
+        return nullptr;
+    }
+
+    ws.hs.Reset(ref[cur], ref_height[0], ref_width[0], ref_stride[0],
+        d.para.BlockSize, d.para.BMrange, d.para.BMstep, d.para.thMSE, d.simd, scratch);
+
+    return &ws.hs;
+}
+
+
+const BlockMoments *const *VBM3D_Process_Base::BlockMomentsMap(const std::vector<const FLType *> &ref, PlaneArena::Frame &scratch) const
+{
+    // The maps live in the arena, which never runs their destructors
+    static_assert(std::is_trivially_destructible<BlockMoments>::value, "BlockMoments must be trivially destructible");
+
+    const BlockMoments **moments = scratch.Get<const BlockMoments *>(ref.size());
+    std::fill_n(moments, ref.size(), nullptr);
+
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0 || !ref_int8.empty() || !ref_int16.empty())
+    {
+        return moments;
+    }
+
+    BlockMoments *maps = scratch.Get<BlockMoments>(ref.size());
+
+    for (size_t f = 0; f < ref.size(); ++f)
+    {
+        const BlockMoments *map = new (maps + f) BlockMoments(ref[f], ref_height[0], ref_width[0], ref_stride[0],
+            d.para.BlockSize, scratch);
+
+        if (map->Valid())
+        {
+            moments[f] = map;
         }
     }
+
+    return moments;
 }
 
 
-VBM3D_Process_Base::Pos3PairCode VBM3D_Process_Base::BlockMatching(
-    const std::vector<const FLType *> &ref, PCType j, PCType i) const
+TransformCache *VBM3D_Process_Base::TransformCacheMap(std::optional<TransformCache> &cache, const std::vector<const FLType *> &src,
+    PCType height, PCType width, PCType stride, int plane, PlaneArena::Frame &scratch) const
 {
+    if (!d.dct_cache)
+    {
+        return nullptr;
+    }
+
+    // A block matched by a row of reference blocks may be matched again by the rows within MatchReach * 2 below it,
+    // the cache holds the groups of all these rows in any frame
+    const PCType BlockPosBottom = height - d.para.BlockSize;
+    const PCType BlockPosRight = width - d.para.BlockSize;
+    const size_t rows = Min(MatchReach() * 2, BlockPosBottom) / d.para.BlockStep + 2;
+    const size_t columns = BlockPosRight / d.para.BlockStep + 2;
+
+    cache.emplace(src.data(), frames, height, width, stride,
+        d.para.BlockSize, rows * columns * d.para.GroupSize, d.f[plane], scratch);
+
+    return &*cache;
+}
+
+
+void VBM3D_Process_Base::SearchPosMap(SearchPosGrid &searchPos, PlaneArena::Frame &scratch) const
+{
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0)
+    {
+        return;
+    }
+
+    const PCType height = ref_height[0] - d.para.BlockSize + 1;
+    const PCType width = ref_width[0] - d.para.BlockSize + 1;
+
+    searchPos.bind(scratch.Get<uint32_t>(static_cast<size_t>(height) * width), height, width);
+}
+
+
+void VBM3D_Process_Base::BlockMatching(Pos3PairTopK &matchCode, PosPairTopK &frameMatch, SearchPosGrid &searchPos,
+    PosCode &curPosCode, PosCode &prePosCode, const std::vector<const FLType *> &ref, const BlockMoments *const *moments,
+    PCType j, PCType i, HierarchicalSearch *hs) const
+{
+    // The reference block is always the first element in the group
+    matchCode.reset(d.para.GroupSize);
+    matchCode.push_fixed(Pos3Pair(KeyType(0), Pos3Type(cur, j, i)));
+
     // Skip block matching if GroupSize is 1 or thMSE is not positive,
     // and take the reference block as the only element in the group
     if (d.para.GroupSize == 1 || d.para.thMSE <= 0)
     {
-        return Pos3PairCode(1, Pos3Pair(KeyType(0), Pos3Type(cur, j, i)));
+        return;
     }
 
+    // Integer input is matched on its own samples, the threshold is scaled by the value range
+    if (!ref_int8.empty())
+    {
+        BlockMatchingFrames(matchCode, frameMatch, searchPos, curPosCode, prePosCode, ref_int8, static_cast<uint8_t>(ref_int_range), moments, j, i, hs);
+    }
+    else if (!ref_int16.empty())
+    {
+        BlockMatchingFrames(matchCode, frameMatch, searchPos, curPosCode, prePosCode, ref_int16, static_cast<uint16_t>(ref_int_range), moments, j, i, hs);
+    }
+    else
+    {
+        BlockMatchingFrames(matchCode, frameMatch, searchPos, curPosCode, prePosCode, ref, FLType(1), moments, j, i, hs);
+    }
+
+    // The number of matched code is limited to GroupSize, and sorted only when it's exceeded
+    if (matchCode.truncated())
+    {
+        matchCode.sort();
+    }
+}
+
+
+VBM3D_Process_Base::block_group VBM3D_Process_Base::ForwardGroup(int plane, FLType *buffer, const std::vector<const FLType *> &src, PCType stride,
+    TransformCache *cache, const Pos3PairCode &code, PCType GroupSize) const
+{
+    if (!cache)
+    {
+        block_group group(buffer, src, stride, code, GroupSize, d.para.BlockSize, d.para.BlockSize);
+        d.f[plane].Forward(group.data(), GroupSize);
+        return group;
+    }
+
+    // Gather the cached 2D transforms of the matched blocks from their frames, then transform along the group axis
+    block_group group(buffer, code, GroupSize, d.para.BlockSize, d.para.BlockSize);
+    const PCType BlockPixels = d.para.BlockSize * d.para.BlockSize;
+
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        const Pos3Type pos = group.GetPos3(z);
+        cache->CopyTo(group.data() + z * BlockPixels, PosType(pos.y, pos.x), pos.z);
+    }
+
+    d.f[plane].Forward1D(group.data(), GroupSize);
+    return group;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Template functions of class VBM3D_Process_Base
+
+
+template < typename _St1 >
+void VBM3D_Process_Base::BlockMatchingFrames(Pos3PairTopK &matchCode, PosPairTopK &frameMatch, SearchPosGrid &searchPos,
+    PosCode &curPosCode, PosCode &prePosCode, const std::vector<const _St1 *> &ref, _St1 ref_range, const BlockMoments *const *moments,
+    PCType j, PCType i, HierarchicalSearch *hs) const
+{
     int f;
-    Pos3PairCode matchCode;
-    PosPairCode frameMatch;
-    PosCode prePosCode;
 
-    // Get reference block from the reference plane in current frame
-    block_type refBlock(ref[cur], ref_stride[0], d.para.BlockSize, d.para.BlockSize, PosType(j, i));
+    // Matched blocks in each frame are limited to GroupSize and sorted, then appended to the group
+    const auto appendMatch = [&](size_t first)
+    {
+        const auto &code = frameMatch.get();
+
+        for (size_t k = first; k < code.size(); ++k)
+        {
+            matchCode.push(Pos3Pair(code[k].first, Pos3Type(code[k].second, f)));
+        }
+    };
+
+    // Get reference block from the reference plane in current frame, into the storage of the largest block_size
+    alignas(MEMORY_ALIGNMENT) _St1 block[64 * 64];
+    Block<_St1, FLType> refBlock(block, ref[cur], ref_stride[0], d.para.BlockSize, d.para.BlockSize, PosType(j, i));
 
     // Block Matching in current frame
     f = cur;
 
-    frameMatch = refBlock.BlockMatchingMulti(ref[f],
-        ref_height[0], ref_width[0], ref_stride[0], FLType(1),
-        d.para.BMrange, d.para.BMstep, d.para.thMSE, 1, d.para.GroupSize, true);
+    frameMatch.reset(d.para.GroupSize);
+    frameMatch.push_fixed(PosPair(KeyType(0), PosType(j, i)));
 
-    matchCode.resize(matchCode.size() + frameMatch.size());
-    std::transform(frameMatch.begin(), frameMatch.end(),
-        matchCode.end() - frameMatch.size(), [&](const PosPair &x)
+    if (hs)
     {
-        return Pos3Pair(x.first, Pos3Type(x.second, f));
-    });
+        hs->Match(frameMatch, j, i, moments[f]);
+    }
+    else
+    {
+        refBlock.BlockMatchingMulti(frameMatch, ref[f],
+            ref_height[0], ref_width[0], ref_stride[0], ref_range,
+            d.para.BMrange, d.para.BMstep, d.para.thMSE, true, d.simd, moments[f]);
+    }
+
+    frameMatch.sort();
+
+    // The reference block is already in the group
+    appendMatch(1);
 
     PCType nextPosNum = Min(d.para.PSnum, static_cast<PCType>(frameMatch.size()));
-    PosCode curPosCode(nextPosNum);
-    std::transform(frameMatch.begin(), frameMatch.begin() + nextPosNum,
+    curPosCode.resize(nextPosNum);
+    std::transform(frameMatch.get().begin(), frameMatch.get().begin() + nextPosNum,
         curPosCode.begin(), [](const PosPair &x)
     {
         return x.second;
     });
 
-    PosCode curSearchPos = refBlock.GenSearchPos(curPosCode,
-        ref_height[0], ref_width[0], d.para.PSrange, d.para.PSstep);
-
-    // Predictive Search Block Matching in backward frames
-    f = cur - 1;
-
-    for (; f >= 0; --f)
+    // Predictive Search Block Matching in backward and forward frames
+    for (int dir = -1; dir <= 1; dir += 2)
     {
-        if (f == cur - 1)
+        for (f = cur + dir; f >= 0 && f < frames; f += dir)
         {
-            frameMatch = refBlock.BlockMatchingMulti(ref[f], ref_stride[0], FLType(1),
-                curSearchPos, d.para.thMSE, d.para.GroupSize, true);
-        }
-        else
-        {
-            PCType nextPosNum = Min(d.para.PSnum, static_cast<PCType>(frameMatch.size()));
-            prePosCode.resize(nextPosNum);
-            std::transform(frameMatch.begin(), frameMatch.begin() + nextPosNum,
-                prePosCode.begin(), [](const PosPair &x)
+            // The search positions are regenerated in the first frame of each direction, which is cheap with the grid
+            if (f == cur + dir)
             {
-                return x.second;
-            });
+                refBlock.GenSearchPos(searchPos, curPosCode,
+                    ref_height[0], ref_width[0], d.para.PSrange, d.para.PSstep);
+            }
+            else
+            {
+                PCType nextPosNum = Min(d.para.PSnum, static_cast<PCType>(frameMatch.size()));
+                prePosCode.resize(nextPosNum);
+                std::transform(frameMatch.get().begin(), frameMatch.get().begin() + nextPosNum,
+                    prePosCode.begin(), [](const PosPair &x)
+                {
+                    return x.second;
+                });
 
-            PosCode searchPos = refBlock.GenSearchPos(prePosCode,
-                ref_height[0], ref_width[0], d.para.PSrange, d.para.PSstep);
-            frameMatch = refBlock.BlockMatchingMulti(ref[f], ref_stride[0], FLType(1),
-                searchPos, d.para.thMSE, d.para.GroupSize, true);
-        }
+                refBlock.GenSearchPos(searchPos, prePosCode,
+                    ref_height[0], ref_width[0], d.para.PSrange, d.para.PSstep);
+            }
 
-        matchCode.resize(matchCode.size() + frameMatch.size());
-        std::transform(frameMatch.begin(), frameMatch.end(),
-            matchCode.end() - frameMatch.size(), [&](const PosPair &x)
-        {
-            return Pos3Pair(x.first, Pos3Type(x.second, f));
-        });
+            frameMatch.reset(d.para.GroupSize);
+            refBlock.BlockMatchingMulti(frameMatch, ref[f], ref_stride[0], ref_range,
+                searchPos.get(), d.para.thMSE, d.simd, moments[f]);
+
+            frameMatch.sort();
+            appendMatch(0);
+        }
     }
+}
 
-    // Predictive Search Block Matching in forward frames
-    f = cur + 1;
 
-    for (; f < frames; ++f)
+template < typename _Ty >
+bool VBM3D_Process_Base::IntegerMatching(const _Ty *refY)
+{
+    // The hierarchical search only works on the floating point plane
+    if (d.para.GroupSize == 1 || d.para.thMSE <= 0 || d.bm_mode != 0)
     {
-        if (f == cur + 1)
-        {
-            frameMatch = refBlock.BlockMatchingMulti(ref[f], ref_stride[0], FLType(1),
-                curSearchPos, d.para.thMSE, d.para.GroupSize, true);
-        }
-        else
-        {
-            PCType nextPosNum = Min(d.para.PSnum, static_cast<PCType>(frameMatch.size()));
-            prePosCode.resize(nextPosNum);
-            std::transform(frameMatch.begin(), frameMatch.begin() + nextPosNum,
-                prePosCode.begin(), [](const PosPair &x)
-            {
-                return x.second;
-            });
+        return false;
+    }
 
-            PosCode searchPos = refBlock.GenSearchPos(prePosCode,
-                ref_height[0], ref_width[0], d.para.PSrange, d.para.PSstep);
-            frameMatch = refBlock.BlockMatchingMulti(ref[f], ref_stride[0], FLType(1),
-                searchPos, d.para.thMSE, d.para.GroupSize, true);
-        }
+    // The floating point plane is (refY - sFloor) / (sCeil - sFloor)
+    _Ty sFloor, sNeutral, sCeil;
+    GetQuanPara(sFloor, sNeutral, sCeil, fi->bitsPerSample, full, false);
+    ref_int_range = sCeil - sFloor;
 
-        matchCode.resize(matchCode.size() + frameMatch.size());
-        std::transform(frameMatch.begin(), frameMatch.end(),
-            matchCode.end() - frameMatch.size(), [&](const PosPair &x)
-        {
-            return Pos3Pair(x.first, Pos3Type(x.second, f));
-        });
+    if constexpr (std::is_same<_Ty, uint8_t>::value)
+    {
+        ref_int8.push_back(refY);
     }
-
-    // Limit the number of matched code to GroupSize
-    if (d.para.GroupSize > 0 && static_cast<PCType>(matchCode.size()) > d.para.GroupSize)
+    else
     {
-        std::partial_sort(matchCode.begin() + 1, matchCode.begin() + d.para.GroupSize, matchCode.end());
-        matchCode.resize(d.para.GroupSize);
+        ref_int16.push_back(refY);
     }
 
-    return matchCode;
+    return true;
 }
 
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Template functions of class VBM3D_Process_Base
-
-
 template < typename _Ty >
 void VBM3D_Process_Base::process_core()
 {
@@ -687,11 +1127,12 @@ void VBM3D_Process_Base::process_core()
 template < typename _Ty >
 void VBM3D_Process_Base::process_core_gray()
 {
-    std::vector<FLType *> dstYv;
-    std::vector<const FLType *> srcYv;
-    std::vector<const FLType *> refYv;
+    auto &dstYv = lists.dst[0];
+    auto &srcYv = lists.srcf[0];
+    auto &refYv = lists.reff[0];
 
-    std::vector<FLType *> srcYd(frames, nullptr), refYd(frames, nullptr);
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
 
     // Get write pointer
     auto dstY = reinterpret_cast<FLType *>(vsapi->getWritePtr(dst, 0))
@@ -703,39 +1144,38 @@ void VBM3D_Process_Base::process_core_gray()
         auto srcY = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(v_src[i], 0));
         auto refY = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(v_ref[i], 0));
 
-        // Allocate memory for floating point Y data
-        AlignedMalloc(srcYd[i], src_pcount[0]);
-        if (d.rdef) AlignedMalloc(refYd[i], ref_pcount[0]);
-        else refYd[i] = srcYd[i];
+        // Block matching runs on the integer ref plane (the src plane without ref) when it can,
+        // then the basic estimate doesn't need the floating point copy of ref
+        const bool intMatch = IntegerMatching(refY);
+        const bool refConv = d.rdef && (!intMatch || d.wiener);
+
+        // Take memory for floating point Y data from the arena
+        FLType *srcYd = planes.Get(src_pcount[0]);
+        FLType *refYd = nullptr;
+        if (refConv) refYd = planes.Get(ref_pcount[0]);
+        else if (!d.rdef) refYd = srcYd;
 
         // Convert src and ref from integer Y data to floating point Y data
-        Int2Float(srcYd[i], srcY, src_height[0], src_width[0], src_stride[0], src_stride[0], false, full, false);
-        if (d.rdef) Int2Float(refYd[i], refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
+        Int2Float(srcYd, srcY, src_height[0], src_width[0], src_stride[0], src_stride[0], false, full, false);
+        if (refConv) Int2Float(refYd, refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
 
         // Store pointer to floating point Y data into corresponding frame of the vector
         dstYv.push_back(dstY + dst_pcount[0] * (i * 2));
         dstYv.push_back(dstY + dst_pcount[0] * (i * 2 + 1));
-        srcYv.push_back(srcYd[i]);
-        refYv.push_back(refYd[i]);
+        srcYv.push_back(srcYd);
+        refYv.push_back(refYd);
     }
 
     // Execute kernel
     Kernel(dstYv, srcYv, refYv);
-
-    // Free memory for floating point Y data
-    for (int i = 0; i < frames; ++i)
-    {
-        AlignedFree(srcYd[i]);
-        if (d.rdef) AlignedFree(refYd[i]);
-    }
 }
 
 template <>
 void VBM3D_Process_Base::process_core_gray<FLType>()
 {
-    std::vector<FLType *> dstYv;
-    std::vector<const FLType *> srcYv;
-    std::vector<const FLType *> refYv;
+    auto &dstYv = lists.dst[0];
+    auto &srcYv = lists.srcf[0];
+    auto &refYv = lists.reff[0];
 
     // Get write pointer
     auto dstY = reinterpret_cast<FLType *>(vsapi->getWritePtr(dst, 0))
@@ -762,20 +1202,20 @@ void VBM3D_Process_Base::process_core_gray<FLType>()
 template < typename _Ty >
 void VBM3D_Process_Base::process_core_yuv()
 {
-    std::vector<FLType *> dstYv;
-    std::vector<FLType *> dstUv;
-    std::vector<FLType *> dstVv;
+    auto &dstYv = lists.dst[0];
+    auto &dstUv = lists.dst[1];
+    auto &dstVv = lists.dst[2];
 
-    std::vector<const FLType *> srcYv;
-    std::vector<const FLType *> srcUv;
-    std::vector<const FLType *> srcVv;
+    auto &srcYv = lists.srcf[0];
+    auto &srcUv = lists.srcf[1];
+    auto &srcVv = lists.srcf[2];
 
-    std::vector<const FLType *> refYv;
-    std::vector<const FLType *> refUv;
-    std::vector<const FLType *> refVv;
+    auto &refYv = lists.reff[0];
+    auto &refUv = lists.reff[1];
+    auto &refVv = lists.reff[2];
 
-    std::vector<FLType *> srcYd(frames, nullptr), srcUd(frames, nullptr), srcVd(frames, nullptr);
-    std::vector<FLType *> refYd(frames, nullptr), refUd(frames, nullptr), refVd(frames, nullptr);
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
 
     // Get write pointer
     auto dstY = reinterpret_cast<FLType *>(vsapi->getWritePtr(dst, 0))
@@ -796,34 +1236,41 @@ void VBM3D_Process_Base::process_core_yuv()
         auto refU = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(v_ref[i], 1));
         auto refV = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(v_ref[i], 2));
 
-        // Allocate memory for floating point YUV data
-        if (d.process[0] || !d.rdef) AlignedMalloc(srcYd[i], src_pcount[0]);
-        if (d.process[1]) AlignedMalloc(srcUd[i], src_pcount[1]);
-        if (d.process[2]) AlignedMalloc(srcVd[i], src_pcount[2]);
+        // Block matching runs on the integer ref plane (the src plane without ref) when it can,
+        // then only Wiener filtering of Y needs the floating point copy of ref
+        const bool intMatch = IntegerMatching(refY);
+        const bool refConvY = d.rdef && (!intMatch || (d.wiener && d.process[0]));
+
+        // Take memory for floating point YUV data from the arena
+        FLType *srcYd = nullptr, *srcUd = nullptr, *srcVd = nullptr;
+        FLType *refYd = nullptr, *refUd = nullptr, *refVd = nullptr;
+        if (d.process[0] || !d.rdef) srcYd = planes.Get(src_pcount[0]);
+        if (d.process[1]) srcUd = planes.Get(src_pcount[1]);
+        if (d.process[2]) srcVd = planes.Get(src_pcount[2]);
 
         if (d.rdef)
         {
-            AlignedMalloc(refYd[i], ref_pcount[0]);
-            if (d.wiener && d.process[1]) AlignedMalloc(refUd[i], ref_pcount[1]);
-            if (d.wiener && d.process[2]) AlignedMalloc(refVd[i], ref_pcount[2]);
+            if (refConvY) refYd = planes.Get(ref_pcount[0]);
+            if (d.wiener && d.process[1]) refUd = planes.Get(ref_pcount[1]);
+            if (d.wiener && d.process[2]) refVd = planes.Get(ref_pcount[2]);
         }
         else
         {
-            refYd[i] = srcYd[i];
-            refUd[i] = srcUd[i];
-            refVd[i] = srcVd[i];
+            refYd = srcYd;
+            refUd = srcUd;
+            refVd = srcVd;
         }
 
         // Convert src and ref from integer YUV data to floating point YUV data
-        if (d.process[0] || !d.rdef) Int2Float(srcYd[i], srcY, src_height[0], src_width[0], src_stride[0], src_stride[0], false, full, false);
-        if (d.process[1]) Int2Float(srcUd[i], srcU, src_height[1], src_width[1], src_stride[1], src_stride[1], true, full, false);
-        if (d.process[2]) Int2Float(srcVd[i], srcV, src_height[2], src_width[2], src_stride[2], src_stride[2], true, full, false);
+        if (d.process[0] || !d.rdef) Int2Float(srcYd, srcY, src_height[0], src_width[0], src_stride[0], src_stride[0], false, full, false);
+        if (d.process[1]) Int2Float(srcUd, srcU, src_height[1], src_width[1], src_stride[1], src_stride[1], true, full, false);
+        if (d.process[2]) Int2Float(srcVd, srcV, src_height[2], src_width[2], src_stride[2], src_stride[2], true, full, false);
 
         if (d.rdef)
         {
-            Int2Float(refYd[i], refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
-            if (d.wiener && d.process[1]) Int2Float(refUd[i], refU, ref_height[1], ref_width[1], ref_stride[1], ref_stride[1], true, full, false);
-            if (d.wiener && d.process[2]) Int2Float(refVd[i], refV, ref_height[2], ref_width[2], ref_stride[2], ref_stride[2], true, full, false);
+            if (refConvY) Int2Float(refYd, refY, ref_height[0], ref_width[0], ref_stride[0], ref_stride[0], false, full, false);
+            if (d.wiener && d.process[1]) Int2Float(refUd, refU, ref_height[1], ref_width[1], ref_stride[1], ref_stride[1], true, full, false);
+            if (d.wiener && d.process[2]) Int2Float(refVd, refV, ref_height[2], ref_width[2], ref_stride[2], ref_stride[2], true, full, false);
         }
 
         // Store pointer to floating point YUV data into corresponding frame in the vector
@@ -835,48 +1282,33 @@ void VBM3D_Process_Base::process_core_yuv()
         dstUv.push_back(dstU + dst_pcount[1] * (i * 2 + 1));
         dstVv.push_back(dstV + dst_pcount[2] * (i * 2 + 1));
 
-        srcYv.push_back(srcYd[i]);
-        srcUv.push_back(srcUd[i]);
-        srcVv.push_back(srcVd[i]);
+        srcYv.push_back(srcYd);
+        srcUv.push_back(srcUd);
+        srcVv.push_back(srcVd);
 
-        refYv.push_back(refYd[i]);
-        refUv.push_back(refUd[i]);
-        refVv.push_back(refVd[i]);
+        refYv.push_back(refYd);
+        refUv.push_back(refUd);
+        refVv.push_back(refVd);
     }
 
     // Execute kernel
     Kernel(dstYv, dstUv, dstVv, srcYv, srcUv, srcVv, refYv, refUv, refVv);
-
-    // Free memory for floating point YUV data
-    for (int i = 0; i < frames; ++i)
-    {
-        if (d.process[0] || !d.rdef) AlignedFree(srcYd[i]);
-        if (d.process[1]) AlignedFree(srcUd[i]);
-        if (d.process[2]) AlignedFree(srcVd[i]);
-
-        if (d.rdef)
-        {
-            AlignedFree(refYd[i]);
-            if (d.wiener && d.process[1]) AlignedFree(refUd[i]);
-            if (d.wiener && d.process[2]) AlignedFree(refVd[i]);
-        }
-    }
 }
 
 template <>
 void VBM3D_Process_Base::process_core_yuv<FLType>()
 {
-    std::vector<FLType *> dstYv;
-    std::vector<FLType *> dstUv;
-    std::vector<FLType *> dstVv;
+    auto &dstYv = lists.dst[0];
+    auto &dstUv = lists.dst[1];
+    auto &dstVv = lists.dst[2];
 
-    std::vector<const FLType *> srcYv;
-    std::vector<const FLType *> srcUv;
-    std::vector<const FLType *> srcVv;
+    auto &srcYv = lists.srcf[0];
+    auto &srcUv = lists.srcf[1];
+    auto &srcVv = lists.srcf[2];
 
-    std::vector<const FLType *> refYv;
-    std::vector<const FLType *> refUv;
-    std::vector<const FLType *> refVv;
+    auto &refYv = lists.reff[0];
+    auto &refUv = lists.reff[1];
+    auto &refVv = lists.reff[2];
 
     // Get write/read pointer
     auto dstY = reinterpret_cast<FLType *>(vsapi->getWritePtr(dst, 0))
@@ -923,20 +1355,20 @@ void VBM3D_Process_Base::process_core_yuv<FLType>()
 template < typename _Ty >
 void VBM3D_Process_Base::process_core_rgb()
 {
-    std::vector<FLType *> dstYv;
-    std::vector<FLType *> dstUv;
-    std::vector<FLType *> dstVv;
+    auto &dstYv = lists.dst[0];
+    auto &dstUv = lists.dst[1];
+    auto &dstVv = lists.dst[2];
 
-    std::vector<const FLType *> srcYv;
-    std::vector<const FLType *> srcUv;
-    std::vector<const FLType *> srcVv;
+    auto &srcYv = lists.srcf[0];
+    auto &srcUv = lists.srcf[1];
+    auto &srcVv = lists.srcf[2];
 
-    std::vector<const FLType *> refYv;
-    std::vector<const FLType *> refUv;
-    std::vector<const FLType *> refVv;
+    auto &refYv = lists.reff[0];
+    auto &refUv = lists.reff[1];
+    auto &refVv = lists.reff[2];
 
-    std::vector<FLType *> srcYd(frames, nullptr), srcUd(frames, nullptr), srcVd(frames, nullptr);
-    std::vector<FLType *> refYd(frames, nullptr), refUd(frames, nullptr), refVd(frames, nullptr);
+    // Floating point planes of this frame, returned to the arena of the thread at the end
+    PlaneArena::Frame planes;
 
     // Get write pointer
     auto dstY = reinterpret_cast<FLType *>(vsapi->getWritePtr(dst, 0))
@@ -957,26 +1389,27 @@ void VBM3D_Process_Base::process_core_rgb()
         auto refG = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(v_ref[i], 1));
         auto refB = reinterpret_cast<const _Ty *>(vsapi->getReadPtr(v_ref[i], 2));
 
-        // Allocate memory for floating point YUV data
-        AlignedMalloc(srcYd[i], src_pcount[0]);
-        AlignedMalloc(srcUd[i], src_pcount[1]);
-        AlignedMalloc(srcVd[i], src_pcount[2]);
+        // Take memory for floating point YUV data from the arena
+        FLType *srcYd = planes.Get(src_pcount[0]);
+        FLType *srcUd = planes.Get(src_pcount[1]);
+        FLType *srcVd = planes.Get(src_pcount[2]);
+        FLType *refYd = nullptr, *refUd = nullptr, *refVd = nullptr;
 
         if (d.rdef)
         {
-            AlignedMalloc(refYd[i], ref_pcount[0]);
-            if (d.wiener) AlignedMalloc(refUd[i], ref_pcount[1]);
-            if (d.wiener) AlignedMalloc(refVd[i], ref_pcount[2]);
+            refYd = planes.Get(ref_pcount[0]);
+            if (d.wiener) refUd = planes.Get(ref_pcount[1]);
+            if (d.wiener) refVd = planes.Get(ref_pcount[2]);
         }
         else
         {
-            refYd[i] = srcYd[i];
-            refUd[i] = srcUd[i];
-            refVd[i] = srcVd[i];
+            refYd = srcYd;
+            refUd = srcUd;
+            refVd = srcVd;
         }
 
         // Convert src and ref from RGB data to floating point YUV data
-        RGB2FloatYUV(srcYd[i], srcUd[i], srcVd[i], srcR, srcG, srcB,
+        RGB2FloatYUV(srcYd, srcUd, srcVd, srcR, srcG, srcB,
             src_height[0], src_width[0], src_stride[0], src_stride[0],
             ColorMatrix::OPP, true, false);
 
@@ -984,13 +1417,13 @@ void VBM3D_Process_Base::process_core_rgb()
         {
             if (d.wiener)
             {
-                RGB2FloatYUV(refYd[i], refUd[i], refVd[i], refR, refG, refB,
+                RGB2FloatYUV(refYd, refUd, refVd, refR, refG, refB,
                     ref_height[0], ref_width[0], ref_stride[0], ref_stride[0],
                     ColorMatrix::OPP, true, false);
             }
             else
             {
-                RGB2FloatY(refYd[i], refR, refG, refB,
+                RGB2FloatY(refYd, refR, refG, refB,
                     ref_height[0], ref_width[0], ref_stride[0], ref_stride[0],
                     ColorMatrix::OPP, true, false);
             }
@@ -1005,32 +1438,17 @@ void VBM3D_Process_Base::process_core_rgb()
         dstUv.push_back(dstU + dst_pcount[1] * (i * 2 + 1));
         dstVv.push_back(dstV + dst_pcount[2] * (i * 2 + 1));
 
-        srcYv.push_back(srcYd[i]);
-        srcUv.push_back(srcUd[i]);
-        srcVv.push_back(srcVd[i]);
+        srcYv.push_back(srcYd);
+        srcUv.push_back(srcUd);
+        srcVv.push_back(srcVd);
 
-        refYv.push_back(refYd[i]);
-        refUv.push_back(refUd[i]);
-        refVv.push_back(refVd[i]);
+        refYv.push_back(refYd);
+        refUv.push_back(refUd);
+        refVv.push_back(refVd);
     }
 
     // Execute kernel
     Kernel(dstYv, dstUv, dstVv, srcYv, srcUv, srcVv, refYv, refUv, refVv);
-
-    // Free memory for floating point YUV data
-    for (int i = 0; i < frames; ++i)
-    {
-        AlignedFree(srcYd[i]);
-        AlignedFree(srcUd[i]);
-        AlignedFree(srcVd[i]);
-
-        if (d.rdef)
-        {
-            AlignedFree(refYd[i]);
-            if (d.wiener) AlignedFree(refUd[i]);
-            if (d.wiener) AlignedFree(refVd[i]);
-        }
-    }
 }
 
 
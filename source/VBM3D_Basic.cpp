@@ -69,10 +69,10 @@ int VBM3D_Basic_Data::arguments_process(const VSMap *in, VSMap *out)
 // Functions of class VBM3D_Basic_Process
 
 
-void VBM3D_Basic_Process::CollaborativeFilter(int plane,
-    const std::vector<FLType *> &ResNum, const std::vector<FLType *> &ResDen,
+void VBM3D_Basic_Process::CollaborativeFilter(int plane, Accumulator &acc,
     const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref,
-    const Pos3PairCode &code) const
+    TransformCache *srcCache, TransformCache *refCache,
+    FLType *buffer, const Pos3PairCode &code) const
 {
     PCType GroupSize = static_cast<PCType>(code.size());
     // When para.GroupSize > 0, limit GroupSize up to para.GroupSize
@@ -80,19 +80,18 @@ void VBM3D_Basic_Process::CollaborativeFilter(int plane,
     {
         GroupSize = d.para.GroupSize;
     }
+    // Haar and Walsh-Hadamard transforms only take power-of-2 sizes
+    GroupSize = d.f[plane].FitGroupSize(GroupSize);
 
-    // Construct source group guided by matched pos code
-    block_group srcGroup(src, src_stride[plane], code, GroupSize, d.para.BlockSize, d.para.BlockSize);
+    // Construct source group guided by matched pos code and apply forward 3D transform to it
+    block_group srcGroup = ForwardGroup(plane, buffer, src, src_stride[plane], srcCache, code, GroupSize);
 
     // Initialize retianed coefficients of hard threshold filtering
     int retainedCoefs = 0;
 
-    // Apply forward 3D transform to the source group
-    d.f[plane].fp[GroupSize - 1].execute_r2r(srcGroup.data(), srcGroup.data());
-
     // Apply hard-thresholding to the source group
     auto srcp = srcGroup.data();
-    auto thrp = d.f[plane].thrTable[GroupSize - 1].get();
+    auto thrp = d.f[plane].ThrTable(GroupSize);
     const auto upper = srcp + srcGroup.size();
 
 #if defined(__SSE2__)
@@ -133,18 +132,26 @@ void VBM3D_Basic_Process::CollaborativeFilter(int plane,
         }
     }
 
-    // Apply backward 3D transform to the filtered group
-    d.f[plane].bp[GroupSize - 1].execute_r2r(srcGroup.data(), srcGroup.data());
+    // Apply backward 3D transform to the filtered group, flat groups are left with a few coefficients and take a shortcut
+    if (!d.f[plane].BackwardSparse(srcGroup.data(), GroupSize, retainedCoefs))
+    {
+        d.f[plane].Backward(srcGroup.data(), GroupSize);
+    }
 
     // Calculate weight for the filtered group
     // Also include the normalization factor to compensate for the amplification introduced in 3D transform
     FLType denWeight = retainedCoefs < 1 ? 1 : FLType(1) / static_cast<FLType>(retainedCoefs);
-    FLType numWeight = static_cast<FLType>(denWeight / d.f[plane].finalAMP[GroupSize - 1]);
+    FLType numWeight = static_cast<FLType>(denWeight / d.f[plane].FinalAMP(GroupSize));
 
     // Store the weighted filtered group to the numerator part of the basic estimation
     // Store the weight to the denominator part of the basic estimation
-    srcGroup.AddTo(ResNum, dst_stride[plane], numWeight);
-    srcGroup.CountTo(ResDen, dst_stride[plane], denWeight);
+    const PCType BlockPixels = d.para.BlockSize * d.para.BlockSize;
+
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        const Pos3Type pos = srcGroup.GetPos3(z);
+        acc.Add(PosType(pos), srcGroup.data() + z * BlockPixels, d.para.BlockSize, numWeight, denWeight, pos.z);
+    }
 }
 
 
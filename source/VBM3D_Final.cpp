@@ -36,6 +36,30 @@ int VBM3D_Final_Data::arguments_process(const VSMap *in, VSMap *out)
         return 1;
     }
 
+    try
+    {
+        int error;
+
+        // wiener_mode - int
+        int wiener_mode = vsapi->mapGetIntSaturated(in, "wiener_mode", 0, &error);
+
+        if (error)
+        {
+            wiener_mode = 0;
+        }
+        else if (wiener_mode < 0 || wiener_mode > 2)
+        {
+            throw std::string("Invalid \"wiener_mode\" assigned, must be an integer in [0, 2]");
+        }
+
+        wiener_filter = Wiener_Func(simd, static_cast<WienerMode>(wiener_mode));
+    }
+    catch (const std::string &error_msg)
+    {
+        setError(out, error_msg.c_str());
+        return 1;
+    }
+
     // Initialize filter data for empirical Wiener filtering
     init_filter_data();
 
@@ -47,10 +71,10 @@ int VBM3D_Final_Data::arguments_process(const VSMap *in, VSMap *out)
 // Functions of class VBM3D_Final_Process
 
 
-void VBM3D_Final_Process::CollaborativeFilter(int plane,
-    const std::vector<FLType *> &ResNum, const std::vector<FLType *> &ResDen,
+void VBM3D_Final_Process::CollaborativeFilter(int plane, Accumulator &acc,
     const std::vector<const FLType *> &src, const std::vector<const FLType *> &ref,
-    const Pos3PairCode &code) const
+    TransformCache *srcCache, TransformCache *refCache,
+    FLType *buffer, const Pos3PairCode &code) const
 {
     PCType GroupSize = static_cast<PCType>(code.size());
     // When para.GroupSize > 0, limit GroupSize up to para.GroupSize
@@ -58,72 +82,37 @@ void VBM3D_Final_Process::CollaborativeFilter(int plane,
     {
         GroupSize = d.para.GroupSize;
     }
+    // Haar and Walsh-Hadamard transforms only take power-of-2 sizes
+    GroupSize = d.f[plane].FitGroupSize(GroupSize);
 
-    // Construct source group and reference group guided by matched pos code
-    block_group srcGroup(src, src_stride[plane], code, GroupSize, d.para.BlockSize, d.para.BlockSize);
-    block_group refGroup(ref, ref_stride[plane], code, GroupSize, d.para.BlockSize, d.para.BlockSize);
-
-    // Initialize L2-norm of Wiener coefficients
-    FLType L2Wiener = 0;
-
-    // Apply forward 3D transform to the source group and the reference group
-    d.f[plane].fp[GroupSize - 1].execute_r2r(srcGroup.data(), srcGroup.data());
-    d.f[plane].fp[GroupSize - 1].execute_r2r(refGroup.data(), refGroup.data());
+    // Construct source group and reference group guided by matched pos code and apply forward 3D transform to them
+    block_group srcGroup = ForwardGroup(plane, buffer, src, src_stride[plane], srcCache, code, GroupSize);
+    block_group refGroup = ForwardGroup(plane, buffer + d.f[plane].GroupStride(d.para.GroupSize),
+        ref, ref_stride[plane], refCache, code, GroupSize);
 
     // Apply empirical Wiener filtering to the source group guided by the reference group
-    const FLType sigmaSquare = d.f[plane].wienerSigmaSqr[GroupSize - 1];
-
-    auto srcp = srcGroup.data();
-    auto refp = refGroup.data();
-    const auto upper = srcp + srcGroup.size();
-
-#if defined(__SSE2__)
-    static const ptrdiff_t simd_step = 4;
-    const ptrdiff_t simd_residue = srcGroup.size() % simd_step;
-    const ptrdiff_t simd_width = srcGroup.size() - simd_residue;
-
-    const __m128 sgm_sqr = _mm_set_ps1(sigmaSquare);
-    __m128 l2wiener_sum = _mm_setzero_ps();
-
-    for (const auto upper1 = srcp + simd_width; srcp < upper1; srcp += simd_step, refp += simd_step)
-    {
-        const __m128 s1 = _mm_load_ps(srcp);
-        const __m128 r1 = _mm_load_ps(refp);
-        const __m128 r1sqr = _mm_mul_ps(r1, r1);
-
-        const __m128 wiener = _mm_mul_ps(r1sqr, _mm_rcp_ps(_mm_add_ps(r1sqr, sgm_sqr)));
-
-        const __m128 d1 = _mm_mul_ps(s1, wiener);
-        _mm_store_ps(srcp, d1);
-        l2wiener_sum = _mm_add_ps(l2wiener_sum, _mm_mul_ps(wiener, wiener));
-    }
-
-    alignas(16) FLType l2wiener_sum_f32[4];
-    _mm_store_ps(l2wiener_sum_f32, l2wiener_sum);
-    L2Wiener += l2wiener_sum_f32[0] + l2wiener_sum_f32[1] + l2wiener_sum_f32[2] + l2wiener_sum_f32[3];
-#endif
-
-    for (; srcp < upper; ++srcp, ++refp)
-    {
-        const FLType refSquare = *refp * *refp;
-        const FLType wienerCoef = refSquare / (refSquare + sigmaSquare);
-        *srcp *= wienerCoef;
-        L2Wiener += wienerCoef * wienerCoef;
-    }
+    // and get the L2-norm of Wiener coefficients
+    const FLType sigmaSquare = d.f[plane].WienerSigmaSqr(GroupSize);
+    FLType L2Wiener = d.wiener_filter(srcGroup.data(), refGroup.data(), static_cast<PCType>(srcGroup.size()), sigmaSquare);
 
     // Apply backward 3D transform to the filtered group
-    d.f[plane].bp[GroupSize - 1].execute_r2r(srcGroup.data(), srcGroup.data());
+    d.f[plane].Backward(srcGroup.data(), GroupSize);
 
     // Calculate weight for the filtered group
     // Also include the normalization factor to compensate for the amplification introduced in 3D transform
     L2Wiener = Max(std::numeric_limits<float>::epsilon(), L2Wiener);
     FLType denWeight = FLType(1) / L2Wiener;
-    FLType numWeight = static_cast<FLType>(denWeight / d.f[plane].finalAMP[GroupSize - 1]);
+    FLType numWeight = static_cast<FLType>(denWeight / d.f[plane].FinalAMP(GroupSize));
 
     // Store the weighted filtered group to the numerator part of the final estimation
     // Store the weight to the denominator part of the final estimation
-    srcGroup.AddTo(ResNum, dst_stride[plane], numWeight);
-    srcGroup.CountTo(ResDen, dst_stride[plane], denWeight);
+    const PCType BlockPixels = d.para.BlockSize * d.para.BlockSize;
+
+    for (PCType z = 0; z < GroupSize; ++z)
+    {
+        const Pos3Type pos = srcGroup.GetPos3(z);
+        acc.Add(PosType(pos), srcGroup.data() + z * BlockPixels, d.para.BlockSize, numWeight, denWeight, pos.z);
+    }
 }
 
 
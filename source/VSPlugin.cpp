@@ -417,6 +417,21 @@ static void VS_CC VAggregate_Create(const VSMap *in, VSMap *out, void *userData,
 }
 
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// VapourSynth: bm3d.ArenaStats
+
+
+static void VS_CC ArenaStats_Create(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi)
+{
+    const auto usage = PlaneArena::Stats();
+
+    vsapi->mapSetInt(out, "in_use", static_cast<int64_t>(usage.in_use), maReplace);
+    vsapi->mapSetInt(out, "peak", static_cast<int64_t>(usage.peak), maReplace);
+    vsapi->mapSetInt(out, "reserved", static_cast<int64_t>(usage.reserved), maReplace);
+    vsapi->mapSetInt(out, "peak_reserved", static_cast<int64_t>(usage.peak_reserved), maReplace);
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // VapourSynth: plugin initialization
 
@@ -451,7 +466,14 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI
         "bm_step:int:opt;"
         "th_mse:float:opt;"
         "hard_thr:float:opt;"
-        "matrix:int:opt;",
+        "matrix:int:opt;"
+        "opt:int:opt;"
+        "bm_mode:int:opt;"
+        "dct_cache:int:opt;"
+        "group_transform:int:opt;"
+        "wisdom:data:opt;"
+        "plan_flags:int:opt;"
+        "threads:int:opt;",
         "clip:vnode;",
         BM3D_Basic_Create, nullptr, plugin);
 
@@ -466,7 +488,15 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI
         "bm_range:int:opt;"
         "bm_step:int:opt;"
         "th_mse:float:opt;"
-        "matrix:int:opt;",
+        "matrix:int:opt;"
+        "opt:int:opt;"
+        "bm_mode:int:opt;"
+        "dct_cache:int:opt;"
+        "group_transform:int:opt;"
+        "wisdom:data:opt;"
+        "plan_flags:int:opt;"
+        "wiener_mode:int:opt;"
+        "threads:int:opt;",
         "clip:vnode;",
         BM3D_Final_Create, nullptr, plugin);
 
@@ -486,7 +516,14 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI
         "ps_step:int:opt;"
         "th_mse:float:opt;"
         "hard_thr:float:opt;"
-        "matrix:int:opt;",
+        "matrix:int:opt;"
+        "opt:int:opt;"
+        "bm_mode:int:opt;"
+        "dct_cache:int:opt;"
+        "group_transform:int:opt;"
+        "wisdom:data:opt;"
+        "plan_flags:int:opt;"
+        "threads:int:opt;",
         "clip:vnode;",
         VBM3D_Basic_Create, nullptr, plugin);
 
@@ -505,7 +542,15 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI
         "ps_range:int:opt;"
         "ps_step:int:opt;"
         "th_mse:float:opt;"
-        "matrix:int:opt;",
+        "matrix:int:opt;"
+        "opt:int:opt;"
+        "bm_mode:int:opt;"
+        "dct_cache:int:opt;"
+        "group_transform:int:opt;"
+        "wisdom:data:opt;"
+        "plan_flags:int:opt;"
+        "wiener_mode:int:opt;"
+        "threads:int:opt;",
         "clip:vnode;",
         VBM3D_Final_Create, nullptr, plugin);
 
@@ -515,6 +560,14 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin* plugin, const VSPLUGINAPI
         "sample:int:opt;",
         "clip:vnode;",
         VAggregate_Create, nullptr, plugin);
+
+    vspapi->registerFunction("ArenaStats",
+        "",
+        "in_use:int;"
+        "peak:int;"
+        "reserved:int;"
+        "peak_reserved:int;",
+        ArenaStats_Create, nullptr, plugin);
 }
 
 